@@ -1,21 +1,109 @@
 #ifndef _CORE_H_
 #define _CORE_H_ /* _CORE_H_ */
 
-extern FILE *current_in, *current_out, *current_err;
-extern char* last_parse_error;
+#define ERROR_MESSAGE_MAX 256    /* longer messages are truncated */
 
-void type_error(char*, unsigned, char*);
-void lisp_error(char*);
+/* linterp: an interpreter instance. all state of the evaluator lives
+ * here, so that interpreters can run in parallel, each in its own OS
+ * thread. objects and the symbol table are shared among them. */
+typedef struct linterp
+{
+    /* registers */
+    lobj local_env, global_env, callstack, eax, unwind_protects;
+    int local_boundary;         /* a boundary is on top of local_env */
+    FILE *current_in, *current_out, *current_err;
+    struct input_buffer *inputs; /* see "input_getc" */
+
+    /* evaluator */
+    struct eval_session *current_session;
+    unsigned long session_count;
+    unsigned long stack_jumps;  /* callstack replaced other than by popping */
+    lobj escape_cont, escape_value, tail_call_proc, tail_call_args;
+    char* last_parse_error;
+
+    /* an error being raised, to be caught by the innermost ERRORBACK.
+     * NULL, or points error_buf. ERROR_KIND is its kind ("ERROR",
+     * "TYPE ERROR", ...). */
+    char *pending_error, *error_kind, error_buf[ERROR_MESSAGE_MAX];
+    int catching;               /* errors are always caught if non-0 */
+
+    /* scheduler of green threads */
+    lobj current_thread, run_queue, run_queue_last, io_waiters;
+
+    /* modules loaded with "require" */
+    struct module_node *loaded_modules;
+
+    lstats stats;
+    struct ltracer *tracer;     /* non-NULL while tracing */
+
+    struct linterp *next;       /* list of all interpreters */
+} linterp;
+
+/* the interpreter running on this OS thread */
+extern THREAD_LOCAL linterp* current_interp;
+
+#define current_in       (current_interp->current_in)
+#define current_out      (current_interp->current_out)
+#define current_err      (current_interp->current_err)
+#define last_parse_error (current_interp->last_parse_error)
+#define pending_error    (current_interp->pending_error)
+#define current_thread   (current_interp->current_thread)
+
+extern lsubr subr_wait_input;
+
+/* well-known symbols, interned only once (by "core_initialize") since
+ * "intern" takes a lock shared by all interpreters. SYM(EVAL) is the
+ * symbol "eval". */
+#define WELL_KNOWN_SYMBOLS(X)                   \
+    X(SELF, "self")                             \
+    X(EVAL, "eval")                             \
+    X(QUOTE, "quote")                           \
+    X(NIL, "nil")
+
+#define SYMBOL_ID(id, name) SYM_##id,
+enum { WELL_KNOWN_SYMBOLS(SYMBOL_ID) NUM_SYMBOLS };
+
+#define SYM(id) (well_known_symbols[SYM_##id])
+extern lobj well_known_symbols[NUM_SYMBOLS];
+
+linterp* interp_new();
+void interp_enter(linterp*);
+void interp_leave();
+void interp_free(linterp*);
+void interp_stats(lstats*);
+void stats_report(FILE*);
+
+void raise_error(char*, char*);
+lobj type_error(char*, unsigned, char*);
+lobj lisp_error(char*);
 void fatal(char*);
 
-lobj binding(lobj, int);
+int binding(lobj, int, lobj*);
 void bind(lobj, lobj, int);
 lobj save_current_env(int);
 void restore_current_env(lobj);
+lobj current_scope();
 void print(FILE*, lobj);
 void stack_dump(FILE*);
+void dump_trace();
+unsigned running_calls(lobj*, unsigned);
+lobj list_array(lobj);
+int read_eof();
 lobj read();
 lobj eval(lobj, lobj);
+lobj funcall(lobj, lobj);
+lobj tail_call(lobj, lobj);
+lobj call_errorback(lobj, char*);
+int escaping();
+lobj spawn(lobj, lobj);
+void channel_send(lobj, lobj);
+int threads_pending();
+int input_ready(FILE*);
+int input_buffered(FILE*);
+int input_getc(FILE*);
+int input_ungetc(int, FILE*);
+int input_eof(FILE*);
+void input_forget(FILE*);
 void core_initialize();
 
 #endif /* _CORE_H_ */
@@ -0,0 +1,74 @@
+#ifndef _GC_H_
+#define _GC_H_ /* _GC_H_ */
+
+/* gc_stats: counters of the collector, returned by "gc_get_stats".
+ * sizes are in bytes, and times are in microseconds. */
+typedef struct gc_stats
+{
+    unsigned long minor_count, major_count;
+    unsigned long heap_size, old_size, nursery_size;
+    unsigned long last_pause, max_pause, total_pause, pause_target;
+} gc_stats;
+
+/* --- allocation --- */
+
+void* gc_alloc(size_t);         /* zero-filled storage of a lisp object */
+void* gc_alloc_cons();           /* storage of a cons (see "philisp.h") */
+void gc_write_barrier(lobj);    /* call after storing an object into O */
+void gc_collect();              /* collect the whole heap now */
+
+/* --- roots --- */
+
+/* an object is live iff it is reachable from a root. roots are the
+ * stacks of OS threads (scanned conservatively), and the ones
+ * registered here. a scanner is a function which calls VISIT with
+ * each of its roots. */
+void gc_add_root(lobj*);
+void gc_add_root_scanner(void (*)(void (*visit)(lobj)));
+
+/* --- threads --- */
+
+/* a thread which blocks (on I/O, locks, ...) must tell the collector
+ * with "BLOCKING(stmt)", so that other threads can collect meanwhile.
+ * STMT must not touch any lisp objects. registers of the thread are
+ * saved to GC_CONTEXT on its stack, to be scanned. */
+#ifdef __GLIBC__
+#include <ucontext.h>           /* getcontext (setjmp mangles some registers) */
+typedef ucontext_t gc_context;
+#define GC_SAVE_CONTEXT(ctx) getcontext(&(ctx))
+#else
+#include <setjmp.h>             /* setjmp */
+typedef struct { jmp_buf regs; } gc_context;
+#define GC_SAVE_CONTEXT(ctx) setjmp((ctx).regs)
+#endif
+
+#define BLOCKING(stmt)                                                  \
+    do{                                                                 \
+        gc_context gc_context_;                                         \
+        int gc_state_;                                                  \
+        GC_SAVE_CONTEXT(gc_context_);                                   \
+        gc_state_ = gc_block();                                         \
+        stmt;                                                           \
+        gc_unblock(gc_state_);                                          \
+    }                                                                   \
+    while(0)
+
+int gc_block();
+void gc_unblock(int);
+
+/* the calling thread never collects nor waits for collections between
+ * these, but the heap may grow meanwhile. */
+void gc_disable();
+void gc_enable();
+
+/* --- statistics --- */
+
+void gc_get_stats(gc_stats*);
+void gc_set_pause_target(unsigned long);
+
+/* --- layout of objects (implemented in "philisp.c") --- */
+
+void lobj_trace(lobj, void (*visit)(lobj));
+void lobj_finalize(lobj);
+
+#endif /* _GC_H_ */
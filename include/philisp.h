@@ -8,12 +8,45 @@
 
 #define DEBUG           0    /* enable debug output */
 #define SYMBOL_NAME_MAX 50   /* maximum length of symbol name */
-#define GC_PROTECT_MAX  100  /* maximum number of protected objects */
+#define THREAD_LOCAL    __thread /* storage class of per-OS-thread variables */
+#define INLINE          __inline__ /* "inline", which C89 lacks */
 
 /* --- typedefs --- */
 
-/* lobj: lisp object */
-typedef struct lobj { unsigned mark : 1, type : 4; char data[1]; } *lobj;
+/* lobj: lisp object (FIXED objects are not in the heap of the GC) */
+typedef struct lobj { unsigned fixed : 1, type : 5; char data[1]; } *lobj;
+
+/* conses have no header, but are just two words (car and cdr). a
+ * pointer to a cons is tagged with CONS_TAG in its lowest bit, which
+ * is 0 in pointers to the other objects. */
+#define CONS_TAG 1
+
+/* type tags of lobj (the names are TYPE_NAMES) */
+
+#define TYPE_SYMB  0  /* symbol                                            */
+#define TYPE_CHAR  1  /* char                                              */
+#define TYPE_INT   2  /* int                                               */
+#define TYPE_FLOAT 3  /* float                                             */
+#define TYPE_STRM  4  /* stream (= FILE*)                                  */
+#define TYPE_CONS  5  /* cons         : lobj + lobj                        */
+#define TYPE_ARR   6  /* array        : length + (lobj, lobj, lobj, ...)   */
+#define TYPE_STR   7  /* (STRs are distinguished from ARRs INTERNALLY)     */
+#define TYPE_SUBR  8  /* C-function   : arity + lsubr                      */
+#define TYPE_FUNC  9  /* function     : formals + body + scope             */
+#define TYPE_CONT  10 /* continuation : call stack + winds + eval session  */
+#define TYPE_CLOS  11 /* closure      : function or subr + bindings        */
+#define TYPE_PA    12 /* partially applied function                        */
+#define TYPE_THRD  13 /* thread       : continuation + value + waiters     */
+#define TYPE_CHAN  14 /* channel      : queue of values + waiters          */
+#define TYPE_FUTR  15 /* future       : task + item + value                */
+#define TYPE_SCOP  16 /* scope        : info + parent + (symbol, value)... */
+#define TYPE_ENV   17 /* environment  : boundary + scope + global bindings */
+
+#define NUM_TYPES 18            /* number of type tags */
+#define TYPE_NIL  NUM_TYPES     /* "type" of NIL, which is not an object */
+
+/* tag of O to switch on, or TYPE_NIL */
+#define TYPE_OF(o) (!(o) ? TYPE_NIL : consp(o) ? TYPE_CONS : (int)(o)->type)
 
 /*
   pargs: procedure arguments
@@ -26,12 +59,28 @@ typedef int pargs;
 /* lsubr: C function that can be called from LISP world */
 typedef struct lsubr { pargs args; lobj (*function)(lobj); char* description; } lsubr;
 
-/* --- macros --- */
+/* lmodule: table of subrs exported from a shared library, loaded by
+ * "require". ENTRIES is terminated by an entry whose name is NULL,
+ * and INIT (if non-NULL) is called once after the subrs are bound. */
+typedef struct lmodule_entry { char* name; lsubr* subr; } lmodule_entry;
+typedef struct lmodule { lmodule_entry* entries; void (*init)(void); } lmodule;
+
+/* lstats: counters of an interpreter, always incremented on the fly
+ * (see "stats"). ALLOCS is indexed by type tags, named TYPE_NAMES. */
+typedef struct lstats
+{
+    unsigned long allocs[NUM_TYPES], alloc_bytes;
+    unsigned long evals, applies, rets; /* transitions of the evaluator */
+    unsigned long lookups, lookup_steps; /* calls of "binding", bindings scanned */
+    unsigned long captures;             /* continuations made */
+} lstats;
 
-extern unsigned int gc_protected, gc_protect_count;
+extern char* type_names[NUM_TYPES];
+
+/* --- macros --- */
 
-#define WITH_GC_PROTECTION()                                            \
-    for(gc_protected = 1; gc_protected; gc_protected = gc_protect_count = 0)
+/* counters of the interpreter on this OS thread, or NULL */
+extern THREAD_LOCAL lstats* current_stats;
 
 #define NIL NULL
 
@@ -104,10 +153,22 @@ extern unsigned int gc_protected, gc_protect_count;
 #define ARGS_PATRB2 ARGS_PATRA
 #define ARGS_PATRB3
 
+/* defmodule */
+
+/*
+  DEFMODULE(entries, init);
+  =
+  lmodule philisp_module = { entries, init };
+ */
+
+#define MODULE_SYMBOL "philisp_module"
+#define DEFMODULE(entries, init) lmodule philisp_module = { entries, init }
+
 /* --- lobj constructors --- */
 
 lobj symbol();
 lobj intern(char*);
+lobj intern_string(lobj);
 int rintern(lobj, char*, unsigned);
 lobj character(char);
 lobj integer(int);
@@ -117,32 +178,49 @@ lobj cons(lobj, lobj);
 lobj make_array(unsigned, lobj);
 lobj make_string(unsigned, char);
 lobj function(pargs, lobj, lobj);
+lobj lexical_function(pargs, lobj, lobj, lobj);
 lobj closure(lobj, lobj);
 lobj subr(lsubr);
-lobj continuation(lobj);
+lobj continuation(lobj, lobj, unsigned long, int);
 lobj pa(pargs, lobj);
+lobj thread(lobj, lobj, int);
+lobj channel();
+lobj future(void*, lobj);
+lobj scope(lobj, unsigned, int);
+lobj environment(lobj, lobj, int);
 
 /* utilities */
 
 lobj array(unsigned, ...);
 lobj string(char*);
+lobj substring(lobj, unsigned, unsigned); /* shares the chars */
 lobj list(unsigned, ...);
 
 /* --- type predicates --- */
 
-int symbolp(lobj);
-int characterp(lobj);
-int integerp(lobj);
-int floatingp(lobj);
-int streamp(lobj);
-int consp(lobj);
-int arrayp(lobj);
-int stringp(lobj); /* may transform an array into a string if proper */
-int functionp(lobj);
-int closurep(lobj);
-int subrp(lobj);
-int continuationp(lobj);
-int pap(lobj);
+/* predicates are inline functions, which evaluate O once */
+
+static INLINE int consp(lobj o) { return (int)((size_t)o & CONS_TAG); }
+static INLINE int header_typep(lobj o, int t) { return o && !consp(o) && o->type == t; }
+
+static INLINE int symbolp(lobj o)       { return header_typep(o, TYPE_SYMB); }
+static INLINE int characterp(lobj o)    { return header_typep(o, TYPE_CHAR); }
+static INLINE int integerp(lobj o)      { return header_typep(o, TYPE_INT); }
+static INLINE int floatingp(lobj o)     { return header_typep(o, TYPE_FLOAT); }
+static INLINE int streamp(lobj o)       { return header_typep(o, TYPE_STRM); }
+static INLINE int arrayp(lobj o)        { return header_typep(o, TYPE_ARR); }
+static INLINE int stringp(lobj o)       { return header_typep(o, TYPE_STR); }
+static INLINE int functionp(lobj o)     { return header_typep(o, TYPE_FUNC); }
+int lexicalp(lobj);
+static INLINE int closurep(lobj o)      { return header_typep(o, TYPE_CLOS); }
+static INLINE int subrp(lobj o)         { return header_typep(o, TYPE_SUBR); }
+static INLINE int continuationp(lobj o) { return header_typep(o, TYPE_CONT); }
+static INLINE int pap(lobj o)           { return header_typep(o, TYPE_PA); }
+static INLINE int threadp(lobj o)       { return header_typep(o, TYPE_THRD); }
+static INLINE int channelp(lobj o)      { return header_typep(o, TYPE_CHAN); }
+static INLINE int futurep(lobj o)       { return header_typep(o, TYPE_FUTR); }
+static INLINE int scopep(lobj o)        { return header_typep(o, TYPE_SCOP); }
+static INLINE int environmentp(lobj o)  { return header_typep(o, TYPE_ENV); }
 
 /* utilities */
 
@@ -160,24 +238,68 @@ void setcar(lobj, lobj);
 void setcdr(lobj, lobj);
 unsigned array_length(lobj);
 lobj* array_ptr(lobj);
-unsigned (*string_length)(lobj);
-char* (*string_ptr)(lobj);
+unsigned string_length(lobj);
+char* string_ptr(lobj);
+char* string_cstr(lobj);        /* terminated with '\0' */
+int string_view(lobj);          /* O is a substring */
+int string_shared(lobj);        /* O is or has substrings */
+lobj string_base(lobj);         /* the string O shares the chars of */
 void string_to_array(lobj);     /* transform a string into an array */
+int array_to_string(lobj);      /* transform an array of chars into a string */
+int string_interned(lobj);      /* interned strings are immutable */
+unsigned string_hash(lobj);
+int string_equal(lobj, lobj);
 pargs function_args(lobj);
 lobj function_formals(lobj);
 lobj function_expr(lobj);
-lobj (*closure_obj)(lobj);
-lobj (*closure_env)(lobj);
+lobj function_scope(lobj);
+lobj closure_obj(lobj);
+lobj closure_env(lobj);
 pargs subr_args(lobj);
 lobj (*subr_function(lobj))(lobj);
 char* subr_description(lobj);
 lobj continuation_callstack(lobj);
+lobj continuation_winds(lobj);
+unsigned long continuation_session(lobj);
+unsigned long continuation_stamp(lobj);
+void continuation_set_stamp(lobj, unsigned long);
+int continuation_escape(lobj);
+void continuation_set_escape(lobj, int);
 pargs pa_eval_pattern(lobj);
 lobj pa_function(lobj);
 void pa_set_function(lobj, lobj);
 lobj pa_values(lobj);
 int pa_num_values(lobj);
 void pa_push(lobj, lobj);
+lobj pa_copy(lobj);
+lobj thread_cont(lobj);
+lobj thread_value(lobj);
+lobj thread_waiters(lobj);
+int thread_state(lobj);
+void thread_set_cont(lobj, lobj);
+void thread_set_value(lobj, lobj);
+void thread_set_waiters(lobj, lobj);
+void thread_set_state(lobj, int);
+FILE** thread_ports(lobj);
+lobj channel_items(lobj);
+lobj channel_waiters(lobj);
+void channel_set_waiters(lobj, lobj);
+void channel_push(lobj, lobj);
+lobj channel_pop(lobj);
+void* future_task(lobj);
+lobj* future_ptr(lobj);
+lobj scope_parent(lobj);
+unsigned scope_count(lobj);
+int scope_boundary(lobj);
+int scope_kept(lobj);
+lobj* scope_slots(lobj);        /* (symbol, value) pairs, read-only */
+void scope_set(lobj, unsigned, lobj);
+int scope_push(lobj, lobj, lobj);
+void scope_share(lobj);
+void scope_keep(lobj);
+lobj environment_scope(lobj);
+lobj environment_globals(lobj);
+int environment_boundary(lobj);
 
 /* ---------------- ---------------- ---------------- ---------------- */
 #endif /* _PHILISP_H_ */
@@ -0,0 +1,11 @@
+#ifndef _POOL_H_
+#define _POOL_H_ /* _POOL_H_ */
+
+/* ltask: a unit of work run by the worker pool */
+typedef struct ltask ltask;
+
+void pool_map(lobj, lobj, lobj);
+lobj pool_future(lobj);
+lobj pool_touch(lobj);
+
+#endif /* _POOL_H_ */
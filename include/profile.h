@@ -0,0 +1,17 @@
+#ifndef _PROFILE_H_
+#define _PROFILE_H_ /* _PROFILE_H_ */
+
+#include <signal.h>             /* sig_atomic_t */
+
+/* set by the timer of the profiler. the evaluator takes a sample at
+ * the next PROFILE_POINT, since the signal handler cannot touch lisp
+ * objects. LEAF is the function being applied, or (). */
+extern volatile sig_atomic_t profile_pending;
+
+#define PROFILE_POINT(leaf) do{ if(profile_pending) profile_sample(leaf); } while(0)
+
+void profile_sample(lobj);
+int profile_start();
+long profile_stop(FILE*, int);
+
+#endif /* _PROFILE_H_ */
@@ -0,0 +1,42 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_ /* _TRACE_H_ */
+
+/* kinds of transitions of the evaluator */
+#define TRACE_EVAL 0            /* evaluate an expression */
+#define TRACE_RET  1            /* return an object to the caller frame */
+#define TRACE_EVLS 2            /* evaluate arguments of "evlis" */
+#define TRACE_CALL 3            /* apply a pa object */
+#define TRACE_SCHD 4            /* switch green threads */
+
+/* trace files start with a header, followed by COUNT records from
+ * the oldest one. (all in the native byte order) */
+#define TRACE_MAGIC   "PHTR"
+#define TRACE_VERSION 1
+
+#define TRACE_DEFAULT_SIZE 65536 /* records kept by default */
+
+typedef struct trace_header
+{
+    char magic[4];
+    unsigned version, record_size;
+    unsigned long count, dropped; /* records written, and overwritten */
+} trace_header;
+
+typedef struct trace_record
+{
+    unsigned long step;         /* transitions since the tracer started */
+    unsigned long time;         /* nanoseconds since the tracer started */
+    unsigned long expr;         /* address of the object in EAX */
+    unsigned depth;             /* number of frames in the callstack */
+    unsigned kind;
+} trace_record;
+
+/* ltracer: a ring buffer of records of an interpreter */
+typedef struct ltracer ltracer;
+
+ltracer* tracer_new(char*, unsigned);
+void tracer_free(ltracer*);
+void trace_point(ltracer*, unsigned, lobj, lobj);
+int trace_dump(ltracer*);
+
+#endif /* _TRACE_H_ */
@@ -1,74 +1,414 @@
+#define _POSIX_C_SOURCE 200112L /* fileno, poll */
+
 #include "philisp.h"
 #include "core.h"
+#include "subr.h"
+#include "gc.h"
+#include "profile.h"
+#include "trace.h"
 
-#include <stdlib.h>             /* exit */
+#include <stdlib.h>             /* exit, malloc, free */
 #include <ctype.h>              /* isspace */
-#include <string.h>             /* strchr */
+#include <string.h>             /* strchr, strncpy, memset */
+#include <pthread.h>            /* pthread_once */
+#ifndef _WIN32
+#include <poll.h>               /* poll */
+#include <sys/uio.h>            /* readv (the name "read" is taken) */
+#endif
 
 #define unused(var) (void)(var) /* suppress "unused variable" warning */
 
 /* + ENVIRONMENT    ---------------- */
 
-/* local_env  = '(<push here> (x . 1) ... NIL ... (y . 2) ... NIL ... (z . 3))
+/* local_env  = #<scope [(x . 1) ...] -> #<scope [...] -> ... -> ()>>
  * global_env = '(NIL <push here> (nil . ()) (t . t) (cons . #<subr cons>) ...)
- */
-lobj local_env, global_env, callstack, eax, unwind_protects;
-FILE *current_in, *current_out, *current_err;
+ *
+ * local bindings are in a chain of scopes (see "philisp.c"), divided
+ * into groups by boundaries. a boundary is pushed lazily: it is put
+ * on the next scope, when local_boundary is set. */
+THREAD_LOCAL linterp* current_interp = NULL;
+
+#define local_env       (current_interp->local_env)
+#define local_boundary  (current_interp->local_boundary)
+#define global_env      (current_interp->global_env)
+#define callstack       (current_interp->callstack)
+#define eax             (current_interp->eax)
+#define unwind_protects (current_interp->unwind_protects)
+#define stack_jumps     (current_interp->stack_jumps)
+
+#define SCOPE_SLOTS 4           /* bindings in a scope made by "bind" */
+
+/* each call of "eval" runs a session, which saves registers of the
+ * caller and restores them on exit. so subrs can call "eval"
+ * recursively without breaking the callstack. */
+typedef struct eval_session eval_session;
+struct eval_session
+{
+    unsigned long id;
+    lobj saved_callstack, saved_eax, saved_local_env, saved_global_env,
+        saved_unwind_protects;  /* registers of the caller */
+    int saved_local_boundary;
+    lobj errorback;             /* applied to errors not caught inside */
+    eval_session *prev;
+};
+
+#define current_session (current_interp->current_session)
+#define session_count   (current_interp->session_count)
+
+/* session ids are unique in the process, so that continuations of
+ * other interpreters are never taken for ones of this. interpreters
+ * reserve ids in blocks of SESSION_ID_BLOCK. */
+#define SESSION_ID_BLOCK 65536
+
+unsigned long session_id_blocks = 0;
+pthread_mutex_t session_id_lock = PTHREAD_MUTEX_INITIALIZER;
+
+unsigned long new_session_id()
+{
+    if(session_count % SESSION_ID_BLOCK == 0)
+    {
+        pthread_mutex_lock(&session_id_lock);
+        session_count = session_id_blocks++ * SESSION_ID_BLOCK;
+        pthread_mutex_unlock(&session_id_lock);
+    }
+
+    return ++session_count;
+}
 
-/* search for a binding of O. returns binding, or () if unbound. if
- * LOCAL is non-0, search only before a boundary. */
-lobj binding(lobj o, int local)
+/* a continuation of an outer session called in an inner session, and
+ * its argument. inner sessions return immediately while this is set. */
+#define escape_cont  (current_interp->escape_cont)
+#define escape_value (current_interp->escape_value)
+
+/* an application requested by a subr, to be applied by "eval" in
+ * place of the subr's return value. */
+#define tail_call_proc (current_interp->tail_call_proc)
+#define tail_call_args (current_interp->tail_call_args)
+
+/* function of pa objects in frames made by "evlis" (resp.
+ * "unwind-protect", "eval" with ERRORBACK, the bottom of threads). */
+lobj evlis_marker, unwind_marker, catch_marker, thread_marker;
+
+lobj well_known_symbols[NUM_SYMBOLS];
+
+/* a frame in callstack is [pa, pending_args, scope, share, globals,
+ * boundary]. SCOPE, GLOBALS and BOUNDARY (() or frame_boundary) are
+ * the registers of bindings when the frame is pushed, restored when
+ * the frame gets a value. they are kept as is rather than in an
+ * environment object, which is made only when captured. frames
+ * may be shared with continuations, and they are copied before
+ * modified if so (copy-on-write). to make capturing O(1), SHARE is
+ * set lazily: frame_shared means the frame and all frames below are
+ * shared, and frame_below_shared means only frames below are. when a
+ * frame with non-() SHARE is popped, the next frame gets
+ * frame_shared. */
+lobj frame_shared, frame_below_shared, frame_boundary;
+
+#define FRAME_SIZE 6
+
+/* make a frame of PA and PENDING with SIZE (FRAME_SIZE or more) slots,
+ * saving the current bindings. like "save_current_env", a boundary is
+ * put on the current local bindings. */
+lobj make_frame(unsigned size, lobj pa, lobj pending)
 {
-    lobj env;
+    lobj o = make_array(size, NIL), *ptr = array_ptr(o);
 
-    for(env = local_env; env; env = cdr(env))
-        if(!car(env) && local)
-            return NIL;
-        else if(car(env) && car(car(env)) == o)
-            return car(env);
+    ptr[0] = pa, ptr[1] = pending;
+    ptr[2] = local_env, ptr[4] = global_env;
+    ptr[5] = local_boundary ? frame_boundary : NIL;
+
+    if(local_env)
+        scope_share(local_env);
+    local_boundary = 1;
+
+    return o;
+}
+
+/* restore the bindings saved in FRAME */
+void restore_frame_env(lobj frame)
+{
+    lobj *ptr = array_ptr(frame);
+
+    local_env = ptr[2], global_env = ptr[4], local_boundary = ptr[5] != NIL;
+}
+
+#define PUSH_FRAME(pa, pending)                                         \
+    callstack = cons(make_frame(FRAME_SIZE, pa, pending), callstack)
+
+void pop_frame()
+{
+    lobj share = array_ptr(car(callstack))[3];
+
+    if((callstack = cdr(callstack)) && share)
+        array_ptr(car(callstack))[3] = frame_shared;
+}
+
+/* make a private copy of the top frame */
+void unshare_frame()
+{
+    lobj o = car(callstack), *ptr;
+    unsigned ix;
+
+    ptr = array_ptr(o = make_array(array_length(o), NIL));
+
+    for(ix = 0; ix < array_length(o); ix++)
+        ptr[ix] = array_ptr(car(callstack))[ix];
+
+    if(ptr[0])
+        ptr[0] = pa_copy(ptr[0]);
+    ptr[3] = frame_below_shared;
+
+    callstack = cons(o, cdr(callstack));
+}
+
+/* an escape-only continuation (made by "call-ec") points a frame
+ * [pa(ec_marker, k), (), ...], and is live while the frame is
+ * on the stack. calling it just pops frames above. it is expired when
+ * the frame is popped by returning or escaping, so the frame is
+ * searched for only if the callstack has been replaced in other ways
+ * (by full continuations, thread switches, ...) since its STAMP. */
+lobj ec_marker;
+
+#define ESCAPE_LIVE    1
+#define ESCAPE_EXPIRED 2
+
+/* non-0 iff escape-only continuation K can be called from the
+ * current callstack. */
+int escape_live(lobj k)
+{
+    lobj stack;
+
+    if(continuation_escape(k) != ESCAPE_LIVE)
+        return 0;
+    else if(continuation_stamp(k) == stack_jumps)
+        return 1;
+
+    for(stack = callstack; stack; stack = cdr(stack))
+        if(stack == continuation_callstack(k))
+        {
+            continuation_set_stamp(k, stack_jumps);
+            return 1;
+        }
+
+    continuation_set_escape(k, ESCAPE_EXPIRED);
+
+    return 0;
+}
+
+/* expire escape-only continuations of frames from STACK to BOTTOM
+ * (exclusive), which are popped at once */
+void expire_escapes(lobj stack, lobj bottom)
+{
+    lobj o;
+
+    for(; stack && stack != bottom; stack = cdr(stack))
+        if((o = array_ptr(car(stack))[0]) && pa_function(o) == ec_marker)
+            continuation_set_escape(car(pa_values(o)), ESCAPE_EXPIRED);
+}
+
+/* unwind_protects is the chain of frames of "unwind-protect" whose
+ * BODY is being evaluated, innermost first. such a frame is
+ * [pa, (AFTER), ..., depth], where DEPTH is the length of the chain
+ * from the frame. */
+#define WIND_DEPTH(winds) ((winds) ? integer_value(array_ptr(car(winds))[FRAME_SIZE]) : 0)
+
+/* return the innermost frame in the chain FROM which is left when
+ * jumping to the chain TO, or () if nothing is left. */
+lobj crossed_wind(lobj from, lobj to)
+{
+    int df = WIND_DEPTH(from), dt = WIND_DEPTH(to);
+
+    if(!from || df > dt)
+        return from;
+
+    while(dt-- > df)
+        to = cdr(to);
+
+    return from == to ? NIL : from;
+}
+
+/* search for a binding of O. returns the scope which has the binding
+ * (and set *IX to the slot), the pair (O . value) of a global
+ * binding, or () if unbound. if LOCAL is non-0, search only before a
+ * boundary. */
+lobj lookup(lobj o, int local, unsigned* ix)
+{
+    lobj s, env, *slots;
+    unsigned long steps = 0;
+    unsigned n, i;
+
+    if(!(local && local_boundary))
+        for(s = local_env; s; s = scope_parent(s))
+        {
+            for(slots = scope_slots(s), n = scope_count(s), i = 0; i < n; i++)
+                if(slots[2 * i] == o)
+                {
+                    current_interp->stats.lookups++;
+                    current_interp->stats.lookup_steps += steps + i + 1;
+                    *ix = i;
+                    return s;
+                }
+
+            steps += n;
+
+            if(local && scope_boundary(s))
+                break;
+        }
 
     if(!local)
-        for(env = cdr(global_env); env; env = cdr(env))
+        for(env = cdr(global_env); env; env = cdr(env), steps++)
             if(car(car(env)) == o)
+            {
+                current_interp->stats.lookups++;
+                current_interp->stats.lookup_steps += steps + 1;
                 return car(env);
+            }
+
+    current_interp->stats.lookups++;
+    current_interp->stats.lookup_steps += steps;
 
     return NIL;
 }
 
+/* search for a binding of O, and store its value to *VALUE. return 0
+ * if unbound. if LOCAL is non-0, search only before a boundary. */
+int binding(lobj o, int local, lobj* value)
+{
+    unsigned ix;
+    lobj b = lookup(o, local, &ix);
+
+    if(!b)
+        return 0;
+
+    *value = scopep(b) ? scope_slots(b)[2 * ix + 1] : cdr(b);
+
+    return 1;
+}
+
 /* if binding of O is found, modify the binding. otherwise add a new
  * global binding of O. if LOCAL is non-0, search binding only BEFORE
  * A BOUNDARY, and add a local binding instead. */
 void bind(lobj o, lobj value, int local)
 {
-    lobj b;
+    unsigned ix;
+    lobj b = lookup(o, local, &ix);
 
-    if((b = binding(o, local)))
+    if(b && scopep(b))
+        scope_set(b, ix, value);
+    else if(b)
         setcdr(b, value);
     else if(local)
-        WITH_GC_PROTECTION()
-            local_env = cons(cons(o, value), local_env);
+    {
+        if(local_boundary || !local_env || !scope_push(local_env, o, value))
+        {
+            local_env = scope(local_env, SCOPE_SLOTS, local_boundary);
+            scope_push(local_env, o, value);
+            local_boundary = 0;
+        }
+    }
     else
-        WITH_GC_PROTECTION()
-            setcdr(global_env, cons(cons(o, value), cdr(global_env)));
+        setcdr(global_env, cons(cons(o, value), cdr(global_env)));
+}
+
+#define GROUP_COPIES_MAX 8      /* bindings copied into a new group */
+
+/* non-0 iff symbol O is "self" or one of FORMALS (a list, possibly
+ * dotted) */
+int shadowed(lobj o, lobj formals)
+{
+    if(o == SYM(SELF))
+        return 1;
+
+    for(; consp(formals); formals = cdr(formals))
+        if(car(formals) == o)
+            return 1;
+
+    return formals == o;
+}
+
+/* start a new group of local bindings for a function with FORMALS,
+ * with room for SIZE bindings.
+ *
+ * the group on top, of the caller, is dropped if nothing in the
+ * function can see it: if all bindings in it are shadowed by FORMALS,
+ * or if it is dead (not kept, and not referred by the top frame, i.e.
+ * the call is a tail call) in which case the bindings not shadowed
+ * are copied into the new group. so tail-recursive loops run in
+ * constant space, and lookups do not slow down as they go.
+ * (continuations captured before see the dropped group, without
+ * changes made to the copies.) */
+void push_group(lobj formals, unsigned size)
+{
+    lobj s, o, below = NIL, referred = NIL;
+    unsigned ix, copies = 0;
+    int live = 0;
+
+    if(callstack)
+        referred = array_ptr(car(callstack))[2];
+
+    if(!local_boundary)
+        for(s = local_env; s; s = scope_parent(s))
+        {
+            live = live || s == referred || scope_kept(s);
+
+            for(ix = 0; ix < scope_count(s); ix++)
+                copies += !shadowed(scope_slots(s)[2 * ix], formals);
+
+            if(scope_boundary(s))
+            {
+                below = scope_parent(s);
+                break;
+            }
+        }
+
+    if(local_boundary || (copies && (live || copies > GROUP_COPIES_MAX)))
+        below = local_env, copies = 0;
+
+    o = scope(below, size + copies, 1);
+
+    /* names are unique in a group, since "bind" searches it first */
+    for(s = local_env; copies; s = scope_parent(s))
+        for(ix = 0; ix < scope_count(s); ix++)
+            if(!shadowed(scope_slots(s)[2 * ix], formals))
+                scope_push(o, scope_slots(s)[2 * ix], scope_slots(s)[2 * ix + 1]), copies--;
+
+    local_env = o, local_boundary = 0;
+}
+
+/* the current local scope, to be referred from outside of the
+ * callstack */
+lobj current_scope()
+{
+    if(local_env)
+        scope_keep(local_env);
+
+    return local_env;
 }
 
+/* make an environment of the current bindings. if LOCAL is non-0, the
+ * environment shares global bindings with the current one, and a
+ * boundary is put on the current local bindings. otherwise, global
+ * bindings made later are not shared between them. */
 lobj save_current_env(int local)
 {
     lobj o;
 
-    local_env = cons(NIL, local_env);
-
     if(local)
-        return cons(local_env, global_env);
-    else
     {
-        WITH_GC_PROTECTION()
-            o = cons(local_env, cons(NIL, cdr(global_env)));
-        return o;
+        o = environment(local_env, global_env, local_boundary);
+        local_boundary = 1;
     }
+    else
+        o = environment(current_scope(), cons(NIL, cdr(global_env)), local_boundary);
+
+    return o;
 }
 
-void restore_current_env(lobj env) { local_env = cdr(car(env)), global_env = cdr(env); }
+void restore_current_env(lobj env)
+{
+    local_env = environment_scope(env), global_env = environment_globals(env);
+    local_boundary = environment_boundary(env);
+}
 
 /* + UTILITIES      ---------------- */
 
@@ -88,20 +428,36 @@ lobj list_array(lobj lst)
     return o;
 }
 
-void stack_dump(FILE* stream)
+/* non-0 iff T, the pa object of a frame, is made by the evaluator
+ * for itself */
+int internal_pa(lobj t)
 {
-    lobj stack, t;
-    unsigned level = 0, i;
+    lobj f = pa_function(t);
 
-    for(stack = callstack; stack; stack = cdr(stack))
+    return f == evlis_marker || f == unwind_marker || f == catch_marker
+        || f == ec_marker || f == thread_marker;
+}
+
+/* dump frames in STACK, indented from LEVEL, except internal
+ * ones. returns the next level. */
+unsigned stack_dump_(FILE* stream, lobj stack, unsigned level)
+{
+    lobj t;
+    unsigned i;
+
+    for(; stack; stack = cdr(stack))
     {
+        if((t = array_ptr(car(stack))[0]) && pap(t) && internal_pa(t))
+            continue;
+
         for(i = 0; i < level; i++) fprintf(stream, "  ");
         fprintf(stream, "> in expression ");
         level++;
 
         putc('(', stream);
 
-        if(pap(t = array_ptr(car(stack))[0]))
+        t = array_ptr(car(stack))[0];
+        if(pap(t))
         {
             print(stream, pa_function(t)), putc(' ', stream);
 
@@ -116,30 +472,152 @@ void stack_dump(FILE* stream)
 
         fprintf(stream, ")\n");
     }
+
+    return level;
 }
 
-/* *TODO* IMPLEMENT ERROR HANDLER */
+/* the function bound to "self" in the innermost scope from S, i.e.
+ * the function whose invocation S belongs to, or (). *INVOCATION is
+ * set to the scope of the binding, which tells invocations apart. */
+lobj scope_self(lobj s, lobj* invocation)
+{
+    unsigned i;
+
+    for(; s; s = scope_parent(s))
+        for(i = 0; i < scope_count(s); i++)
+            if(scope_slots(s)[2 * i] == SYM(SELF))
+            {
+                *invocation = s;
+                return scope_slots(s)[2 * i + 1];
+            }
 
-void type_error(char* name, unsigned ix, char* expected)
+    return NIL;
+}
+
+/* store lisp functions being run in the current session and outer
+ * sessions to BUF, from the innermost one. a function runs from when
+ * its body is evaluated until it returns, and is found from the
+ * environments of the evaluator and of the frames (calls still
+ * evaluating their arguments are not running). return the number of
+ * them stored (at most SIZE). */
+unsigned running_calls(lobj* buf, unsigned size)
 {
-    fprintf(current_err,
-            "TYPE ERROR: %d-th arg for %s is not a %s\n",
-            ix, name, expected);
-    stack_dump(current_err);
-    exit(1);
+    eval_session *s = current_session;
+    lobj stack = callstack, scope = local_env, fn, invocation, last = NIL;
+    unsigned n = 0;
+
+    for(;;)
+    {
+        if((fn = scope_self(scope, &invocation)) && invocation != last)
+            buf[n++] = fn, last = invocation;
+
+        while(!stack && s)
+            stack = s->saved_callstack, s = s->prev;
+
+        if(n == size || !stack)
+            return n;
+
+        scope = array_ptr(car(stack))[2];
+        stack = cdr(stack);
+    }
+}
+
+/* dump frames of the current session, then of outer sessions. */
+void stack_dump(FILE* stream)
+{
+    eval_session *s;
+    unsigned level = stack_dump_(stream, callstack, 0);
+
+    for(s = current_session; s; s = s->prev)
+        level = stack_dump_(stream, s->saved_callstack, level);
 }
 
-void lisp_error(char* msg)
+/* write the trace of the current interpreter, if traced */
+void dump_trace()
 {
-    fprintf(current_err, "ERROR: %s\n", msg);
-    stack_dump(current_err);
-    exit(1);
+    if(current_interp && current_interp->tracer && trace_dump(current_interp->tracer))
+        fprintf(current_err, "failed to write the trace.\n");
+}
+
+/* the innermost frame of "eval" with ERRORBACK in STACK, or () */
+lobj catch_frame(lobj stack)
+{
+    lobj t;
+
+    for(; stack; stack = cdr(stack))
+    {
+        t = array_ptr(car(stack))[0];
+        if(pap(t) && pa_function(t) == catch_marker)
+            return stack;
+    }
+
+    return NIL;
+}
+
+/* non-0 iff an error raised here is caught by some ERRORBACK */
+int error_caught()
+{
+    eval_session *s;
+
+    if(current_interp->catching || catch_frame(callstack))
+        return 1;
+
+    for(s = current_session; s; s = s->prev)
+        if(s->errorback || catch_frame(s->saved_callstack))
+            return 1;
+
+    return 0;
+}
+
+/* raise an error with message MSG. the evaluator unwinds to the
+ * innermost ERRORBACK, or to the caller of the outermost session, so
+ * callers of this must return immediately (subrs may return the value
+ * of this, which is always ()). errors not caught are reported here,
+ * while the callstack is still alive. */
+void raise_error(char* kind, char* msg)
+{
+    if(pending_error)           /* keep the first one */
+        return;
+
+    if(msg != current_interp->error_buf)
+    {
+        strncpy(current_interp->error_buf, msg, ERROR_MESSAGE_MAX - 1);
+        current_interp->error_buf[ERROR_MESSAGE_MAX - 1] = '\0';
+    }
+    pending_error = current_interp->error_buf;
+    current_interp->error_kind = kind;
+
+    if(!error_caught())
+    {
+        fprintf(current_err, "%s: %s\n", kind, pending_error);
+        stack_dump(current_err);
+        dump_trace();
+    }
+}
+
+lobj type_error(char* name, unsigned ix, char* expected)
+{
+    char msg[ERROR_MESSAGE_MAX];
+
+    sprintf(msg, "%d-th arg for %.100s is not a %.100s", ix, name, expected);
+    raise_error("TYPE ERROR", msg);
+
+    return NIL;
+}
+
+lobj lisp_error(char* msg)
+{
+    raise_error("ERROR", msg);
+    return NIL;
 }
 
+/* errors which leave the process inconsistent terminate it */
+
 void fatal(char* msg)
 {
     fprintf(current_err, "FATAL: %s\n", msg);
     stack_dump(current_err);
+    dump_trace();
     exit(1);
 }
 
@@ -168,36 +646,41 @@ void put_literal_char(FILE* stream, char ch)
 
 void print(FILE* stream, lobj o)
 {
-    if(!o)
+    switch(TYPE_OF(o))
+    {
+      case TYPE_NIL:
         fprintf(stream, "()");
+        break;
 
-    else if (symbolp(o))
-    {
-        static char buf[SYMBOL_NAME_MAX + 1];
+      case TYPE_SYMB:
+        {
+            char buf[SYMBOL_NAME_MAX + 1];
 
-        if(!rintern(o, buf, SYMBOL_NAME_MAX + 1))
-            fprintf(stream, buf);
-        else
-            fprintf(stream, "#<symbol %p>", (void*)o);
-    }
+            if(!rintern(o, buf, SYMBOL_NAME_MAX + 1))
+                fprintf(stream, buf);
+            else
+                fprintf(stream, "#<symbol %p>", (void*)o);
+            break;
+        }
 
-    else if(characterp(o))
-    {
+      case TYPE_CHAR:
         putc('?', stream);
         put_literal_char(stream, character_value(o));
-    }
+        break;
 
-    else if(integerp(o))
+      case TYPE_INT:
         fprintf(stream, "%d", integer_value(o));
+        break;
 
-    else if(floatingp(o))
+      case TYPE_FLOAT:
         fprintf(stream, "%f", floating_value(o));
+        break;
 
-    else if(streamp(o))
+      case TYPE_STRM:
         fprintf(stream, "#<stream %p>", (void*)o);
+        break;
 
-    else if(consp(o))
-    {
+      case TYPE_CONS:
         putc('(', stream);
         while(1)
         {
@@ -224,119 +707,288 @@ void print(FILE* stream, lobj o)
                 o = cdr(o);
             }
         }
-    }
-
-    else if(stringp(o))
-    {
-        unsigned len = string_length(o);
-        char *ptr = string_ptr(o);
+        break;
 
-        putc('\"', stream);
-
-        for(; len--; ptr++)
-            put_literal_char(stream, *ptr);
+      case TYPE_ARR:
+        {
+            lobj *arr = array_ptr(o);
+            unsigned len = array_length(o), ix;
 
-        putc('\"', stream);
-    }
+            /* an array of chars is printed as a string, but not
+             * transformed into one */
+            for(ix = 0; ix < len && characterp(arr[ix]); ix++)
+                ;
 
-    else if(arrayp(o))
-    {
-        lobj *arr = array_ptr(o);
-        unsigned len = array_length(o);
+            if(ix == len)
+            {
+                putc('\"', stream);
+                for(ix = 0; ix < len; ix++)
+                    put_literal_char(stream, character_value(arr[ix]));
+                putc('\"', stream);
+                break;
+            }
 
-        putc('[', stream);
-        if(len >= 1)
-        {
-            while(len-- > 1)
+            putc('[', stream);
+            if(len >= 1)
             {
-                print(stream, *(arr++));
-                putc(' ', stream);
+                while(len-- > 1)
+                {
+                    print(stream, *(arr++));
+                    putc(' ', stream);
+                }
+                print(stream, *arr);
             }
-            print(stream, *arr);
+            putc(']', stream);
+            break;
         }
-        putc(']', stream);
-    }
 
-    else if(functionp(o))
-    {
-        lobj expr = function_expr(o);
-        pargs args = function_args(o);
+      case TYPE_STR:
+        {
+            unsigned len = string_length(o);
+            char *ptr = string_ptr(o);
+
+            putc('\"', stream);
 
-        fprintf(stream, "#<func:%d%s ", args & 255, args & 256 ? "+" : "");
+            for(; len--; ptr++)
+                put_literal_char(stream, *ptr);
 
-        if(consp(expr))
+            putc('\"', stream);
+            break;
+        }
+
+      case TYPE_FUNC:
         {
-            fprintf(stream, "(");
+            lobj expr = function_expr(o);
+            pargs args = function_args(o);
+
+            fprintf(stream, "#<%s:%d%s ", lexicalp(o) ? "lfn" : "func",
+                    args & 255, args & 256 ? "+" : "");
+
+            if(consp(expr))
+            {
+                fprintf(stream, "(");
+
+                if(consp(car(expr)))
+                    fprintf(stream, "(...)");
+                else if(arrayp(car(expr)))
+                    fprintf(stream, "[...]");
+                else
+                    print(stream, car(expr));
 
-            if(consp(car(expr)))
-                fprintf(stream, "(...)");
-            else if(arrayp(car(expr)))
+                fprintf(stream, " ...)");
+            }
+            else if(arrayp(expr))
                 fprintf(stream, "[...]");
             else
-                print(stream, car(expr));
+                print(stream, expr);
 
-            fprintf(stream, " ...)");
+            putc('>', stream);
+            break;
         }
-        else if(arrayp(expr))
-            fprintf(stream, "[...]");
-        else
-            print(stream, expr);
-
-        putc('>', stream);
-    }
 
-    else if(closurep(o))
-    {
+      case TYPE_CLOS:
         fprintf(stream, "#<closure ");
         print(stream, closure_obj(o));
         putc('>', stream);
-    }
+        break;
 
-    else if(subrp(o))
-    {
-        pargs args = subr_args(o);
-        fprintf(stream, "#<subr:%d%s %s>",
-                args & 255, args & 256 ? "+" : "", subr_description(o));
-    }
+      case TYPE_SUBR:
+        {
+            pargs args = subr_args(o);
+            fprintf(stream, "#<subr:%d%s %s>",
+                    args & 255, args & 256 ? "+" : "", subr_description(o));
+            break;
+        }
 
-    else if(continuationp(o))
-        fprintf(stream, "#<cont:1 %p>", (void*)o);
+      case TYPE_CONT:
+        fprintf(stream, continuation_escape(o) ? "#<escape:1 %p>" : "#<cont:1 %p>", (void*)o);
+        break;
 
-    else if(pap(o))
-    {
+      case TYPE_PA:
         fprintf(stream, "#<func (pa:");
         print(stream, pa_function(o));
         fprintf(stream, "/%d)>", pa_num_values(o));
-    }
+        break;
 
-    else
+      case TYPE_THRD: case TYPE_CHAN: case TYPE_FUTR: case TYPE_SCOP: case TYPE_ENV:
+        fprintf(stream, "#<%s %p>", type_names[o->type], (void*)o);
+        break;
+
+      default:
         fprintf(stream, "#<broken object?>");
+    }
 
     fflush(stream);
 }
 
 /* + PARSER         ---------------- */
 
-int read_char()
-{
-    int ch;
-    while(isspace((ch = getc(current_in))));
-    return ch;
-}
+/* streams with file descriptors are read through buffers of our own,
+ * not of stdio, so that the scheduler can tell whether a character
+ * is available without blocking. each interpreter has its own
+ * buffers, so a stream must not be read by two interpreters. streams
+ * without descriptors (e.g. "fmemopen") are read with stdio. */
 
-/* like getchar but aware of escape-sequence. if the char is endchar,
- * return -2. if failed to parse, return -3. */
-int get_literal_char(int endchar)
+#define INPUT_BUFFER_SIZE 4096
+
+typedef struct input_buffer
 {
-    int ch = getc(current_in);
+    FILE* f;
+    int fd;
+    unsigned pos, len;
+    int eof;                    /* the last read returned nothing */
+    struct input_buffer* next;
+    char buf[INPUT_BUFFER_SIZE];
+} input_buffer;
+
+#define input_buffers   (current_interp->inputs)
+
+/* the buffer for F (NULL if F has no descriptor), moved to the front
+ * of input_buffers so that the stream being read is found first. */
+input_buffer* input_buffer_of(FILE* f)
+{
+  #ifndef _WIN32
+    input_buffer **p, *b;
 
-    if(ch == endchar)
-        return -2;
-    else if(ch != '\\')
-        return ch;
+    if(input_buffers && input_buffers->f == f)
+        return input_buffers;
+
+    for(p = &input_buffers; *p && (*p)->f != f; p = &(*p)->next);
+
+    if((b = *p))
+        *p = b->next;
+    else if(fileno(f) < 0)
+        return NULL;
+    else if(!(b = (input_buffer*)malloc(sizeof(input_buffer))))
+        fatal("failed to allocate memory.");
     else
-    {
-        ch = getc(current_in);
+        b->f = f, b->fd = fileno(f), b->pos = b->len = 0, b->eof = 0;
+
+    b->next = input_buffers, input_buffers = b;
+
+    return b;
+  #endif
+  #ifdef _WIN32
+    unused(f);
+    return NULL;
+  #endif
+}
+
+/* forget the buffer for F, which is about to be closed. characters
+ * left in the buffer are discarded. */
+void input_forget(FILE* f)
+{
+    input_buffer **p, *b;
+
+    for(p = &input_buffers; *p && (*p)->f != f; p = &(*p)->next);
+
+    if((b = *p))
+        *p = b->next, free(b);
+}
+
+/* getc, letting other OS threads collect while waiting for input */
+int input_getc(FILE* f)
+{
+    input_buffer* b;
+
+    if(!(b = input_buffer_of(f)))
+        return getc(f);         /* not backed by a descriptor */
+
+    if(b->pos < b->len)
+        return (unsigned char)b->buf[b->pos++];
+
+  #ifndef _WIN32
+    {
+        struct iovec v;
+        ssize_t n;
+
+        v.iov_base = b->buf, v.iov_len = INPUT_BUFFER_SIZE;
+        fflush(stdout);         /* show the prompt before waiting */
+        BLOCKING(n = readv(b->fd, &v, 1));
+
+        b->pos = 0, b->len = n > 0 ? (unsigned)n : 0, b->eof = n <= 0;
+    }
+  #endif
+
+    return b->len ? (unsigned char)b->buf[b->pos++] : EOF;
+}
+
+/* ungetc for streams read with "input_getc". return CH, or EOF on
+ * failure. */
+int input_ungetc(int ch, FILE* f)
+{
+    input_buffer* b;
+
+    if(!(b = input_buffer_of(f)))
+        return ungetc(ch, f);
+
+    if(ch == EOF || (!b->pos && b->len == INPUT_BUFFER_SIZE))
+        return EOF;
+
+    if(!b->pos)                 /* nothing read from this buffer yet */
+        memmove(b->buf + 1, b->buf, b->len), b->pos++, b->len++;
+
+    b->buf[--b->pos] = (char)ch, b->eof = 0;
+
+    return ch;
+}
+
+/* non-0 iff the last "input_getc" on F reached the end of input. */
+int input_eof(FILE* f)
+{
+    input_buffer* b;
+
+    if(!(b = input_buffer_of(f)))
+        return feof(f);
+
+    return b->eof && b->pos == b->len;
+}
+
+/* non-0 iff a character can be read from F without blocking on its
+ * descriptor: it is buffered, or F has no descriptor. */
+int input_buffered(FILE* f)
+{
+    input_buffer* b;
+
+    return !(b = input_buffer_of(f)) || b->pos < b->len;
+}
+
+int read_char()
+{
+    int ch;
+    while(isspace((ch = input_getc(current_in))));
+    return ch;
+}
+
+/* skip whitespaces and comments, and return non-0 iff current_in
+ * reaches EOF before the next expression. */
+int read_eof()
+{
+    int ch;
+
+    while((ch = read_char()) == ';')
+        while((ch = input_getc(current_in)) != '\n' && ch != EOF);
+
+    if(ch == EOF)
+        return 1;
+
+    input_ungetc(ch, current_in);
+    return 0;
+}
+
+/* like getchar but aware of escape-sequence. if the char is endchar,
+ * return -2. if failed to parse, return -3. */
+int get_literal_char(int endchar)
+{
+    int ch = input_getc(current_in);
+
+    if(ch == endchar)
+        return -2;
+    else if(ch != '\\')
+        return ch;
+    else
+    {
+        ch = input_getc(current_in);
 
         /* octal constant */
         if('0' <= ch && ch <= '8')
@@ -346,11 +998,11 @@ int get_literal_char(int endchar)
 
             for(i = 0; i < 3; i++)
             {
-                ch = getc(current_in);
+                ch = input_getc(current_in);
                 if('0' <= ch && ch <= '8')
                     v = v * 8 + (ch - '0');
                 else
-                    ungetc(ch, current_in);
+                    input_ungetc(ch, current_in);
             }
 
             return v;
@@ -372,12 +1024,12 @@ int get_literal_char(int endchar)
 
           case 'x':             /* hexadecimal constant */
             {
-                unsigned char v;
+                unsigned char v = 0;
                 char i;
 
                 for(i = 0; i < 2; i++)
                 {
-                    ch = getc(current_in);
+                    ch = input_getc(current_in);
                     if('0' <= ch && ch <= '9')
                         v = v * 16 + (ch - '0');
                     else if('a' <= ch && ch <= 'f')
@@ -385,7 +1037,7 @@ int get_literal_char(int endchar)
                     else if('A' <= ch && ch <= 'F')
                         v = v * 16 + (ch - 'A') + 10;
                     else
-                        ungetc(ch, current_in);
+                        input_ungetc(ch, current_in);
                 }
 
                 return v;
@@ -398,7 +1050,6 @@ int get_literal_char(int endchar)
 
 /* read an S-expression and return it. if succeeded, last_parse_error
  * == NULL. otherwise last_parse_error == "error message". */
-char* last_parse_error;
 #define PARSE_ERROR(str) do{ last_parse_error = str; return NIL; }while(0)
 lobj read()
 {
@@ -421,19 +1072,17 @@ lobj read()
         PARSE_ERROR("too many ']' in expression.");
 
       case ';':                 /* comment */
-        ch = getc(current_in);
+        ch = input_getc(current_in);
         while(ch != '\n' && ch != EOF)
-            ch = getc(current_in);
+            ch = input_getc(current_in);
         return read();
 
       case '\'':                /* quote */
-        WITH_GC_PROTECTION()
-            t = cons(intern("quote"), cons(read(), NIL));
+        t = cons(SYM(QUOTE), cons(read(), NIL));
         return t;
 
       case ',':                 /* eval */
-        WITH_GC_PROTECTION()
-            t = cons(intern("eval"), cons(read(), NIL));
+        t = cons(SYM(EVAL), cons(read(), NIL));
         return t;
 
       case '?':                 /* char */
@@ -452,29 +1101,26 @@ lobj read()
         {
             lobj head, last;
 
-            ungetc(ch, current_in);
+            input_ungetc(ch, current_in);
 
-            WITH_GC_PROTECTION()
-            {
-                head = cons(read(), NIL), last = head;
+            head = cons(read(), NIL), last = head;
 
-                while((ch = read_char()) != ')')
+            while((ch = read_char()) != ')')
+            {
+                if(ch == EOF)
+                    PARSE_ERROR("unexpected EOF in a list.");
+                else if(ch == '.')
                 {
-                    if(ch == EOF)
-                        PARSE_ERROR("unexpected EOF in a list.");
-                    else if(ch == '.')
-                    {
-                        setcdr(last, read());
-                        if(read_char() != ')')
-                            PARSE_ERROR("more than one elements after dot.");
-                        break;
-                    }
-                    else
-                    {
-                        ungetc(ch, current_in);
-                        setcdr(last, cons(read(), NIL));
-                        last = cdr(last);
-                    }
+                    setcdr(last, read());
+                    if(read_char() != ')')
+                        PARSE_ERROR("more than one elements after dot.");
+                    break;
+                }
+                else
+                {
+                    input_ungetc(ch, current_in);
+                    setcdr(last, cons(read(), NIL));
+                    last = cdr(last);
                 }
             }
 
@@ -488,57 +1134,55 @@ lobj read()
         {
             lobj head, last;
 
-            ungetc(ch, current_in);
+            input_ungetc(ch, current_in);
 
-            WITH_GC_PROTECTION()
-            {
-                head = cons(read(), NIL), last = head;
+            head = cons(read(), NIL), last = head;
 
-                while((ch = read_char()) != ']')
-                {
-                    if(ch == EOF)
-                        PARSE_ERROR("unexpected EOF in an array literal.");
-                    ungetc(ch, current_in);
-                    setcdr(last, cons(read(), NIL));
-                    last = cdr(last);
-                }
+            while((ch = read_char()) != ']')
+            {
+                if(ch == EOF)
+                    PARSE_ERROR("unexpected EOF in an array literal.");
+                input_ungetc(ch, current_in);
+                setcdr(last, cons(read(), NIL));
+                last = cdr(last);
             }
 
-            return list_array(head);
+            /* a literal of chars is a string, as users see it */
+            head = list_array(head);
+            array_to_string(head);
+
+            return head;
         }
 
       case '\"':                /* string */
-        if((ch = getc(current_in)) == '\"')
+        if((ch = input_getc(current_in)) == '\"')
             return make_string(0, '\0');
         else
         {
             lobj head, last;
 
-            ungetc(ch, current_in);
+            input_ungetc(ch, current_in);
 
             if((ch = get_literal_char(-1)) == EOF)
                 PARSE_ERROR("unexpected EOF in a string literal.");
             else if(ch == -3)
                 PARSE_ERROR("invalid escape sequence.");
 
-            WITH_GC_PROTECTION()
-            {
-                head = last = cons(character(ch), NIL);
-
-                while((ch = get_literal_char('\"')) != -2)
-                {
-                    if(ch == EOF)
-                        PARSE_ERROR("unexpected EOF in a string literal.");
-                    else if(ch == -3)
-                        PARSE_ERROR("invalid escape sequence.");
-                    setcdr(last, cons(character(ch), NIL));
-                    last = cdr(last);
-                }
+            head = last = cons(character(ch), NIL);
 
-                head = list_array(head);
-                stringp(head);  /* array -> string */
+            while((ch = get_literal_char('\"')) != -2)
+            {
+                if(ch == EOF)
+                    PARSE_ERROR("unexpected EOF in a string literal.");
+                else if(ch == -3)
+                    PARSE_ERROR("invalid escape sequence.");
+                setcdr(last, cons(character(ch), NIL));
+                last = cdr(last);
             }
 
+            head = list_array(head);
+            array_to_string(head);
+
             return head;
         }
 
@@ -550,7 +1194,7 @@ lobj read()
             while('0' <= ch && ch <= '9')
             {
                 v = v * 10 + (ch - '0');
-                ch = getc(current_in);
+                ch = input_getc(current_in);
             }
 
             if(ch == '.')
@@ -558,11 +1202,11 @@ lobj read()
                 double vv = 0;
 
                 /* *FIXME* MAY OVERFLOW */
-                ch = getc(current_in);
+                ch = input_getc(current_in);
                 while('0' <= ch && ch <= '9')
                 {
                     vv = vv * 10 + (ch - '0');
-                    ch = getc(current_in);
+                    ch = input_getc(current_in);
                 }
                 while(vv >= 1) vv /= 10;
 
@@ -570,23 +1214,23 @@ lobj read()
                 {
                     int e = 0;
 
-                    ch = getc(current_in);
+                    ch = input_getc(current_in);
                     while('0' <= ch && ch <= '9')
                     {
                         e = e * 10 + (ch - '0');
-                        ch = getc(current_in);
+                        ch = input_getc(current_in);
                     }
 
                     for(vv += v; e--; vv *= 10);
 
-                    ungetc(ch, current_in);
+                    input_ungetc(ch, current_in);
 
                     return floating(vv);
                 }
 
                 else
                 {
-                    ungetc(ch, current_in);
+                    input_ungetc(ch, current_in);
                     return floating(v + vv);
                 }
             }
@@ -595,22 +1239,22 @@ lobj read()
             {
                 int e = 0;
 
-                ch = getc(current_in);
+                ch = input_getc(current_in);
                 while('0' <= ch && ch <= '9')
                 {
                     e = e * 10 + (ch - '0');
-                    ch = getc(current_in);
+                    ch = input_getc(current_in);
                 }
 
                 for(; e--; v *= 10);
 
-                ungetc(ch, current_in);
+                input_ungetc(ch, current_in);
                 return integer(v);
             }
 
             else
             {
-                ungetc(ch, current_in);
+                input_ungetc(ch, current_in);
                 return integer(v);
             }
         }
@@ -620,28 +1264,30 @@ lobj read()
       case '-': case '+':       /* negative/positive number ? */
         buf[0] = ch;
         bufptr = 1;
-        ch = getc(current_in);
+        ch = input_getc(current_in);
         if(ch == '.' || ('0' <= ch && ch <= '9'))
         {
             lobj v;
-            ungetc(ch, current_in);
+            input_ungetc(ch, current_in);
             v = read();
 
             if(integerp(v))
                 return integer(-integer_value(v));
             else if(floatingp(v))
                 return floating(-floating_value(v));
-            else
-                fatal("unexpected non-number value after '-'.");
+            else if(!last_parse_error)
+                PARSE_ERROR("unexpected non-number value after '-'.");
+
+            return NIL;
         }
 
-        /* vv FALL THROUGH ... vv */
+        /* FALL THROUGH */
 
       default:                  /* symbol name */
         while(1)
         {
             if(bufptr == SYMBOL_NAME_MAX)
-                fatal("too long symbol name given.");
+                PARSE_ERROR("too long symbol name given.");
 
             else if(ch == -1 || isspace(ch) || strchr("()[]\";", ch))
             {
@@ -652,21 +1298,292 @@ lobj read()
             else
             {
                 buf[bufptr++] = ch;
-                ch = getc(current_in);
+                ch = input_getc(current_in);
             }
         }
-        ungetc(ch, current_in);
+        input_ungetc(ch, current_in);
         return intern(buf);
     }
 }
 
+/* + SCHEDULER      ---------------- */
+
+/* threads are scheduled cooperatively, in round-robin order. the
+ * evaluator switches threads only in "yield", "join", "receive" and
+ * "wait-input", by saving the registers of the current thread into
+ * its continuation, and loading ones of the next runnable thread.
+ *
+ * *NOTE* A THREAD SUSPENDED IN A NESTED "eval" (e.g. IN A CALLBACK OF
+ * "map") CAN BE RESUMED ONLY IN THE SAME "eval", SINCE THE C STACK IS
+ * NOT SWITCHED. */
+
+#define THREAD_RUNNING 0 /* the current thread                            */
+#define THREAD_READY   1 /* runnable, resumed by returning VALUE          */
+#define THREAD_APPLY   2 /* runnable, resumed by applying VALUE (a pa)    */
+#define THREAD_BLOCKED 3 /* joining a thread, or receiving from a channel */
+#define THREAD_IO      4 /* waiting for input, VALUE = (stream . pa)      */
+#define THREAD_DONE    5 /* finished, VALUE is the result                 */
+
+/* runnable threads (FIFO), and threads waiting for input */
+#define run_queue      (current_interp->run_queue)
+#define run_queue_last (current_interp->run_queue_last)
+#define io_waiters     (current_interp->io_waiters)
+
+/* the bottom frame of threads is [pa(thread_marker, thread), (),
+ * ...]. */
+
+/* append O to list LST destructively */
+lobj append1(lobj lst, lobj o)
+{
+    lobj l;
+
+    o = cons(o, NIL);
+
+    if(!lst)
+        return o;
+
+    for(l = lst; cdr(l); l = cdr(l));
+    setcdr(l, o);
+
+    return lst;
+}
+
+/* make thread T runnable. T will be resumed as STATE with VALUE. */
+void wake(lobj t, lobj value, int state)
+{
+    lobj o;
+
+    thread_set_value(t, value), thread_set_state(t, state);
+
+    o = cons(t, NIL);
+
+    if(run_queue)
+        setcdr(run_queue_last, o);
+    else
+        run_queue = o;
+
+    run_queue_last = o;
+}
+
+/* non-0 iff other threads may run (or wait for input) now. */
+int threads_pending() { return run_queue || io_waiters; }
+
+/* each thread has its own current ports: they are saved when the
+ * thread is suspended, and restored when it is resumed. */
+void save_ports(lobj t)
+{
+    FILE** p = thread_ports(t);
+    p[0] = current_in, p[1] = current_out, p[2] = current_err;
+}
+
+void restore_ports(lobj t)
+{
+    FILE** p = thread_ports(t);
+    current_in = p[0], current_out = p[1], current_err = p[2];
+}
+
+/* make a thread which applies ARGS to PROC in the current
+ * environment and with the current ports, and schedule it. */
+lobj spawn(lobj proc, lobj args)
+{
+    lobj t, o;
+
+    t = thread(NIL, NIL, THREAD_APPLY);
+    save_ports(t);
+    pa_push(o = pa(0, thread_marker), t);
+    current_scope();        /* the thread may outlive the caller */
+    o = cons(make_frame(FRAME_SIZE, o, NIL), NIL);
+    thread_set_cont(t, continuation(o, NIL, 0, 0)); /* resumable in any session */
+
+    for(o = pa(0, proc); args; args = cdr(args))
+        pa_push(o, car(args));
+    wake(t, o, THREAD_APPLY);
+
+    return t;
+}
+
+/* send O to channel CH. if some threads are waiting for a value, the
+ * first one receives O. */
+void channel_send(lobj ch, lobj o)
+{
+    lobj w = channel_waiters(ch);
+
+    if(w)
+    {
+        channel_set_waiters(ch, cdr(w));
+        wake(car(w), o, THREAD_READY);
+    }
+    else
+        channel_push(ch, o);
+}
+
+/* non-0 iff a character can be read from F without blocking. */
+int input_ready(FILE* f)
+{
+  #ifndef _WIN32
+    struct pollfd p;
+
+    if(input_buffered(f))
+        return 1;
+
+    p.fd = fileno(f);
+
+    p.events = POLLIN;
+
+    return poll(&p, 1, 0) != 0;
+  #endif
+  #ifdef _WIN32
+    unused(f);
+    return 1;
+  #endif
+}
+
+#ifndef _WIN32
+/* poll, letting other OS threads collect while waiting */
+int poll_blocking(struct pollfd* fds, unsigned n)
+{
+    int polled;
+
+    BLOCKING(polled = poll(fds, n, -1));
+
+    return polled;
+}
+#endif
+
+/* wake threads in io_waiters whose input is ready. if BLOCK is
+ * non-0, wait until some of them get ready. */
+void poll_io(int block)
+{
+    lobj w, prev, next;
+    unsigned n = 0, ix;
+
+  #ifndef _WIN32
+    struct pollfd *fds;
+
+    for(w = io_waiters; w; w = cdr(w))
+        if(input_buffered(stream_value(car(thread_value(car(w))))))
+            block = 0;
+        else
+            n++;
+
+    if(!(fds = (struct pollfd*)malloc(sizeof(struct pollfd) * (n + 1))))
+        fatal("failed to allocate memory.");
+
+    for(ix = 0, w = io_waiters; w; w = cdr(w))
+    {
+        FILE* f = stream_value(car(thread_value(car(w))));
+
+        if(!input_buffered(f))
+            fds[ix].fd = fileno(f), fds[ix].events = POLLIN, fds[ix++].revents = 0;
+    }
+
+    if((block ? poll_blocking(fds, n) : poll(fds, n, 0)) < 0) /* interrupted */
+        for(ix = 0; ix < n; ix++)
+            fds[ix].revents = 0;
+  #endif
+  #ifdef _WIN32
+    unused(block);
+  #endif
+
+    for(ix = 0, prev = NIL, w = io_waiters; w; w = next)
+    {
+        lobj t = car(w), v = thread_value(t);
+        int ready = 1;
+
+        next = cdr(w);
+
+      #ifndef _WIN32
+        if(!input_buffered(stream_value(car(v))))
+            ready = fds[ix++].revents != 0;
+      #endif
+
+        if(!ready)
+            prev = w;
+        else
+        {
+            if(prev)
+                setcdr(prev, next);
+            else
+                io_waiters = next;
+
+            if(cdr(v))
+                wake(t, cdr(v), THREAD_APPLY);
+            else
+                wake(t, car(v), THREAD_READY);
+        }
+    }
+
+  #ifndef _WIN32
+    free(fds);
+  #endif
+}
+
+/* pop the first thread in the run queue which can be resumed in the
+ * session ID. return () if no threads can be resumed. */
+lobj next_thread(unsigned long id)
+{
+    lobj o, prev;
+    int block = 0;
+    unsigned long s;
+
+    while(1)
+    {
+        if(io_waiters)
+            poll_io(block);
+
+        for(prev = NIL, o = run_queue; o; prev = o, o = cdr(o))
+            if(!(s = continuation_session(thread_cont(car(o)))) || s == id)
+            {
+                if(prev)
+                    setcdr(prev, cdr(o));
+                else
+                    run_queue = cdr(o);
+
+                if(o == run_queue_last)
+                    run_queue_last = prev;
+
+                return car(o);
+            }
+
+        if(!io_waiters)
+            return NIL;
+
+        block = 1;
+    }
+}
+
 /* + EVALUATOR      ---------------- */
 
+/* let "eval" apply ARGS to PROC as the result of the subr currently
+ * called, instead of calling "eval" recursively. return value of the
+ * subr is ignored (so just return the return value of this). */
+lobj tail_call(lobj proc, lobj args)
+{
+    tail_call_proc = proc, tail_call_args = args;
+    return NIL;
+}
+
+/* tail_call ERRORBACK with message MSG. */
+lobj call_errorback(lobj errorback, char* msg)
+{
+    lobj o;
+
+    o = tail_call(errorback, cons(string(msg), NIL));
+
+    return o;
+}
+
+/* non-0 iff an "eval" called from a subr is escaping to an outer
+ * continuation, or raised an error. the subr must return
+ * immediately. */
+int escaping() { return escape_cont != NIL || pending_error; }
+
 #define DEFINE_DUMMY_SUBR(n, a, r)                     \
     DEFSUBR(n, a, r)(lobj args)                        \
     {                                                  \
         unused(args);                                  \
         fatal("unexpected call to " #n ".");           \
+        return NIL;                                    \
     }                                                  \
 
 /* (if COND ,THEN [,ELSE]) => if COND is non-(), evaluate THEN, else
@@ -680,20 +1597,38 @@ DEFINE_DUMMY_SUBR(subr_evlis, E E, _)
 /* (apply PROC ARGS) => apply ARGS to PROC. */
 DEFINE_DUMMY_SUBR(subr_apply, E E, _)
 
-/* (unwind-protect ,BODY ,AFTER) => evaluate BODY and then AFTER. when
- * a continuation is called in BODY, evaluate AFTER before winding the
- * continuation. */
+/* (unwind-protect ,BODY ,AFTER) => evaluate BODY and then AFTER, and
+ * return the value of BODY. when a continuation is called or an error
+ * is raised in BODY, evaluate AFTER before winding the continuation or
+ * unwinding to the handler of the error. */
 DEFINE_DUMMY_SUBR(subr_unwind_protect, Q Q, _)
 
-/* (call/cc FUNC) => evaluate BODY and then AFTER. when
- * a continuation is called in BODY, evaluate AFTER before winding the
- * continuation. */
+/* (call-cc FUNC) => call FUNC with the current continuation. */
 DEFINE_DUMMY_SUBR(subr_call_cc, E, _)
 
+/* (call-ec FUNC) => call FUNC with an escape-only continuation, which
+ * can be called only until FUNC returns. */
+DEFINE_DUMMY_SUBR(subr_call_ec, E, _)
+
 /* (eval O [ERRORBACK]) => evaluate O. on failure, call ERRORBACK with
  * error message, or error if ERRORBACK is omitted. */
 DEFINE_DUMMY_SUBR(subr_eval, E, E)
 
+/* (yield) => let other threads run, and return (). */
+DEFINE_DUMMY_SUBR(subr_yield, _, _)
+
+/* (join THREAD) => wait for THREAD to finish, and return its result. */
+DEFINE_DUMMY_SUBR(subr_join, E, _)
+
+/* (receive CHANNEL) => pop a value from CHANNEL. if CHANNEL is empty,
+ * wait for a value to be sent. */
+DEFINE_DUMMY_SUBR(subr_receive, E, _)
+
+/* (wait-input STREAM [THUNK]) => wait until a character can be read
+ * from STREAM, letting other threads run. then return STREAM, or call
+ * THUNK if specified. */
+DEFINE_DUMMY_SUBR(subr_wait_input, E, E)
+
 int eval_pattern(lobj o)
 {
     if(functionp(o))
@@ -710,25 +1645,37 @@ int eval_pattern(lobj o)
         return ~0;
 }
 
+#define TRACE_POINT(kind)                                               \
+    do{                                                                 \
+        if(current_interp->tracer)                                      \
+            trace_point(current_interp->tracer, kind, eax, callstack);  \
+    }                                                                   \
+    while(0)
+
 void DEBUG_DUMP(char* labelname)
 {
   #if DEBUG
     lobj env, stack;
+    unsigned ix;
     for(stack = callstack; stack; stack = cdr(stack))
         printf("> ");
     printf("%s: ", labelname); print(stdout, eax);
     printf(" | locals: ");
-    for(env = local_env; env; env = cdr(env))
-        if(car(env))
+    if(local_boundary)
+        printf("/ ");
+    for(env = local_env; env; env = scope_parent(env))
+    {
+        for(ix = 0; ix < scope_count(env); ix++)
         {
             putchar('(');
-            print(stdout, car(car(env)));
+            print(stdout, scope_slots(env)[2 * ix]);
             printf(" : ");
-            print(stdout, cdr(car(env)));
+            print(stdout, scope_slots(env)[2 * ix + 1]);
             printf(") ");
         }
-        else
+        if(scope_boundary(env))
             printf("/ ");
+    }
     printf(" | globals: ");
     for(env = cdr(global_env); env; env = cdr(env))
         if(subrp(cdr(car(env))))
@@ -751,78 +1698,95 @@ void DEBUG_DUMP(char* labelname)
   #endif
 }
 
-/* *FIXME* RECURSIVE "eval" */
-#define EVALUATION_ERROR(str)                                   \
-    do{                                                         \
-        if(!errorback)                                          \
-            lisp_error(str);                                    \
-        else                                                    \
-        {                                                       \
-            lobj o;                                             \
-            WITH_GC_PROTECTION()                                \
-                o = cons(errorback, cons(string(str), NIL));    \
-            return eval(o, NIL);                                \
-        }                                                       \
-    }                                                           \
+/* raise an error, and unwind to the innermost ERRORBACK */
+#define EVALUATION_ERROR(str)                           \
+    do{ lisp_error(str); goto error; }while(0)
+
+#define EVALUATION_TYPE_ERROR(name, ix, expected)               \
+    do{ type_error(name, ix, expected); goto error; }while(0)
+
+/* save registers of the current thread, to be resumed later as
+ * STATE with VALUE. */
+#define SUSPEND_THREAD(state, value)                                    \
+    do{                                                                 \
+        thread_set_cont(current_thread,                                 \
+                        continuation(callstack, unwind_protects, session.id, 0)); \
+        thread_set_state(current_thread, state);                        \
+        thread_set_value(current_thread, value);                        \
+        save_ports(current_thread);                                     \
+    }                                                                   \
     while(0)
 
-/* *FIXME* "eval" INSIDE "eval" BREAKS CALLSTACK */
-lobj eval(lobj o, lobj errorback)
-{
-    /* /\* we already have an eval session */
-    /*    -> just push to stack and return a dummy obj *\/ */
-    /* if(callstack) */
-    /* { */
-    /*     WITH_GC_PROTECTION() */
-    /*     { */
-    /*         lobj app = pa(0, subr(subr_eval)); */
-    /*         pa_push(app, eax); */
-    /*         callstack = cons(array(4, app, NIL, local_env, global_env), callstack); */
-    /*     } */
-    /*     return NIL; */
-    /* } */
+/* run a session. if APPLYING is non-0, O is a pa object to be
+ * applied instead of an expression. */
+lobj eval_(lobj o, lobj errorback, int applying)
+{
+    eval_session session;
+
+    /* save registers of the caller */
+    session.id = new_session_id(), session.prev = current_session;
+    session.saved_callstack = callstack, session.saved_eax = eax;
+    session.saved_local_env = local_env, session.saved_global_env = global_env;
+    session.saved_local_boundary = local_boundary;
+    session.saved_unwind_protects = unwind_protects;
+    if(local_env)
+        scope_keep(local_env);  /* the caller resumes with it */
+    session.errorback = errorback;
+    current_session = &session;
 
     callstack = NIL, eax = o;
 
+    if(applying)
+        goto apply;
+
   eval:               /* here EAX is an expression to be evaluated. */
 
     DEBUG_DUMP("eval");
+    TRACE_POINT(TRACE_EVAL);
+    current_interp->stats.evals++;
 
-    if(symbolp(eax))
+    switch(TYPE_OF(eax))
     {
-        if(!(eax = binding(eax, 0)))
+      case TYPE_SYMB:
+        if(!binding(eax, 0, &eax))
             EVALUATION_ERROR("reference to unbound symbol.");
-        eax = cdr(eax);
         goto ret;
-    }
-    else if(consp(eax))
-    {
-        WITH_GC_PROTECTION() /* stack_frame = [pa, pending_args, local, global] */
-            callstack = cons(array(3, NIL, cdr(eax), save_current_env(1)), callstack);
+
+      case TYPE_CONS:
+        PUSH_FRAME(NIL, cdr(eax));
         eax = car(eax);
         goto eval;
-    }
-    else if(closurep(eax))
-    {
-        lobj o = closure_obj(eax);
 
-        if(symbolp(o) || consp(o))
+      case TYPE_CLOS:
         {
-            restore_current_env(closure_env(eax));
-            eax = o;
-            goto eval;
+            lobj o = closure_obj(eax);
+
+            if(symbolp(o) || consp(o))
+            {
+                restore_current_env(closure_env(eax));
+                eax = o;
+                goto eval;
+            }
         }
     }
 
   ret:                 /* here EAX is an object evaluated just now. */
 
     DEBUG_DUMP("ret ");
+    TRACE_POINT(TRACE_RET);
+    current_interp->stats.rets++;
+    PROFILE_POINT(NIL);
 
     if(!callstack)           /* nothing more to evaluate */
-        return eax;
+        goto quit;
     else
     {
-        lobj *ptr = array_ptr(car(callstack));
+        lobj *ptr;
+
+        if(array_ptr(car(callstack))[3] == frame_shared)
+            unshare_frame();
+
+        ptr = array_ptr(car(callstack));
 
         /* update pa */
         if(!ptr[0])             /* pa is not set */
@@ -831,7 +1795,20 @@ lobj eval(lobj o, lobj errorback)
             pa_push(ptr[0], eax);
 
         /* restore environ */
-        restore_current_env(ptr[2]);
+        restore_frame_env(car(callstack));
+    }
+
+  evlis:     /* here the top frame has a pa and pending expressions. */
+
+    DEBUG_DUMP("evls");
+    TRACE_POINT(TRACE_EVLS);
+
+    {
+        lobj *ptr = array_ptr(car(callstack));
+
+        /* BODY of "unwind-protect" is done */
+        if(pa_function(ptr[0]) == unwind_marker && ptr[1])
+            unwind_protects = cdr(unwind_protects);
 
         /* then evaluate next "unevaluated" arg or apply all evaluated args */
         if(ptr[1])
@@ -844,10 +1821,62 @@ lobj eval(lobj o, lobj errorback)
             else
                 goto ret;
         }
+        else if(pa_function(ptr[0]) == evlis_marker) /* values of "evlis" */
+        {
+            eax = pa_values(ptr[0]);
+            pop_frame();
+            goto ret;
+        }
+        else if(pa_function(ptr[0]) == ec_marker) /* FUNC of "call-ec" returned */
+        {
+            continuation_set_escape(car(pa_values(ptr[0])), ESCAPE_EXPIRED);
+            eax = car(cdr(pa_values(ptr[0])));
+            pop_frame();
+            goto ret;
+        }
+        else if(pa_function(ptr[0]) == catch_marker) /* O of "eval" returned */
+        {
+            lobj errorback = car(pa_values(ptr[0]));
+
+            eax = car(cdr(cdr(pa_values(ptr[0]))));
+            pop_frame();
+
+            /* or an error escaped here : apply ERRORBACK to the message */
+            if(consp(eax) && car(eax) == catch_marker)
+            {
+                lobj msg = cdr(eax);
+
+                eax = pa(eval_pattern(errorback), errorback);
+                pa_push(eax, msg);
+                goto apply;
+            }
+
+            goto ret;
+        }
+        else if(pa_function(ptr[0]) == unwind_marker) /* value of BODY */
+        {
+            eax = car(pa_values(ptr[0]));
+            pop_frame();
+            goto ret;
+        }
+        else if(pa_function(ptr[0]) == thread_marker) /* a thread is finished */
+        {
+            lobj t = car(pa_values(ptr[0])), w;
+
+            thread_set_state(t, THREAD_DONE);
+            thread_set_value(t, car(cdr(pa_values(ptr[0]))));
+
+            for(w = thread_waiters(t); w; w = cdr(w))
+                wake(car(w), thread_value(t), THREAD_READY);
+            thread_set_waiters(t, NIL);
+
+            pop_frame();
+            goto schedule;
+        }
         else
         {
             eax = ptr[0];
-            callstack = cdr(callstack);
+            pop_frame();
             goto apply;
         }
     }
@@ -855,218 +1884,747 @@ lobj eval(lobj o, lobj errorback)
   apply:                   /* here EAX is a pa object to be applied */
 
     DEBUG_DUMP("call");
+    TRACE_POINT(TRACE_CALL);
+    current_interp->stats.applies++;
+    PROFILE_POINT(pa_function(eax));
 
     {
         lobj func = pa_function(eax),
              vals = pa_values(eax);
         int num_vals = pa_num_values(eax);
 
-        if(functionp(func))
+        switch(TYPE_OF(func))
         {
-            pargs num_args = function_args(func);
+          case TYPE_FUNC:
+            {
+                pargs num_args = function_args(func);
 
-            if((num_args & 255) < num_vals && !(num_args & 256)) /* too many */
-                EVALUATION_ERROR("too many arguments applied to a function.");
-            else if(num_vals < (num_args & 255)) /* too few */
-                goto ret;
-            else                /* okay */
+                if((num_args & 255) < num_vals && !(num_args & 256)) /* too many */
+                    EVALUATION_ERROR("too many arguments applied to a function.");
+                else if(num_vals < (num_args & 255)) /* too few */
+                    goto ret;
+                else if(arrayp(function_formals(func))) /* lexical */
+                {
+                    lobj *formals = array_ptr(function_formals(func));
+                    unsigned len = array_length(function_formals(func)), ix;
+
+                    /* a new scope of just the formals and "self", which
+                     * the caller's bindings are not visible from */
+                    local_env = scope(function_scope(func), len + 1, 1);
+                    local_boundary = 0;
+
+                    for(ix = 0; ix < (num_args & 255); ix++, vals = cdr(vals))
+                        scope_push(local_env, formals[ix], car(vals));
+                    if(num_args & 256)
+                        scope_push(local_env, formals[ix], vals);
+                    scope_push(local_env, SYM(SELF), func);
+
+                    eax = function_expr(func);
+                    goto eval;
+                }
+                else                /* okay */
+                {
+                    lobj formals = function_formals(func), f;
+                    unsigned len;
+
+                    for(f = formals, len = 1; consp(f); f = cdr(f))
+                        len++;
+
+                    push_group(formals, len + !!f);
+
+                    while(formals)
+                    {
+                        if(consp(formals))
+                        {
+                            bind(car(formals), car(vals), 1);
+                            vals = cdr(vals), formals = cdr(formals);
+                        }
+                        else
+                        {
+                            bind(formals, vals, 1);
+                            break;
+                        }
+                    }
+
+                    bind(SYM(SELF), func, 1);
+
+                    eax = function_expr(func);
+                    goto eval;
+                }
+            }
+
+          case TYPE_CLOS:
+            {
+                restore_current_env(closure_env(func));
+                pa_set_function(eax, closure_obj(func));
+                goto apply;
+            }
+
+          case TYPE_SUBR:
             {
-                lobj formals = function_formals(func);
+                pargs num_args = subr_args(func);
 
-                while(formals)
+                if((num_args & 255) < num_vals && !(num_args & 256)) /* too many */
+                    EVALUATION_ERROR("too many arguments applied to a subr.");
+
+                else if(num_vals < (num_args & 255)) /* too few */
+                    goto ret;
+                else
                 {
-                    if(consp(formals))
+                    lobj (*fobj)(lobj) = subr_function(func);
+
+                    if(fobj == f_subr_eval)
+                    {
+                        /* evaluate O on top of a catch frame, which
+                         * remembers ERRORBACK and the wind frames */
+                        if(cdr(vals))
+                        {
+                            lobj o;
+
+                            PUSH_FRAME(o = pa(0, catch_marker), NIL);
+                            pa_push(o, car(cdr(vals)));
+                            pa_push(o, unwind_protects);
+                        }
+                        eax = car(vals);
+                        goto eval;
+                    }
+                    if(fobj == f_subr_if)
+                    {
+                        eax = car(vals) ? car(cdr(vals)) : car(cdr(cdr(vals)));
+                        goto eval;
+                    }
+                    else if(fobj == f_subr_evlis)
+                    {
+                        if(!listp(car(cdr(vals))))
+                            EVALUATION_TYPE_ERROR("subr \"evlis\"", 1, "list");
+
+                        /* a frame whose values are returned instead of applied */
+                        PUSH_FRAME(pa(eval_pattern(car(vals)), evlis_marker), car(cdr(vals)));
+                        goto evlis;
+                    }
+                    else if(fobj == f_subr_apply)
+                    {
+                        eax = pa(eval_pattern(car(vals)), car(vals));
+
+                        if(!listp(car(cdr(vals))))
+                            EVALUATION_TYPE_ERROR("subr \"apply\"", 1, "list");
+
+                        for(vals = car(cdr(vals)); vals; vals = cdr(vals))
+                            pa_push(eax, car(vals));
+
+                        goto apply;
+                    }
+                    else if(fobj == f_subr_unwind_protect)
+                    {
+                        /* evaluate BODY on top of a wind frame */
+                        o = make_frame(FRAME_SIZE + 1, pa(2, unwind_marker), cdr(vals));
+                        array_ptr(o)[FRAME_SIZE] = integer(WIND_DEPTH(unwind_protects) + 1);
+                        callstack = cons(o, callstack);
+                        unwind_protects = cons(car(callstack), unwind_protects);
+                        eax = car(vals);
+                        goto eval;
+                    }
+                    else if(fobj == f_subr_call_ec)
+                    {
+                        lobj o, k;
+
+                        PUSH_FRAME(o = pa(0, ec_marker), NIL);
+                        k = continuation(callstack, unwind_protects, session.id, ESCAPE_LIVE);
+                        continuation_set_stamp(k, stack_jumps);
+                        pa_push(o, k);
+                        eax = pa(eval_pattern(car(vals)), car(vals));
+                        pa_push(eax, k);
+                        goto apply;
+                    }
+                    else if(fobj == f_subr_yield)
+                    {
+                        eax = NIL;
+
+                        if(!threads_pending())
+                            goto ret;
+
+                        SUSPEND_THREAD(THREAD_READY, NIL);
+                        wake(current_thread, NIL, THREAD_READY);
+                        goto schedule;
+                    }
+                    else if(fobj == f_subr_join)
+                    {
+                        lobj t = car(vals);
+
+                        if(!threadp(t))
+                            EVALUATION_TYPE_ERROR("subr \"join\"", 0, "thread");
+
+                        if(thread_state(t) == THREAD_DONE)
+                        {
+                            eax = thread_value(t);
+                            goto ret;
+                        }
+                        else if(t == current_thread)
+                            EVALUATION_ERROR("a thread cannot join itself.");
+
+                        SUSPEND_THREAD(THREAD_BLOCKED, NIL);
+                        thread_set_waiters(t, append1(thread_waiters(t), current_thread));
+                        goto schedule;
+                    }
+                    else if(fobj == f_subr_receive)
+                    {
+                        lobj ch = car(vals);
+
+                        if(!channelp(ch))
+                            EVALUATION_TYPE_ERROR("subr \"receive\"", 0, "channel");
+
+                        if(channel_items(ch))
+                        {
+                            eax = channel_pop(ch);
+                            goto ret;
+                        }
+
+                        SUSPEND_THREAD(THREAD_BLOCKED, NIL);
+                        channel_set_waiters(ch, append1(channel_waiters(ch), current_thread));
+                        goto schedule;
+                    }
+                    else if(fobj == f_subr_wait_input)
+                    {
+                        lobj thunk = cdr(vals) ? car(cdr(vals)) : NIL;
+
+                        if(!streamp(car(vals)))
+                            EVALUATION_TYPE_ERROR("subr \"wait-input\"", 0, "stream");
+
+                        if(thunk)
+                            thunk = pa(eval_pattern(thunk), thunk);
+
+                        if(!threads_pending() || input_ready(stream_value(car(vals))))
+                        {
+                            if(!(eax = thunk))
+                            {
+                                eax = car(vals);
+                                goto ret;
+                            }
+                            goto apply;
+                        }
+
+                        SUSPEND_THREAD(THREAD_IO, cons(car(vals), thunk));
+                        io_waiters = cons(current_thread, io_waiters);
+                        goto schedule;
+                    }
+                    else if(fobj == f_subr_call_cc)
                     {
-                        bind(car(formals), car(vals), 1);
-                        vals = cdr(vals), formals = cdr(formals);
+                        eax = pa(eval_pattern(car(vals)), car(vals));
+                        pa_push(eax, continuation(callstack, unwind_protects, session.id, 0));
+
+                        /* frames below are now shared with the continuation */
+                        if(callstack)
+                            array_ptr(car(callstack))[3] = frame_shared;
+                        goto apply;
                     }
                     else
                     {
-                        bind(formals, vals, 1);
-                        break;
+                        eax = (subr_function(func))(vals);
+
+                        if(pending_error) /* raised by the subr */
+                            goto error;
+                        else if(escape_cont) /* an inner session is escaping */
+                        {
+                            eax = pa(eval_pattern(escape_cont), escape_cont);
+                            pa_push(eax, escape_value);
+                            escape_cont = NIL;
+                            goto apply;
+                        }
+                        else if(tail_call_proc) /* requested by the subr */
+                        {
+                            eax = pa(eval_pattern(tail_call_proc), tail_call_proc);
+                            for(; tail_call_args; tail_call_args = cdr(tail_call_args))
+                                pa_push(eax, car(tail_call_args));
+                            tail_call_proc = NIL;
+                            goto apply;
+                        }
+
+                        goto ret;
                     }
                 }
+            }
 
-                bind(intern("self"), func, 1);
+          case TYPE_CONT:
+            {
+                if(1 < num_vals)    /* too many */
+                    EVALUATION_ERROR("too many arguments applied to a continuation.");
+                else if(num_vals < 1) /* too few */
+                    goto ret;
+                else if(continuation_escape(func)
+                        && (continuation_escape(func) == ESCAPE_EXPIRED
+                            || (continuation_session(func) == session.id && !escape_live(func))))
+                    EVALUATION_ERROR("escape continuation called after its extent.");
+                else
+                {
+                    lobj w = crossed_wind(unwind_protects, continuation_winds(func));
 
-                eax = function_expr(func);
-                goto eval;
-            }
-        }
-        else if(closurep(func))
-        {
-            restore_current_env(closure_env(func));
-            pa_set_function(eax, closure_obj(func));
-            goto apply;
-        }
-        else if(subrp(func))
-        {
-            pargs num_args = subr_args(func);
+                    /* evaluate AFTER of the innermost frame left (if it
+                     * belongs to this session), and then call the
+                     * continuation again */
+                    if(w && WIND_DEPTH(w) > WIND_DEPTH(session.saved_unwind_protects))
+                    {
+                        lobj *ptr = array_ptr(car(w)), o;
 
-            if((num_args & 255) < num_vals && !(num_args & 256)) /* too many */
-                EVALUATION_ERROR("too many arguments applied to a subr.");
+                        PUSH_FRAME(pa(1, func), NIL);
+                        pa_push(o = pa(0, unwind_marker), car(vals));
+                        PUSH_FRAME(o, NIL);
 
-            else if(num_vals < (num_args & 255)) /* too few */
-                goto ret;
-            else
-            {
-                lobj (*fobj)(lobj) = subr_function(func);
+                        unwind_protects = cdr(w);
+                        restore_frame_env(car(w));
+                        eax = car(ptr[1]);
+                        goto eval;
+                    }
 
-                if(fobj == f_subr_eval)
-                {
+                    else if(continuation_session(func) != session.id)
+                    {
+                        eval_session *s;
+
+                        /* escape to an outer session, if it is still alive */
+                        for(s = session.prev; s; s = s->prev)
+                            if(s->id == continuation_session(func))
+                            {
+                                escape_cont = func, escape_value = car(vals);
+                                goto quit;
+                            }
+
+                        EVALUATION_ERROR("continuation called out of its extent.");
+                    }
+
+                    if(continuation_escape(func))
+                        expire_escapes(callstack, continuation_callstack(func));
+                    else
+                        stack_jumps++;
+
+                    callstack = continuation_callstack(func);
+                    unwind_protects = continuation_winds(func);
                     eax = car(vals);
-                    /* *FIXME* FIX ERROR HANDLER */
-                    /* errorback = cdr(vals) ? car(cdr(vals)) : errorback; */
-                    goto eval;
+
+                    if(continuation_escape(func))
+                    {
+                        continuation_set_escape(func, ESCAPE_EXPIRED);
+                        pop_frame();
+                    }
+
+                    goto ret;
                 }
-                if(fobj == f_subr_if)
+            }
+
+          case TYPE_PA:
+            {
+                /* *FIXME* EFFICIENCY */
+
+                lobj vals2 = pa_values(func);
+
+                eax = pa(eval_pattern(pa_function(func)), pa_function(func));
+
+                while(vals2)
                 {
-                    eax = car(vals) ? car(cdr(vals)) : car(cdr(cdr(vals)));
-                    goto eval;
+                    pa_push(eax, car(vals2));
+                    vals2 = cdr(vals2);
                 }
-                else if(fobj == f_subr_evlis)
+
+                while(vals)
                 {
-                    /* *TODO* IMPLEMENT EVLIS */
-                    fatal("NOT IMPLEMENTED subr \"evlis\".");
+                    pa_push(eax, car(vals));
+                    vals = cdr(vals);
                 }
-                else if(fobj == f_subr_apply)
-                {
-                    eax = pa(eval_pattern(car(vals)), car(vals));
-
-                    if(!listp(car(cdr(vals))))
-                        type_error("subr \"apply\"", 1, "list");
 
-                    for(vals = car(cdr(vals)); vals; vals = cdr(vals))
-                        pa_push(eax, car(vals));
+                goto apply;
+            }
 
-                    goto apply;
+          case TYPE_INT: case TYPE_FLOAT:
+            {
+                if(!vals)           /* (1) = 1 */
+                {
+                    eax = func;
+                    goto ret;
                 }
-                else if(fobj == f_subr_unwind_protect)
+                else if(!cdr(vals)) /* (1 f) = (fn x (apply f 1 x)) */
                 {
-                    fatal("NOT IMPLEMENTED subr \"unwind-protect.\"");
-
-                    /* *TODO* IMPLEMENT SUBR "unwind-protect" */
-
-                    /* unwind_protects = cons(car(cdr(vals)), unwind_protects); */
-                    /* eax = car(vals); */
-                    /* goto eval; */
+                    eax = pa(eval_pattern(car(vals)), func);
+                    pa_push(eax, car(vals));
+                    goto ret;
                 }
-                else if(fobj == f_subr_call_cc)
+                else                /* (1 f 2 ...) = ((f 1 2) ...) */
                 {
-                    eax = pa(eval_pattern(car(vals)), car(vals));
-                    pa_push(eax, continuation(callstack));
+                    PUSH_FRAME(pa(0, subr(subr_apply)), cons(cdr(cdr(vals)), NIL));
+                    eax = pa(0, car(vals));
+                    pa_push(eax, func);
+                    pa_push(eax, car(cdr(vals)));
                     goto apply;
                 }
-                else
+            }
+
+          default:
+            {
+                if(!vals)           /* ('a) = 'a */
                 {
-                    WITH_GC_PROTECTION()
-                        eax = (subr_function(func))(vals);
+                    eax = func;
                     goto ret;
                 }
-            }
-        }
-        else if(continuationp(func))
-        {
-            if(1 < num_vals)    /* too many */
-                EVALUATION_ERROR("too many arguments applied to a continuation.");
-            else if(num_vals < 1) /* too few */
-                goto ret;
-            else
-            {
-                if(unwind_protects)
+                else                /* ('a f ...) = ((f a) ...) */
                 {
-                    /* *TODO* EVAL "unwind_protects" here */
+                    PUSH_FRAME(pa(0, subr(subr_apply)), cons(cdr(vals), NIL));
+                    eax = pa(0, car(vals));
+                    pa_push(eax, func);
+                    goto apply;
                 }
-
-                callstack = continuation_callstack(func);
-                eax = car(vals);
-                goto ret;
             }
         }
-        else if(pap(func))
-        {
-            /* *FIXME* EFFICIENCY */
+    }
 
-            lobj vals2 = pa_values(func);
+  schedule:        /* here the current thread is suspended or finished. */
 
-            eax = pa(eval_pattern(pa_function(func)), pa_function(func));
+    DEBUG_DUMP("schd");
+    TRACE_POINT(TRACE_SCHD);
 
-            while(vals2)
-            {
-                pa_push(eax, car(vals2));
-                vals2 = cdr(vals2);
-            }
+    {
+        lobj t = next_thread(session.id);
+
+        if(!t)
+            EVALUATION_ERROR("deadlock: no threads can be resumed.");
+
+        current_thread = t, stack_jumps++;
+        restore_ports(t);
+        callstack = continuation_callstack(thread_cont(t));
+        unwind_protects = continuation_winds(thread_cont(t));
+        eax = thread_value(t);
+
+        thread_set_value(t, NIL);
 
-            while(vals)
+        if(thread_state(t) == THREAD_APPLY)
+        {
+            thread_set_state(t, THREAD_RUNNING);
+
+            if(callstack)
+                restore_frame_env(car(callstack));
+            else
             {
-                pa_push(eax, car(vals));
-                vals = cdr(vals);
+                local_env = session.saved_local_env, global_env = session.saved_global_env;
+                local_boundary = session.saved_local_boundary;
             }
 
             goto apply;
         }
-        else if(integerp(func) || floatingp(func))
+
+        thread_set_state(t, THREAD_RUNNING);
+        goto ret;
+    }
+
+  error:                /* here an error is pending. */
+
+    {
+        lobj frame = catch_frame(callstack), k;
+
+        if(frame)
         {
-            if(!vals)           /* (1) = 1 */
-            {
-                eax = func;
-                goto ret;
-            }
-            else if(!cdr(vals)) /* (1 f) = (fn x (apply f 1 x)) */
-            {
-                eax = pa(eval_pattern(car(vals)), func);
-                pa_push(eax, car(vals));
-                goto ret;
-            }
-            else                /* (1 f 2 ...) = ((f 1 2) ...) */
-            {
-                WITH_GC_PROTECTION()
-                    callstack = cons(array(4,
-                                           pa(0, subr(subr_apply)),
-                                           cons(cdr(cdr(vals)), NIL),
-                                           save_current_env(1)),
-                                     callstack);
-                eax = pa(0, car(vals));
-                pa_push(eax, func);
-                pa_push(eax, car(cdr(vals)));
-                goto apply;
-            }
+            /* escape to the catch frame like a continuation, so that
+             * AFTERs of "unwind-protect" inside are evaluated */
+            array_ptr(car(frame))[3] = frame_shared;
+
+            k = continuation(frame, car(cdr(pa_values(array_ptr(car(frame))[0]))),
+                             session.id, 0);
+            eax = pa(1, k);
+            pa_push(eax, cons(catch_marker, string(pending_error)));
+            pending_error = NULL;
+            goto apply;
         }
-        else
+        else if(session.errorback)
         {
-            if(!vals)           /* ('a) = 'a */
-            {
-                eax = func;
-                goto ret;
-            }
-            else                /* ('a f ...) = ((f a) ...) */
+            /* abandon the session and apply ERRORBACK instead */
+            callstack = NIL, stack_jumps++;
+            unwind_protects = session.saved_unwind_protects;
+            local_env = session.saved_local_env;
+            global_env = session.saved_global_env;
+            local_boundary = session.saved_local_boundary;
+            eax = pa(eval_pattern(session.errorback), session.errorback);
+            pa_push(eax, string(pending_error));
+            session.errorback = NIL, pending_error = NULL;
+            goto apply;
+        }
+
+        else if(crossed_wind(unwind_protects, session.saved_unwind_protects))
+        {
+            /* escape to the bottom of the session, evaluating AFTERs
+             * of "unwind-protect" on the way, and raise the error
+             * again there */
+            k = continuation(NIL, session.saved_unwind_protects, session.id, 0);
+            eax = pa(1, k);
+            pa_push(eax, cons(catch_marker, string(pending_error)));
+            pending_error = NULL;
+            goto apply;
+        }
+
+        /* leave it to the caller of this session */
+        eax = NIL;
+        goto quit;
+    }
+
+  quit:                 /* here EAX is the result of this session. */
+
+    if(consp(eax) && car(eax) == catch_marker) /* an error escaped here */
+    {
+        strcpy(current_interp->error_buf, string_ptr(cdr(eax)));
+        pending_error = current_interp->error_buf;
+        eax = NIL;
+    }
+
+    o = eax;
+
+    /* restore registers of the caller */
+    callstack = session.saved_callstack, eax = session.saved_eax;
+    local_env = session.saved_local_env, global_env = session.saved_global_env;
+    local_boundary = session.saved_local_boundary;
+    unwind_protects = session.saved_unwind_protects;
+    current_session = session.prev;
+
+    return o;
+}
+
+lobj eval(lobj o, lobj errorback) { return eval_(o, errorback, 0); }
+
+/* non-0 iff O is a subr which must be handled by the evaluator. */
+int special_subrp(lobj o)
+{
+    lobj (*f)(lobj) = subr_function(o);
+
+    return f == f_subr_if || f == f_subr_evlis || f == f_subr_apply
+        || f == f_subr_unwind_protect || f == f_subr_call_cc || f == f_subr_call_ec
+        || f == f_subr_eval || f == f_subr_yield || f == f_subr_join
+        || f == f_subr_receive || f == f_subr_wait_input;
+}
+
+/* apply ARGS (a list of objects, not evaluated) to PROC and return
+ * the result. subrs are called directly, without running a
+ * session. like "eval", callers must check "escaping" after this. */
+lobj funcall(lobj proc, lobj args)
+{
+    lobj o;
+
+    if(subrp(proc) && !special_subrp(proc))
+    {
+        pargs num_args = subr_args(proc);
+        unsigned num_vals = 0;
+
+        for(o = args; o; o = cdr(o))
+            num_vals++;
+
+        if(num_vals == (num_args & 255)
+           || ((num_args & 255) < num_vals && (num_args & 256)))
+        {
+            o = (subr_function(proc))(args);
+
+            if(tail_call_proc)
             {
-                WITH_GC_PROTECTION()
-                    callstack = cons(array(4,
-                                           pa(0, subr(subr_apply)),
-                                           cons(cdr(vals), NIL),
-                                           save_current_env(1)),
-                                     callstack);
-                eax = pa(0, car(vals));
-                pa_push(eax, func);
-                goto apply;
+                proc = tail_call_proc, tail_call_proc = NIL;
+                return funcall(proc, tail_call_args);
             }
+
+            return o;
         }
     }
+
+    for(o = pa(eval_pattern(proc), proc); args; args = cdr(args))
+        pa_push(o, car(args));
+
+    return eval_(o, NIL, 1);
 }
 
 /* + INITIALIZE     ---------------- */
 
-/* initialize current ports, and the environment */
+/* marker symbols are shared by all interpreters */
+pthread_once_t markers_once = PTHREAD_ONCE_INIT;
+
+/* all interpreters, to be scanned by the collector */
+linterp *interps = NULL;
+pthread_mutex_t interps_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void scan_interps(void (*visit)(lobj))
+{
+    linterp *saved = current_interp;
+
+    /* threads not running (e.g. after "interp_leave") may make or
+     * free interpreters meanwhile */
+    pthread_mutex_lock(&interps_lock);
+
+    for(current_interp = interps; current_interp; current_interp = current_interp->next)
+    {
+        visit(local_env), visit(global_env), visit(callstack);
+        visit(eax), visit(unwind_protects);
+        visit(escape_cont), visit(escape_value);
+        visit(tail_call_proc), visit(tail_call_args);
+        visit(current_thread), visit(run_queue), visit(run_queue_last);
+        visit(io_waiters);
+    }
+
+    pthread_mutex_unlock(&interps_lock);
+
+    current_interp = saved;
+}
+
+#define SYMBOL_NAME(id, name) name,
+
+void make_markers()
+{
+    char* names[] = { WELL_KNOWN_SYMBOLS(SYMBOL_NAME) NULL };
+    unsigned ix;
+
+    /* not to collect (and wait for other threads) inside pthread_once */
+    gc_disable();
+
+    evlis_marker = symbol(), unwind_marker = symbol(), ec_marker = symbol();
+    catch_marker = symbol();
+    frame_shared = symbol(), frame_below_shared = symbol(), frame_boundary = symbol();
+    thread_marker = symbol();
+
+    for(ix = 0; ix < NUM_SYMBOLS; ix++)
+        well_known_symbols[ix] = intern(names[ix]);
+
+    gc_add_root(&evlis_marker), gc_add_root(&unwind_marker), gc_add_root(&ec_marker);
+    gc_add_root(&catch_marker);
+    gc_add_root(&frame_shared), gc_add_root(&frame_below_shared);
+    gc_add_root(&frame_boundary);
+    gc_add_root(&thread_marker);
+    gc_add_root_scanner(scan_interps);
+
+    gc_enable();
+}
+
+/* initialize current ports, and the environment of the current
+ * interpreter */
 void core_initialize()
 {
+    pthread_once(&markers_once, make_markers);
+
     current_in = stdin, current_out = stdout, current_err = stderr;
     local_env = callstack = unwind_protects = NIL, global_env = cons(NIL, NIL);
+    local_boundary = 0;
+    current_session = NULL, session_count = 0, last_parse_error = NULL;
+    stack_jumps = 0;
+    escape_cont = escape_value = tail_call_proc = tail_call_args = NIL;
+    run_queue = run_queue_last = io_waiters = NIL;
+    current_thread = thread(NIL, NIL, THREAD_RUNNING);
 
     bind(intern("if"), subr(subr_if), 0);
     bind(intern("evlis"), subr(subr_evlis), 0);
     bind(intern("apply"), subr(subr_apply), 0);
     bind(intern("unwind-protect"), subr(subr_unwind_protect), 0);
     bind(intern("call-cc"), subr(subr_call_cc), 0);
-    bind(intern("eval"), subr(subr_eval), 0);
+    bind(intern("call-ec"), subr(subr_call_ec), 0);
+    bind(SYM(EVAL), subr(subr_eval), 0);
+    bind(intern("yield"), subr(subr_yield), 0);
+    bind(intern("join"), subr(subr_join), 0);
+    bind(intern("receive"), subr(subr_receive), 0);
+    bind(intern("wait-input"), subr(subr_wait_input), 0);
+}
+
+/* make a new interpreter with builtin subrs bound. */
+linterp* interp_new()
+{
+    linterp *saved = current_interp, *interp;
+    lstats *saved_stats = current_stats;
+
+    if(!(interp = (linterp*)calloc(1, sizeof(linterp))))
+        return NULL;
+
+    pthread_mutex_lock(&interps_lock);
+    interp->next = interps, interps = interp;
+    pthread_mutex_unlock(&interps_lock);
+
+    current_interp = interp, current_stats = &interp->stats;
+    core_initialize();
+    subr_initialize();
+    current_interp = saved, current_stats = saved_stats;
+
+    return interp;
+}
+
+/* make INTERP the current interpreter of the calling OS thread. an
+ * interpreter must not be current in two OS threads at a time. */
+void interp_enter(linterp* interp)
+{
+    current_interp = interp, current_stats = &interp->stats;
+    gc_unblock(1);
+}
+
+/* tell the collector that the calling OS thread does not touch lisp
+ * objects until the next "interp_enter". */
+void interp_leave()
+{
+    gc_context ctx;
+
+    GC_SAVE_CONTEXT(ctx);
+    gc_block();
+}
+
+/* free INTERP. objects only it refers are collected later. */
+void interp_free(linterp* interp)
+{
+    linterp **p;
+    input_buffer *b;
+
+    if(current_interp == interp)
+        current_interp = NULL, current_stats = NULL;
+
+    if(interp->tracer)
+        tracer_free(interp->tracer);
+
+    while((b = interp->inputs))
+        interp->inputs = b->next, free(b);
+
+    pthread_mutex_lock(&interps_lock);
+    for(p = &interps; *p != interp; p = &(*p)->next);
+    *p = interp->next;
+    pthread_mutex_unlock(&interps_lock);
+
+    free(interp);
+}
+
+/* add counters of all interpreters to TOTAL */
+void interp_stats(lstats* total)
+{
+    linterp *i;
+    unsigned ix;
+
+    pthread_mutex_lock(&interps_lock);
+
+    for(i = interps; i; i = i->next)
+    {
+        for(ix = 0; ix < NUM_TYPES; ix++)
+            total->allocs[ix] += i->stats.allocs[ix];
+        total->alloc_bytes += i->stats.alloc_bytes;
+        total->evals += i->stats.evals, total->applies += i->stats.applies;
+        total->rets += i->stats.rets, total->captures += i->stats.captures;
+        total->lookups += i->stats.lookups, total->lookup_steps += i->stats.lookup_steps;
+    }
+
+    pthread_mutex_unlock(&interps_lock);
+}
+
+/* print counters of all interpreters, and of the collector */
+void stats_report(FILE* f)
+{
+    lstats st;
+    gc_stats gst;
+    unsigned ix;
+
+    memset(&st, 0, sizeof(lstats));
+    interp_stats(&st);
+    gc_get_stats(&gst);
+
+    fprintf(f, "evals        %lu\n", st.evals);
+    fprintf(f, "applies      %lu\n", st.applies);
+    fprintf(f, "rets         %lu\n", st.rets);
+    fprintf(f, "lookups      %lu (%.2f bindings scanned per lookup)\n", st.lookups,
+            st.lookups ? (double)st.lookup_steps / st.lookups : 0.0);
+    fprintf(f, "captures     %lu\n", st.captures);
+    fprintf(f, "allocated    %lu KB\n", st.alloc_bytes / 1024);
+
+    for(ix = 0; ix < NUM_TYPES; ix++)
+        if(st.allocs[ix])
+            fprintf(f, "  %-12s %lu\n", type_names[ix], st.allocs[ix]);
+
+    fprintf(f, "collections  %lu minor, %lu major\n", gst.minor_count, gst.major_count);
+    fprintf(f, "gc pauses    %lu usec total, %lu usec max\n", gst.total_pause, gst.max_pause);
+    fprintf(f, "heap         %lu KB (%lu KB old)\n", gst.heap_size / 1024, gst.old_size / 1024);
 }
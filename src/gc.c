@@ -0,0 +1,1030 @@
+#define _GNU_SOURCE             /* pthread_getattr_np, posix_memalign */
+
+#include "philisp.h"
+#include "gc.h"
+
+#include <stdlib.h>             /* malloc, realloc, free, posix_memalign */
+#include <string.h>             /* memset */
+#include <pthread.h>            /* pthread_mutex_lock, pthread_cond_wait, ... */
+#include <time.h>               /* clock_gettime, clock */
+
+/* the collector is generational and non-moving. young objects are
+ * allocated by bumping a cursor through free cells of the blocks a
+ * thread owns (the nursery), and survivors of a minor collection are
+ * promoted in place by flipping a flag. the old generation is marked
+ * incrementally, a slice per minor collection, and then swept lazily.
+ *
+ * stacks of threads are scanned conservatively, so C code needs no
+ * bookkeeping to keep its locals alive. pointers to old objects taken
+ * before a collection and written through after it are caught by
+ * re-remembering old objects which the stacks refer to. */
+
+/* + CONFIG         ---------------- */
+
+#define NURSERY_SIZE     (4 << 20) /* bytes allocated between minor collections */
+#define MAJOR_THRESHOLD  (8 << 20) /* minimum size of the old generation to mark */
+#define PAUSE_TARGET     5000      /* default pause target in microseconds */
+#define MARK_STEP        4096      /* objects marked per slice at least */
+#define SWEEP_STEP       16        /* blocks swept per slice at least */
+
+/* + HEAP           ---------------- */
+
+/* we cannot report errors with "fatal", as no interpreters may be
+ * running on this thread */
+void out_of_memory()
+{
+    fputs("FATAL: failed to allocate memory.\n", stderr);
+    exit(1);
+}
+
+/* the heap is made of BLOCK_SIZE-aligned blocks. a small block holds
+ * cells of a size class, and a large object owns blocks of its own.
+ * flags of objects live in the header of the block (one byte per
+ * GRANULE bytes), so that setting them never races with writes to
+ * the objects. */
+
+#define BLOCK_SIZE   (1 << 16)
+#define BLOCK_MASK   (~(size_t)(BLOCK_SIZE - 1))
+#define GRANULE      8
+#define LARGE_SIZE   8192       /* objects larger than this are large */
+#define CHUNK_BLOCKS 16         /* number of blocks allocated at a time */
+
+#define F_ALLOC 1               /* the cell holds an object */
+#define F_OLD   2               /* the object survived a collection */
+#define F_MARK  4               /* the object is reached in this collection */
+#define F_DIRTY 8               /* the object is in the remembered set */
+
+typedef struct block block;
+struct block
+{
+    size_t cell_size;           /* 0 if the block is free */
+    size_t first;               /* offset of the first cell */
+    unsigned cls, num_cells, free_cells;
+    int large, nursery, unswept;
+    block *next;                /* in a free list of blocks */
+    block *next_nursery;        /* in the nursery list */
+    block *prev_large, *next_large;
+    unsigned char *flags, large_flags[1];
+};
+
+#define ROUND_UP(n, unit) (((n) + (unit) - 1) / (unit) * (unit))
+#define SMALL_HEADER ROUND_UP(sizeof(block) + BLOCK_SIZE / GRANULE, GRANULE)
+#define LARGE_HEADER ROUND_UP(sizeof(block), 16)
+
+#define BLOCK_OF(o) ((block*)((size_t)(o) & BLOCK_MASK))
+#define FLAGS(b, p) ((b)->large ? (b)->flags : (b)->flags + ((char*)(p) - (char*)(b)) / GRANULE)
+
+/* conses have no headers, so they are allocated in blocks of their
+ * own class, and pointers to them are tagged (see "philisp.h") */
+#define CELL(b, off) ((lobj)((char*)(b) + (off) + ((b)->cls == CONS_CLASS ? CONS_TAG : 0)))
+#define FIXED(o) (!consp(o) && (o)->fixed)
+
+/* -- size classes -- */
+
+#define NUM_CLASSES 40
+#define CONS_CLASS  NUM_CLASSES /* an extra class of conses */
+
+size_t class_size[NUM_CLASSES + 1];
+unsigned char size_class[LARGE_SIZE / GRANULE + 1];
+
+/* classes are 8, 16, ..., 128, and then 4 steps per power of 2 up
+ * to LARGE_SIZE. conses are never allocated in the other classes. */
+void init_classes()
+{
+    unsigned c, ix;
+
+    for(c = 0; c < NUM_CLASSES; c++)
+        class_size[c] = c < 16 ? (c + 1) * GRANULE
+            : ((size_t)128 << (c - 16) / 4) / 4 * (5 + (c - 16) % 4);
+
+    for(c = ix = 0; ix <= LARGE_SIZE / GRANULE; ix++)
+    {
+        while(class_size[c] < ix * GRANULE)
+            c++;
+        size_class[ix] = c;
+    }
+
+    class_size[CONS_CLASS] = sizeof(lobj) * 2;
+}
+
+/* -- block table -- */
+
+/* maps addresses of blocks in the heap to their headers, to tell if
+ * a word on a stack points an object */
+
+typedef struct table_entry { size_t key; block *b; } table_entry;
+
+table_entry *table = NULL;      /* removed entries have b = NULL */
+size_t table_size = 0, table_used = 0;
+
+block* table_lookup(size_t key)
+{
+    size_t ix;
+
+    if(table_size)
+        for(ix = (key >> 16) & (table_size - 1); table[ix].key; ix = (ix + 1) & (table_size - 1))
+            if(table[ix].key == key)
+                return table[ix].b;
+
+    return NULL;
+}
+
+void table_insert(size_t key, block* b);
+
+void table_grow()
+{
+    table_entry *old = table;
+    size_t old_size = table_size, ix;
+
+    table_size = table_size ? table_size * 2 : 1024, table_used = 0;
+
+    if(!(table = (table_entry*)calloc(table_size, sizeof(table_entry))))
+        out_of_memory();
+
+    for(ix = 0; ix < old_size; ix++)
+        if(old[ix].b)
+            table_insert(old[ix].key, old[ix].b);
+
+    free(old);
+}
+
+void table_insert(size_t key, block* b)
+{
+    size_t ix;
+
+    if((table_used + 1) * 2 > table_size)
+        table_grow();
+
+    for(ix = (key >> 16) & (table_size - 1); table[ix].key; ix = (ix + 1) & (table_size - 1))
+        if(table[ix].key == key)
+        {
+            table[ix].b = b;
+            return;
+        }
+
+    table[ix].key = key, table[ix].b = b, table_used++;
+}
+
+void table_remove(size_t key)
+{
+    size_t ix;
+
+    for(ix = (key >> 16) & (table_size - 1); table[ix].key; ix = (ix + 1) & (table_size - 1))
+        if(table[ix].key == key)
+        {
+            table[ix].b = NULL;
+            return;
+        }
+}
+
+/* -- blocks -- */
+
+/* all small blocks ever made are in "blocks" (they are never
+ * returned to the OS). free ones are chained in "free_blocks", and
+ * ones with free cells which no threads own are in "available". */
+
+block **blocks = NULL, *free_blocks = NULL, *available[NUM_CLASSES + 1];
+unsigned num_blocks = 0, max_blocks = 0;
+block *large_objects = NULL;    /* all large objects */
+block *nursery = NULL;          /* blocks in which young objects are allocated */
+
+unsigned long heap_size = 0, old_size = 0, nursery_size = 0;
+
+void* alloc_aligned(size_t size)
+{
+    void *p;
+
+  #ifdef _WIN32
+    if(!(p = _aligned_malloc(size, BLOCK_SIZE)))
+        out_of_memory();
+  #endif
+  #ifndef _WIN32
+    if(posix_memalign(&p, BLOCK_SIZE, size))
+        out_of_memory();
+  #endif
+
+    return p;
+}
+
+void free_aligned(void* p)
+{
+  #ifdef _WIN32
+    _aligned_free(p);
+  #endif
+  #ifndef _WIN32
+    free(p);
+  #endif
+}
+
+block* new_block()
+{
+    block *b;
+    char *chunk;
+    unsigned ix;
+
+    if(!free_blocks)
+    {
+        if(num_blocks + CHUNK_BLOCKS > max_blocks)
+        {
+            max_blocks = max_blocks ? max_blocks * 2 : 64;
+            if(!(blocks = (block**)realloc(blocks, sizeof(block*) * max_blocks)))
+                out_of_memory();
+        }
+
+        chunk = (char*)alloc_aligned((size_t)BLOCK_SIZE * CHUNK_BLOCKS);
+        heap_size += (size_t)BLOCK_SIZE * CHUNK_BLOCKS;
+
+        for(ix = CHUNK_BLOCKS; ix--;)
+        {
+            b = (block*)(chunk + (size_t)BLOCK_SIZE * ix);
+            memset(b, 0, SMALL_HEADER);
+            b->flags = (unsigned char*)b + sizeof(block);
+            b->next = free_blocks, free_blocks = b;
+            blocks[num_blocks++] = b;
+            table_insert((size_t)b, b);
+        }
+    }
+
+    b = free_blocks, free_blocks = b->next;
+
+    return b;
+}
+
+/* make free block B a block of size class C */
+void init_block(block* b, unsigned c)
+{
+    b->cell_size = class_size[c], b->cls = c, b->first = SMALL_HEADER;
+    b->num_cells = b->free_cells = (BLOCK_SIZE - SMALL_HEADER) / class_size[c];
+    b->nursery = b->unswept = 0;
+}
+
+/* put block B, just swept, to the proper list */
+void release_block(block* b)
+{
+    if(b->free_cells == b->num_cells)
+        b->cell_size = 0, b->next = free_blocks, free_blocks = b;
+    else if(b->free_cells)
+        b->next = available[b->cls], available[b->cls] = b;
+}
+
+void free_large(block* b)
+{
+    size_t ix;
+
+    if(b->prev_large)
+        b->prev_large->next_large = b->next_large;
+    else
+        large_objects = b->next_large;
+
+    if(b->next_large)
+        b->next_large->prev_large = b->prev_large;
+
+    for(ix = 0; ix < LARGE_HEADER + b->cell_size; ix += BLOCK_SIZE)
+        table_remove((size_t)b + ix);
+
+    heap_size -= LARGE_HEADER + b->cell_size;
+    free_aligned(b);
+}
+
+/* return the object which P points (into), or NULL if none */
+lobj find_object(char* p)
+{
+    block *b = table_lookup((size_t)p & BLOCK_MASK);
+    char *o;
+
+    if(!b || !b->cell_size)
+        return NULL;
+
+    o = (char*)b + b->first;
+
+    if(b->large)
+    {
+        if(p < o || o + b->cell_size <= p)
+            return NULL;
+    }
+    else
+    {
+        if(p < o || (size_t)(p - o) / b->cell_size >= b->num_cells)
+            return NULL;
+        o += (size_t)(p - o) / b->cell_size * b->cell_size;
+    }
+
+    return *FLAGS(b, o) & F_ALLOC ? CELL(b, o - (char*)b) : NULL;
+}
+
+/* + MARK STACK     ---------------- */
+
+typedef struct mark_stack { lobj *items; size_t count, size; } mark_stack;
+
+/* "young_stack" is for minor collections, "grey_stack" holds old
+ * objects to be scanned by the incremental marker, "remembered" is
+ * the remembered set of old objects which may refer young ones, and
+ * "stack_refs" collects objects stacks refer to. */
+mark_stack young_stack, grey_stack, remembered, stack_refs;
+
+void stack_push(mark_stack* s, lobj o)
+{
+    if(s->count == s->size)
+    {
+        s->size = s->size ? s->size * 2 : 1024;
+        if(!(s->items = (lobj*)realloc(s->items, sizeof(lobj) * s->size)))
+            out_of_memory();
+    }
+
+    s->items[s->count++] = o;
+}
+
+/* + THREADS        ---------------- */
+
+#define T_RUNNING  0            /* may touch objects */
+#define T_PARKED   1            /* waiting for a collection to finish */
+#define T_BLOCKING 2            /* blocking, not touching objects */
+
+typedef struct gc_thread gc_thread;
+struct gc_thread
+{
+    char *stack_base, *stack_top; /* stack_top is valid unless running */
+    int state, disabled;
+    block *tlab[NUM_CLASSES + 1]; /* blocks this thread allocates in */
+    size_t cursor[NUM_CLASSES + 1]; /* offset of the next cell to try */
+    gc_thread *next;
+};
+
+gc_thread *threads = NULL;
+THREAD_LOCAL gc_thread* this_thread = NULL;
+
+/* "heap_lock" guards the heap and the list of threads. "heap_cond"
+ * is broadcasted when a thread stops running or a collection ends. */
+pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t heap_cond = PTHREAD_COND_INITIALIZER;
+pthread_mutex_t remembered_lock = PTHREAD_MUTEX_INITIALIZER;
+volatile int stop_requested = 0;
+
+pthread_once_t gc_once = PTHREAD_ONCE_INIT;
+pthread_key_t thread_key;       /* to unregister threads on exit */
+
+/* return an address in the frame of the caller's callee, below any
+ * frames of the caller (not inlined, called via a volatile pointer) */
+char* stack_pointer_()
+{
+    volatile char c = 0;
+    char * volatile p = (char*)&c;
+    return p;
+}
+
+char* (*volatile stack_pointer)() = stack_pointer_;
+
+char* stack_base(char* here)
+{
+  #ifdef __GLIBC__
+    pthread_attr_t attr;
+    void *addr;
+    size_t size;
+
+    if(!pthread_getattr_np(pthread_self(), &attr))
+    {
+        pthread_attr_getstack(&attr, &addr, &size);
+        pthread_attr_destroy(&attr);
+        return (char*)addr + size;
+    }
+  #endif
+
+    /* *NOTE* FRAMES ABOVE THE FIRST ALLOCATION ARE NOT SCANNED HERE */
+    return here;
+}
+
+void unregister_thread(void* arg)
+{
+    gc_thread *t = (gc_thread*)arg, **p;
+
+    pthread_mutex_lock(&heap_lock);
+
+    for(p = &threads; *p != t; p = &(*p)->next);
+    *p = t->next;
+
+    pthread_cond_broadcast(&heap_cond);
+    pthread_mutex_unlock(&heap_lock);
+
+    free(t);
+}
+
+void gc_initialize()
+{
+    init_classes();
+    pthread_key_create(&thread_key, unregister_thread);
+}
+
+gc_thread* register_thread()
+{
+    gc_thread *t;
+    char here;
+
+    pthread_once(&gc_once, gc_initialize);
+
+    if(!(t = (gc_thread*)calloc(1, sizeof(gc_thread))))
+        out_of_memory();
+
+    t->stack_base = stack_base(&here);
+
+    pthread_mutex_lock(&heap_lock);
+
+    while(stop_requested)
+        pthread_cond_wait(&heap_cond, &heap_lock);
+
+    t->state = T_RUNNING, t->next = threads, threads = t;
+
+    pthread_mutex_unlock(&heap_lock);
+
+    pthread_setspecific(thread_key, t);
+
+    return this_thread = t;
+}
+
+#define THIS_THREAD() (this_thread ? this_thread : register_thread())
+
+/* wait for the running collection to finish */
+void park(gc_thread* t)
+{
+    gc_context ctx;
+
+    GC_SAVE_CONTEXT(ctx);
+    t->stack_top = stack_pointer();
+
+    pthread_mutex_lock(&heap_lock);
+
+    t->state = T_PARKED;
+    pthread_cond_broadcast(&heap_cond);
+
+    while(stop_requested)
+        pthread_cond_wait(&heap_cond, &heap_lock);
+
+    t->state = T_RUNNING;
+
+    pthread_mutex_unlock(&heap_lock);
+}
+
+/* the caller must have saved registers with GC_SAVE_CONTEXT */
+int gc_block()
+{
+    gc_thread *t = this_thread;
+
+    if(!t || t->state != T_RUNNING)
+        return 0;
+
+    t->stack_top = stack_pointer();
+
+    pthread_mutex_lock(&heap_lock);
+    t->state = T_BLOCKING;
+    pthread_cond_broadcast(&heap_cond);
+    pthread_mutex_unlock(&heap_lock);
+
+    return 1;
+}
+
+/* if STATE is non-0, start running again (registering the thread if
+ * it is new) */
+void gc_unblock(int state)
+{
+    gc_thread *t = THIS_THREAD();
+
+    if(state && t->state == T_BLOCKING)
+    {
+        pthread_mutex_lock(&heap_lock);
+
+        while(stop_requested)
+            pthread_cond_wait(&heap_cond, &heap_lock);
+        t->state = T_RUNNING;
+
+        pthread_mutex_unlock(&heap_lock);
+    }
+}
+
+void gc_disable() { THIS_THREAD()->disabled++; }
+void gc_enable() { THIS_THREAD()->disabled--; }
+
+/* + ROOTS          ---------------- */
+
+lobj **roots = NULL;
+unsigned num_roots = 0;
+void (**scanners)(void (*)(lobj)) = NULL;
+unsigned num_scanners = 0;
+
+void gc_add_root(lobj* root)
+{
+    pthread_mutex_lock(&heap_lock);
+    if(!(roots = (lobj**)realloc(roots, sizeof(lobj*) * (num_roots + 1))))
+        out_of_memory();
+    roots[num_roots++] = root;
+    pthread_mutex_unlock(&heap_lock);
+}
+
+void gc_add_root_scanner(void (*scanner)(void (*)(lobj)))
+{
+    pthread_mutex_lock(&heap_lock);
+    if(!(scanners = (void(**)(void(*)(lobj)))realloc(scanners, sizeof(*scanners) * (num_scanners + 1))))
+        out_of_memory();
+    scanners[num_scanners++] = scanner;
+    pthread_mutex_unlock(&heap_lock);
+}
+
+/* call PRECISE with each root object, and CONSERVATIVE with each
+ * object which a word on the stacks points */
+void scan_roots(void (*precise)(lobj), void (*conservative)(lobj))
+{
+    gc_thread *t;
+    char **p;
+    lobj o;
+    unsigned ix;
+
+    for(t = threads; t; t = t->next)
+    {
+        for(p = (char**)ROUND_UP((size_t)t->stack_top, sizeof(char*)); (char*)(p + 1) <= t->stack_base; p++)
+            if((o = find_object(*p)))
+                conservative(o);
+    }
+
+    for(ix = 0; ix < num_roots; ix++)
+        precise(*roots[ix]);
+
+    for(ix = 0; ix < num_scanners; ix++)
+        scanners[ix](precise);
+}
+
+/* + BARRIER        ---------------- */
+
+void gc_write_barrier(lobj o)
+{
+    unsigned char *f;
+
+    if(!o || FIXED(o))
+        return;
+
+    f = FLAGS(BLOCK_OF(o), o);
+
+    if((*f & (F_OLD | F_DIRTY)) == F_OLD)
+    {
+        pthread_mutex_lock(&remembered_lock);
+        if(!(*f & F_DIRTY))
+            *f |= F_DIRTY, stack_push(&remembered, o);
+        pthread_mutex_unlock(&remembered_lock);
+    }
+}
+
+/* + COLLECTOR      ---------------- */
+
+#define MAJOR_IDLE     0
+#define MAJOR_MARKING  1
+#define MAJOR_SWEEPING 2
+
+int major_state = MAJOR_IDLE;
+unsigned long major_threshold = MAJOR_THRESHOLD;
+unsigned sweep_cursor;          /* index of the next block to sweep */
+
+unsigned long minor_count = 0, major_count = 0;
+unsigned long last_pause = 0, max_pause = 0, total_pause = 0;
+unsigned long pause_target = PAUSE_TARGET;
+
+unsigned long now()
+{
+  #if defined(CLOCK_MONOTONIC) && !defined(_WIN32)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+  #else
+    return clock() / (CLOCKS_PER_SEC / 1000000.0);
+  #endif
+}
+
+/* -- minor collection -- */
+
+void mark_young(lobj o)
+{
+    unsigned char *f;
+
+    if(o && !FIXED(o) && !(*(f = FLAGS(BLOCK_OF(o), o)) & (F_OLD | F_MARK)))
+        *f |= F_MARK, stack_push(&young_stack, o);
+}
+
+/* objects the stacks refer to are remembered until the next
+ * collection (see "minor_collection"), young ones included: they are
+ * promoted now, but may be in the middle of initialization (e.g. in
+ * "pa" parked on its second allocation), and written without the
+ * barrier. old objects in blocks not swept yet are garbage unless
+ * marked. */
+void mark_young_conservative(lobj o)
+{
+    unsigned char f = *FLAGS(BLOCK_OF(o), o);
+
+    if(!(f & F_OLD))
+        mark_young(o), stack_push(&stack_refs, o);
+    else if(!BLOCK_OF(o)->unswept || (f & F_MARK))
+        stack_push(&stack_refs, o);
+}
+
+/* free young objects in block B which are not marked, and promote
+ * the others */
+void sweep_young(block* b)
+{
+    unsigned char *f;
+    size_t off, end = b->first + b->num_cells * b->cell_size;
+
+    for(off = b->first; off < end; off += b->cell_size)
+        if((*(f = FLAGS(b, (char*)b + off)) & (F_ALLOC | F_OLD)) == F_ALLOC)
+        {
+            if(!(*f & F_MARK))
+            {
+                lobj_finalize(CELL(b, off));
+                *f = 0, b->free_cells++;
+            }
+            else
+            {
+                old_size += b->cell_size;
+
+                /* promoted objects are grey while marking */
+                if(major_state == MAJOR_MARKING)
+                    *f = F_ALLOC | F_OLD | F_MARK, stack_push(&grey_stack, CELL(b, off));
+                else
+                    *f = F_ALLOC | F_OLD;
+            }
+        }
+}
+
+void minor_collection()
+{
+    gc_thread *t;
+    block *b, *next;
+    unsigned char *f;
+    size_t ix;
+
+    for(t = threads; t; t = t->next)
+        memset(t->tlab, 0, sizeof(t->tlab));
+
+    scan_roots(mark_young, mark_young_conservative);
+
+    for(ix = 0; ix < remembered.count; ix++)
+        lobj_trace(remembered.items[ix], mark_young);
+
+    while(young_stack.count)
+        lobj_trace(young_stack.items[--young_stack.count], mark_young);
+
+    for(b = nursery; b; b = next)
+    {
+        next = b->next_nursery, b->nursery = 0;
+
+        if(!b->large)
+        {
+            sweep_young(b);
+            release_block(b);
+        }
+        else if(!(b->flags[0] & F_MARK))
+        {
+            lobj_finalize((lobj)((char*)b + b->first));
+            free_large(b);
+        }
+        else
+        {
+            old_size += b->cell_size;
+
+            if(major_state == MAJOR_MARKING)
+                b->flags[0] = F_ALLOC | F_OLD | F_MARK, stack_push(&grey_stack, (lobj)((char*)b + b->first));
+            else
+                b->flags[0] = F_ALLOC | F_OLD;
+        }
+    }
+    nursery = NULL, nursery_size = 0;
+
+    /* remembered objects already marked must be rescanned by the
+     * marker, as they may have new referents */
+    for(ix = 0; ix < remembered.count; ix++)
+    {
+        *(f = FLAGS(BLOCK_OF(remembered.items[ix]), remembered.items[ix])) &= ~F_DIRTY;
+
+        if(major_state == MAJOR_MARKING && (*f & F_MARK))
+            stack_push(&grey_stack, remembered.items[ix]);
+    }
+    remembered.count = 0;
+
+    /* objects the stacks refer to may be written via pointers taken
+     * before this collection, so remember them until the next one */
+    for(ix = 0; ix < stack_refs.count; ix++)
+        if(!(*(f = FLAGS(BLOCK_OF(stack_refs.items[ix]), stack_refs.items[ix])) & F_DIRTY))
+            *f |= F_DIRTY, stack_push(&remembered, stack_refs.items[ix]);
+    stack_refs.count = 0;
+
+    minor_count++;
+}
+
+/* -- major collection -- */
+
+/* major collections run only right after a minor collection, when
+ * no young objects exist */
+
+void mark_old(lobj o)
+{
+    unsigned char *f;
+
+    if(o && !FIXED(o) && !(*(f = FLAGS(BLOCK_OF(o), o)) & F_MARK))
+        *f |= F_MARK, stack_push(&grey_stack, o);
+}
+
+void major_start()
+{
+    major_state = MAJOR_MARKING;
+    scan_roots(mark_old, mark_old);
+}
+
+/* scan grey objects until DEADLINE (or until done if DEADLINE is 0).
+ * return non-0 iff no grey objects are left. */
+int major_mark(unsigned long deadline)
+{
+    unsigned long n = 0;
+
+    while(grey_stack.count)
+    {
+        lobj_trace(grey_stack.items[--grey_stack.count], mark_old);
+
+        if(deadline && ++n >= MARK_STEP && n % 256 == 0 && now() >= deadline)
+            return 0;
+    }
+
+    return 1;
+}
+
+/* finish marking, and start sweeping */
+void major_remark()
+{
+    block *b, *next;
+    unsigned ix;
+
+    scan_roots(mark_old, mark_old);
+    major_mark(0);
+
+    major_state = MAJOR_SWEEPING, sweep_cursor = 0, old_size = 0;
+
+    for(ix = 0; ix <= CONS_CLASS; ix++)
+        available[ix] = NULL;
+
+    for(ix = 0; ix < num_blocks; ix++)
+        blocks[ix]->unswept = blocks[ix]->cell_size != 0;
+
+    for(b = large_objects; b; b = next)
+    {
+        next = b->next_large;
+
+        if(!(b->flags[0] & F_MARK))
+        {
+            lobj_finalize((lobj)((char*)b + b->first));
+            free_large(b);
+        }
+        else
+            b->flags[0] &= ~F_MARK, old_size += b->cell_size;
+    }
+}
+
+void sweep_old(block* b)
+{
+    unsigned char *f;
+    size_t off, end = b->first + b->num_cells * b->cell_size;
+
+    for(off = b->first; off < end; off += b->cell_size)
+        if(*(f = FLAGS(b, (char*)b + off)) & F_ALLOC)
+        {
+            if(*f & F_MARK)
+                *f &= ~F_MARK, old_size += b->cell_size;
+            else
+            {
+                lobj_finalize(CELL(b, off));
+                *f = 0, b->free_cells++;
+            }
+        }
+
+    b->unswept = 0;
+    release_block(b);
+}
+
+/* sweep blocks until DEADLINE (or until done if DEADLINE is 0) */
+void major_sweep(unsigned long deadline)
+{
+    unsigned n = 0;
+
+    while(sweep_cursor < num_blocks)
+    {
+        if(blocks[sweep_cursor]->unswept)
+            sweep_old(blocks[sweep_cursor]);
+        sweep_cursor++;
+
+        if(deadline && ++n >= SWEEP_STEP && now() >= deadline)
+            return;
+    }
+
+    major_state = MAJOR_IDLE, major_count++;
+    major_threshold = old_size * 2 > MAJOR_THRESHOLD ? old_size * 2 : MAJOR_THRESHOLD;
+}
+
+/* -- stop the world -- */
+
+/* collect with the world stopped. called from thread SELF with
+ * "heap_lock" locked. if FULL is non-0, collect the whole heap,
+ * otherwise collect the nursery and run a slice of the major
+ * collection. */
+void collect(gc_thread* self, int full)
+{
+    gc_context ctx;
+    gc_thread *t;
+    unsigned long start, deadline;
+
+    if(stop_requested)          /* another thread is collecting */
+    {
+        pthread_mutex_unlock(&heap_lock);
+        park(self);
+        pthread_mutex_lock(&heap_lock);
+        return;
+    }
+
+    GC_SAVE_CONTEXT(ctx);
+    self->stack_top = stack_pointer();
+
+    stop_requested = 1;
+
+    /* wait for other threads to park or block. (threads which
+     * disabled the collector park after enabling it.) */
+    while(1)
+    {
+        for(t = threads; t && (t == self || t->state != T_RUNNING); t = t->next);
+
+        if(!t)
+            break;
+
+        pthread_cond_wait(&heap_cond, &heap_lock);
+    }
+
+    start = now(), deadline = start + pause_target;
+
+    minor_collection();
+
+    if(full)
+    {
+        if(major_state == MAJOR_SWEEPING)
+            major_sweep(0);
+        if(major_state == MAJOR_IDLE)
+            major_start();
+        major_mark(0);
+        major_remark();
+        major_sweep(0);
+    }
+    else
+    {
+        /* do not let the old generation grow too much while marking */
+        if(old_size >= major_threshold * 2)
+            deadline = 0;
+
+        if(major_state == MAJOR_IDLE && old_size >= major_threshold)
+            major_start();
+
+        if(major_state == MAJOR_MARKING && major_mark(deadline))
+            major_remark();
+
+        if(major_state == MAJOR_SWEEPING)
+            major_sweep(deadline);
+    }
+
+    last_pause = now() - start, total_pause += last_pause;
+    if(last_pause > max_pause)
+        max_pause = last_pause;
+
+    stop_requested = 0;
+    pthread_cond_broadcast(&heap_cond);
+}
+
+/* + ALLOCATOR      ---------------- */
+
+/* give thread SELF a new block of size class C to allocate in */
+void take_block(gc_thread* self, unsigned c)
+{
+    block *b;
+
+    pthread_mutex_lock(&heap_lock);
+
+    if(!self->disabled && (stop_requested || nursery_size >= NURSERY_SIZE))
+        collect(self, 0);
+
+    if((b = available[c]))
+        available[c] = b->next;
+    else
+        init_block(b = new_block(), c);
+
+    b->nursery = 1, b->next_nursery = nursery, nursery = b;
+    nursery_size += b->free_cells * b->cell_size;
+
+    self->tlab[c] = b, self->cursor[c] = b->first;
+
+    pthread_mutex_unlock(&heap_lock);
+}
+
+void* alloc_large(gc_thread* self, size_t size)
+{
+    block *b;
+    size_t ix;
+
+    pthread_mutex_lock(&heap_lock);
+
+    if(!self->disabled && (stop_requested || nursery_size >= NURSERY_SIZE))
+        collect(self, 0);
+
+    b = (block*)alloc_aligned(LARGE_HEADER + size);
+    memset(b, 0, LARGE_HEADER + size);
+
+    b->cell_size = size, b->first = LARGE_HEADER, b->num_cells = 1, b->large = 1;
+    b->flags = b->large_flags, b->flags[0] = F_ALLOC;
+
+    for(ix = 0; ix < LARGE_HEADER + size; ix += BLOCK_SIZE)
+        table_insert((size_t)b + ix, b);
+
+    if((b->next_large = large_objects))
+        large_objects->prev_large = b;
+    large_objects = b;
+
+    b->nursery = 1, b->next_nursery = nursery, nursery = b;
+    nursery_size += size, heap_size += LARGE_HEADER + size;
+
+    pthread_mutex_unlock(&heap_lock);
+
+    return (char*)b + LARGE_HEADER;
+}
+
+/* allocate SIZE bytes in a cell of class C */
+void* alloc_cell(gc_thread* self, unsigned c, size_t size)
+{
+    block *b;
+    unsigned char *f;
+    size_t off, end;
+
+    if(stop_requested && !self->disabled)
+        park(self);
+
+    while(1)
+    {
+        if((b = self->tlab[c]))
+            for(off = self->cursor[c], end = b->first + b->num_cells * b->cell_size;
+                off < end; off += b->cell_size)
+                if(!*(f = FLAGS(b, (char*)b + off)))
+                {
+                    *f = F_ALLOC, b->free_cells--;
+                    self->cursor[c] = off + b->cell_size;
+                    memset((char*)b + off, 0, size);
+                    return (char*)b + off;
+                }
+
+        take_block(self, c);
+    }
+}
+
+void* gc_alloc(size_t size)
+{
+    gc_thread *self = THIS_THREAD();
+
+    if(size > LARGE_SIZE)
+    {
+        if(stop_requested && !self->disabled)
+            park(self);
+        return alloc_large(self, size);
+    }
+
+    return alloc_cell(self, size_class[(size + GRANULE - 1) / GRANULE], size);
+}
+
+void* gc_alloc_cons()
+{
+    return alloc_cell(THIS_THREAD(), CONS_CLASS, sizeof(lobj) * 2);
+}
+
+void gc_collect()
+{
+    gc_thread *self = THIS_THREAD();
+
+    if(self->disabled)
+        return;
+
+    pthread_mutex_lock(&heap_lock);
+    collect(self, 1);
+    pthread_mutex_unlock(&heap_lock);
+}
+
+/* + STATISTICS     ---------------- */
+
+void gc_get_stats(gc_stats* s)
+{
+    pthread_mutex_lock(&heap_lock);
+    s->minor_count = minor_count, s->major_count = major_count;
+    s->heap_size = heap_size, s->old_size = old_size, s->nursery_size = nursery_size;
+    s->last_pause = last_pause, s->max_pause = max_pause, s->total_pause = total_pause;
+    s->pause_target = pause_target;
+    pthread_mutex_unlock(&heap_lock);
+}
+
+void gc_set_pause_target(unsigned long usec)
+{
+    pthread_mutex_lock(&heap_lock);
+    pause_target = usec;
+    pthread_mutex_unlock(&heap_lock);
+}
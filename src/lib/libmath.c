@@ -1,21 +1,69 @@
 #include "philisp.h"
+#include "core.h"
 
 #include <math.h>
 
-/* *FIXME* 型エラーどうやって通知するねん */
+/* load with (require "lib/libmath.so") */
 
-DEFSUBR(math_sin, E, _)(lobj args)
+/* the value of O, the IX-th arg for NAME, as a double */
+double math_arg(lobj o, char* name, unsigned ix)
 {
-    if(integerp(car(args)))
-        return floating(sin((double)integer_value(car(args))));
+    if(integerp(o))
+        return (double)integer_value(o);
+    else if(floatingp(o))
+        return floating_value(o);
     else
-        return floating(sin(floating_value(car(args))));
+        type_error(name, ix, "number");
+
+    return 0;
 }
 
-DEFSUBR(math_cos, E, _)(lobj args)
+#define DEFINE_MATH_SUBR(name, cfn)                                     \
+    DEFSUBR(name, E, _)(lobj args)                                      \
+    {                                                                   \
+        return floating(cfn(math_arg(car(args), "subr \"" #cfn "\"", 0))); \
+    }                                                                   \
+
+/* (sin NUM) => sine of NUM. */
+DEFINE_MATH_SUBR(math_sin, sin)
+
+/* (cos NUM) => cosine of NUM. */
+DEFINE_MATH_SUBR(math_cos, cos)
+
+/* (tan NUM) => tangent of NUM. */
+DEFINE_MATH_SUBR(math_tan, tan)
+
+/* (atan NUM) => arc tangent of NUM. */
+DEFINE_MATH_SUBR(math_atan, atan)
+
+/* (sqrt NUM) => square root of NUM. */
+DEFINE_MATH_SUBR(math_sqrt, sqrt)
+
+/* (exp NUM) => e to the NUM. */
+DEFINE_MATH_SUBR(math_exp, exp)
+
+/* (log NUM) => natural logarithm of NUM. */
+DEFINE_MATH_SUBR(math_log, log)
+
+/* (pow NUM1 NUM2) => NUM1 to the NUM2. */
+DEFSUBR(math_pow, E E, _)(lobj args)
 {
-    if(integerp(car(args)))
-        return floating(cos((double)integer_value(car(args))));
-    else
-        return floating(cos(floating_value(car(args))));
+    return floating(pow(math_arg(car(args), "subr \"pow\"", 0),
+                        math_arg(car(cdr(args)), "subr \"pow\"", 1)));
 }
+
+lmodule_entry math_entries[] = {
+    { "sin", &math_sin },
+    { "cos", &math_cos },
+    { "tan", &math_tan },
+    { "atan", &math_atan },
+    { "sqrt", &math_sqrt },
+    { "exp", &math_exp },
+    { "log", &math_log },
+    { "pow", &math_pow },
+    { NULL, NULL }
+};
+
+void math_init() { bind(intern("pi"), floating(4 * atan(1)), 0); }
+
+DEFMODULE(math_entries, math_init);
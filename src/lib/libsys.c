@@ -0,0 +1,107 @@
+#define _POSIX_C_SOURCE 200112L /* popen, pclose */
+
+#include "philisp.h"
+#include "core.h"
+#include "gc.h"
+
+#include <stdio.h>              /* popen, pclose */
+#include <stdlib.h>             /* getenv, system, exit */
+#include <time.h>               /* time, clock */
+
+/* load with (require "lib/libsys.so") */
+
+/* (getenv NAME) => value of environment variable NAME as a string, or
+ * () if NAME is not set. */
+DEFSUBR(sys_getenv, E, _)(lobj args)
+{
+    char *val;
+
+    if(!stringp(car(args)))
+        return type_error("subr \"getenv\"", 0, "string");
+
+    return (val = getenv(string_cstr(car(args)))) ? string(val) : NIL;
+}
+
+/* (system COMMAND) => run COMMAND with the shell and return its exit
+ * status. */
+DEFSUBR(sys_system, E, _)(lobj args)
+{
+    char* command;
+    int status;
+
+    if(!stringp(car(args)))
+        return type_error("subr \"system\"", 0, "string");
+
+    command = string_cstr(car(args));
+    BLOCKING(status = system(command));
+
+    return integer(status);
+}
+
+/* (popen COMMAND [WRITABLE ERRORBACK]) => run COMMAND with the shell
+ * and return a stream connected to its stdout (or stdin, if WRITABLE
+ * is non-()). reading the stream with "getc" lets other threads run
+ * while no input is available. */
+DEFSUBR(sys_popen, E, E)(lobj args)
+{
+    FILE* f;
+
+    if(!stringp(car(args)))
+        return type_error("subr \"popen\"", 0, "string");
+
+    if(!(f = popen(string_cstr(car(args)), cdr(args) && car(cdr(args)) ? "w" : "r")))
+    {
+        if(cdr(args) && cdr(cdr(args)))
+            return call_errorback(car(cdr(cdr(args))), "failed to run command.");
+        else
+            return lisp_error("failed to run command.");
+    }
+
+    return stream(f);
+}
+
+/* (pclose STREAM) => close STREAM opened by "popen", and return the
+ * exit status of the command. */
+DEFSUBR(sys_pclose, E, _)(lobj args)
+{
+    FILE* f;
+    int status;
+
+    if(!streamp(car(args)))
+        return type_error("subr \"pclose\"", 0, "stream");
+
+    f = stream_value(car(args));
+    input_forget(f);
+    BLOCKING(status = pclose(f));
+
+    return integer(status);
+}
+
+/* (time) => seconds since the epoch. */
+DEFSUBR(sys_time, _, _)(lobj args) { (void)args; return integer((int)time(NULL)); }
+
+/* (clock) => processor time used so far, in seconds. */
+DEFSUBR(sys_clock, _, _)(lobj args) { (void)args; return floating((double)clock() / CLOCKS_PER_SEC); }
+
+/* (exit [STATUS]) => terminate the interpreter with STATUS, which
+ * defaults to 0. */
+DEFSUBR(sys_exit, _, E)(lobj args)
+{
+    if(args && !integerp(car(args)))
+        return type_error("subr \"exit\"", 0, "integer");
+
+    exit(args ? integer_value(car(args)) : 0);
+}
+
+lmodule_entry sys_entries[] = {
+    { "getenv", &sys_getenv },
+    { "system", &sys_system },
+    { "popen", &sys_popen },
+    { "pclose", &sys_pclose },
+    { "time", &sys_time },
+    { "clock", &sys_clock },
+    { "exit", &sys_exit },
+    { NULL, NULL }
+};
+
+DEFMODULE(sys_entries, NULL);
@@ -1,22 +1,174 @@
 /* phi-lisp interpreter (prototype) : 2014 zk_phi */
 
+#define _POSIX_C_SOURCE 200809L /* fmemopen */
+
 #include "philisp.h"
 #include "core.h"
 #include "subr.h"
+#include "trace.h"
 
 #include <stdio.h>
+#include <stdlib.h>             /* atexit, exit, malloc */
+#include <string.h>             /* strcmp, strlen */
+
+void report_stats(void) { stats_report(stderr); }
+
+char* trace_file = NULL;
+
+/* batch mode : forms are evaluated without prompts and results */
+int batch = 0;
+char* script = NULL;            /* file to run, or NULL for stdin */
+char** exprs = NULL;            /* NULL-terminated "-e" expressions */
+
+void usage()
+{
+    fputs("usage: philisp [--stats] [--trace FILE] [-q] [-e EXPR]... [SCRIPT]\n", stderr);
+    exit(2);
+}
+
+/* --stats      : print counters of the interpreter to stderr on exit
+ * --trace FILE : trace the evaluator, and write the trace to FILE on
+ *                errors (see "trace-start")
+ * -q           : batch mode, reading forms from stdin
+ * -e EXPR      : evaluate forms in EXPR in batch mode (may be repeated)
+ * SCRIPT       : evaluate forms in the file SCRIPT in batch mode */
+void parse_options(int argc, char** argv)
+{
+    int ix, n = 0;
+
+    if(!(exprs = (char**)malloc(sizeof(char*) * argc)))
+        exit(2);
+
+    for(ix = 1; ix < argc; ix++)
+        if(!strcmp(argv[ix], "--stats"))
+            atexit(report_stats);
+        else if(!strcmp(argv[ix], "--trace") && ix + 1 < argc)
+            trace_file = argv[++ix];
+        else if(!strcmp(argv[ix], "-q"))
+            batch = 1;
+        else if(!strcmp(argv[ix], "-e") && ix + 1 < argc)
+            exprs[n++] = argv[++ix], batch = 1;
+        else if(argv[ix][0] != '-' && !script)
+            script = argv[ix], batch = 1;
+        else
+        {
+            fprintf(stderr, "unknown option: %s\n", argv[ix]);
+            usage();
+        }
+
+    exprs[n] = NULL;
+}
+
+/* make the interpreter of the main thread */
+void main_interp()
+{
+    interp_enter(interp_new());
+
+    if(trace_file && !(current_interp->tracer = tracer_new(trace_file, TRACE_DEFAULT_SIZE)))
+        fatal("failed to allocate memory.");
+}
+
+/* the input of "batch-next" */
+FILE* batch_in;
+
+/* read the next form from batch_in, and return a list of it, or () on
+ * EOF. forms may read the rest of stdin via "read" or "getc" when
+ * batch_in is not stdin. */
+DEFSUBR(batch_next, _, _)(lobj args)
+{
+    FILE* in = current_in;
+    lobj o;
+
+    (void)args;
+
+    current_in = batch_in;
+
+    if(read_eof())
+    {
+        current_in = in;
+        return NIL;
+    }
+
+    o = read();
+    current_in = in;
+
+    if(last_parse_error)
+        return lisp_error(last_parse_error);
+
+    return cons(o, NIL);
+}
+
+/* read forms from F and evaluate them one by one, until EOF. errors
+ * not caught exit with status 1. forms are evaluated in one session,
+ * as in the repl, so that continuations captured in a form can be
+ * called from later forms. */
+void run_forms(FILE* f)
+{
+    lobj batch_loop, value = symbol(), form = symbol();
+
+    batch_loop =
+        list(2, function(512+1, list(1, intern("batch")),
+                         list(3, intern("batch"), NIL, list(1, subr(batch_next)))),
+             function((3 << 9) + 2, list(2, value, form),
+                      list(4, intern("if"), form,
+                           list(3, intern("batch"),
+                                list(2, intern("eval"), list(2, intern("car"), form)),
+                                list(1, subr(batch_next))),
+                           NIL)));
+    /* = ((fn (batch) (batch () (batch-next))) */
+    /*    (fn (gensym1 gensym2) */
+    /*      (if gensym2 (batch (eval (car gensym2)) (batch-next)) ()))) */
+
+    batch_in = f;
+    eval(batch_loop, NIL);
+
+    if(pending_error)
+        exit(1);
+}
+
+/* run "-e" expressions, then SCRIPT (or stdin), and exit */
+void run_batch()
+{
+    FILE* f;
+    char** e;
+
+    for(e = exprs; *e; e++)
+    {
+        if(!(f = fmemopen(*e, strlen(*e), "r")))
+            fatal("failed to allocate memory.");
+
+        run_forms(f);
+        input_forget(f), fclose(f);
+    }
+
+    if(script)
+    {
+        if(!(f = fopen(script, "r")))
+        {
+            fprintf(stderr, "cannot open %s\n", script);
+            exit(2);
+        }
+
+        run_forms(f);
+        input_forget(f), fclose(f);
+    }
+    else if(!*exprs)
+        run_forms(stdin);
+
+    exit(0);
+}
 
 #if DEBUG
-lobj local_env, global_env;
-lobj eval(lobj, lobj);
-void print(FILE*, lobj);
-lobj read();
-int main(void)
+int main(int argc, char** argv)
 {
     lobj saved_env;
 
-    core_initialize();
-    subr_initialize();
+    parse_options(argc, argv);
+
+    main_interp();
+
+    if(batch)
+        run_batch();
 
     /* use pseudo-repl to reduce debug output. */
     saved_env = save_current_env(1);
@@ -26,15 +178,22 @@ int main(void)
         restore_current_env(saved_env);
         print(stdout, eval(read(), NIL));
         puts("\n"); fflush(stdout);
+
+        if(pending_error && input_eof(stdin))
+            exit(1);
+        pending_error = NULL;
     }
 }
 #endif
 
 #if !DEBUG
-lobj eval(lobj, lobj);
-int main(void)
+int main(int argc, char** argv)
 {
-    lobj repl =
+    lobj repl;
+
+    parse_options(argc, argv);
+
+    repl =
         list(2, function(512+1, list(1, intern("repl")), list(1, intern("repl"))),
              function((~0) << 8, symbol(),
                       list(4, intern("repl"),
@@ -46,8 +205,21 @@ int main(void)
     /* = ((fn (repl) (repl)) */
     /*    (fn (gensym) (repl (puts ">> ") (print (eval (read))) (puts "\n\n")))) */
 
-    core_initialize();
-    subr_initialize();
-    eval(repl, NIL);
+    main_interp();
+
+    if(batch)
+        run_batch();
+
+    /* errors not caught abandon the current input, and restart the
+     * repl. the heap and global bindings are kept. */
+    while(1)
+    {
+        eval(repl, NIL);
+
+        if(input_eof(stdin))
+            exit(1);
+        pending_error = NULL;
+        puts("\n"); fflush(stdout);
+    }
 }
 #endif
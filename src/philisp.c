@@ -1,75 +1,126 @@
 #include "philisp.h"
+#include "gc.h"
 
 #include <stdio.h>              /* puts, putc, getc */
 #include <stdlib.h>             /* exit, malloc, free */
-#include <string.h>             /* strlen */
+#include <string.h>             /* strlen, memcmp, memcpy */
 #include <stdarg.h>             /* va_start, va_list, va_end */
+#include <pthread.h>            /* pthread_mutex_lock, pthread_mutex_unlock */
 
 /* + TYPE_TAGS      ---------------- */
 
-#define TYPE_SYMB  0  /* symbol                                            */
-#define TYPE_CHAR  1  /* char                                              */
-#define TYPE_INT   2  /* int                                               */
-#define TYPE_FLOAT 3  /* float                                             */
-#define TYPE_STRM  4  /* stream (= FILE*)                                  */
-#define TYPE_CONS  5  /* cons         : lobj + lobj                        */
-#define TYPE_ARR   6  /* array        : length + (lobj, lobj, lobj, ...)   */
-#define TYPE_STR   7  /* (STRs are distinguished from ARRs INTERNALLY)     */
-#define TYPE_SUBR  8  /* C-function   : arity + lsubr                      */
-#define TYPE_FUNC  9  /* function     : formals + body                     */
-#define TYPE_CONT  10 /* continuation : call stack + environ               */
-#define TYPE_CLOS  11 /* closure      : function or subr + bindings        */
-#define TYPE_PA    12 /* partially applied function                        */
+/* tags are defined in "philisp.h" */
+
+char* type_names[NUM_TYPES] = {
+    "symbol", "char", "int", "float", "stream", "cons", "array", "string",
+    "subr", "function", "continuation", "closure", "pa", "thread", "channel",
+    "future", "scope", "environment"
+};
 
 /* + ALLOCATOR      ---------------- */
 
-/* *TODO* IMPLEMENT BETTER ALLOCATOR */
-/* *TODO* IMPLEMENT GC */
+/* objects are allocated in the heap of the collector (see "gc.c"),
+ * except "fixed" ones which are never freed */
 
-unsigned int gc_protected = 0, gc_protect_count = 0;
-lobj gc_protected_items[GC_PROTECT_MAX];
+THREAD_LOCAL lstats* current_stats = NULL;
 
-void gc_protect(lobj o)
+lobj alloc_lobj(int type, size_t data_size)
 {
-    /* we cannot alloc any lisp objects here (so use array) */
-    if(gc_protect_count == GC_PROTECT_MAX)
+    lobj o = (lobj)gc_alloc(sizeof(struct lobj) + data_size - 1);
+    o->fixed = 0, o->type = type;
+
+    if(current_stats)
     {
-        fputs("INTERNAL ERROR: GC protection error.", stderr);
-        exit(1);
+        current_stats->allocs[type]++;
+        current_stats->alloc_bytes += sizeof(struct lobj) + data_size - 1;
     }
-    else
-        gc_protected_items[gc_protect_count++] = o;
+
+    return o;
 }
 
-lobj alloc_lobj(int type, size_t data_size)
+/* conses are allocated without headers (see "philisp.h") */
+
+#define CONS_CELL(o) ((lobj*)((char*)(o) - CONS_TAG))
+
+lobj alloc_cons()
 {
-    lobj o = (lobj)malloc(sizeof(struct lobj) + data_size - 1);
-    o->mark = 0, o->type = type;
-    if(gc_protected) gc_protect(o);
+    lobj o = (lobj)((char*)gc_alloc_cons() + CONS_TAG);
+
+    if(current_stats)
+    {
+        current_stats->allocs[TYPE_CONS]++;
+        current_stats->alloc_bytes += sizeof(lobj) * 2;
+    }
+
+    return o;
+}
+
+lobj alloc_fixed(int type, size_t data_size)
+{
+    lobj o = (lobj)calloc(1, sizeof(struct lobj) + data_size);
+
+    if(!o)
+    {
+        fputs("FATAL: failed to allocate memory.\n", stderr);
+        exit(1);
+    }
+
+    o->fixed = 1, o->type = type;
     return o;
 }
 
-void (*free_lobj)(lobj) = (void(*)(lobj))free;
+/* call VISIT with each object O refers to */
+void lobj_trace(lobj o, void (*visit)(lobj))
+{
+    lobj *ptr = consp(o) ? CONS_CELL(o) : (lobj*)(o->data);
+    unsigned len;
+
+    switch(TYPE_OF(o))
+    {
+      case TYPE_CONS: case TYPE_CLOS: case TYPE_CONT: len = 2; break;
+      case TYPE_THRD: case TYPE_CHAN: len = 3; break;
+      case TYPE_FUNC: ptr = (lobj*)&(((pargs*)(o->data))[1]), len = 3; break;
+      case TYPE_PA: ptr = (lobj*)&(((int*)(o->data))[2]), len = 2; break;
+      case TYPE_FUTR: ptr = future_ptr(o), len = 2; break;
+      case TYPE_ARR: ptr = (lobj*)&(((unsigned*)(o->data))[1]), len = array_length(o); break;
+      case TYPE_SCOP: ptr = (lobj*)&(((unsigned*)(o->data))[1]), len = 1 + 2 * scope_count(o); break;
+      case TYPE_ENV: ptr = (lobj*)&(((unsigned*)(o->data))[1]), len = 2; break;
+      case TYPE_STR: ptr = (lobj*)&(((unsigned*)(o->data))[1]), len = !!string_view(o); break;
+      default: len = 0;
+    }
+
+    while(len--)
+        visit(*ptr++);
+}
+
+/* release resources of O, which is being freed */
+void lobj_finalize(lobj o)
+{
+    if(futurep(o))
+        free(future_task(o));
+}
 
 /* + SYMBOL         ---------------- */
 
 /* *TODO* REDUCE MEMORY CONSUMPTION */
 /* *TODO* IMPROVE REVERSE-INTERN EFFICIENCY */
 
-int symbolp(lobj o) { return o && o->type == TYPE_SYMB; }
 lobj symbol() { return alloc_lobj(TYPE_SYMB, 0); }
 
+/* interned symbols are fixed, as the table refers to them */
+lobj fixed_symbol() { return alloc_fixed(TYPE_SYMB, 0); }
+
 /* -- intern -- */
 
 /* symbol tree is a trie tree of (string -> symbol) */
 typedef struct table_node *table_node;
 struct table_node { table_node bros, child; char ch; lobj symb; };
 
+/* the table is shared by all interpreters, guarded by this lock */
 table_node symbol_table = NULL;
+pthread_mutex_t symbol_table_lock = PTHREAD_MUTEX_INITIALIZER;
 
-/* search for a symbol associated with NAME. if it does not exist,
- * make it. */
-lobj intern(char* name)
+lobj intern_(char* name)
 {
     table_node *tptr = &symbol_table;
 
@@ -82,7 +133,7 @@ lobj intern(char* name)
             (*tptr)->symb = NIL, (*tptr)->ch = *name;
 
             if(*name == '\0')
-                return (*tptr)->symb = symbol();
+                return (*tptr)->symb = fixed_symbol();
 
             tptr = &((*tptr)->child), name++;
         }
@@ -90,7 +141,7 @@ lobj intern(char* name)
         else if(*name == (*tptr)->ch)
         {
             if(*name == '\0')
-                return (*tptr)->symb ? (*tptr)->symb : ((*tptr)->symb = symbol());
+                return (*tptr)->symb ? (*tptr)->symb : ((*tptr)->symb = fixed_symbol());
 
             tptr = &((*tptr)->child), name++;
         }
@@ -100,6 +151,19 @@ lobj intern(char* name)
     }
 }
 
+/* search for a symbol associated with NAME. if it does not exist,
+ * make it. */
+lobj intern(char* name)
+{
+    lobj o;
+
+    pthread_mutex_lock(&symbol_table_lock);
+    o = intern_(name);
+    pthread_mutex_unlock(&symbol_table_lock);
+
+    return o;
+}
+
 /* -- reverse intern -- */
 
 int rintern_(lobj symbol, char* name, table_node table, unsigned size)
@@ -129,24 +193,39 @@ int rintern_(lobj symbol, char* name, table_node table, unsigned size)
  * SIZE, return non-0 value. */
 int rintern(lobj symbol, char* name, unsigned size)
 {
-    return rintern_(symbol, name, symbol_table, size);
+    int ret;
+
+    pthread_mutex_lock(&symbol_table_lock);
+    ret = rintern_(symbol, name, symbol_table, size);
+    pthread_mutex_unlock(&symbol_table_lock);
+
+    return ret;
 }
 
 /* + CHAR           ---------------- */
 
-int characterp(lobj o) { return o && o->type == TYPE_CHAR; }
 char character_value(lobj o) { return *(o->data); }
 
+/* characters are fixed, and made only once for each */
+struct lobj characters[256];
+pthread_once_t characters_once = PTHREAD_ONCE_INIT;
+
+void make_characters()
+{
+    unsigned ix;
+
+    for(ix = 0; ix < 256; ix++)
+        characters[ix].fixed = 1, characters[ix].type = TYPE_CHAR, characters[ix].data[0] = ix;
+}
+
 lobj character(char ch)
 {
-    lobj o = alloc_lobj(TYPE_CHAR, 1);
-    *(char*)(o->data) = ch;
-    return o;
+    pthread_once(&characters_once, make_characters);
+    return &characters[(unsigned char)ch];
 }
 
 /* + INT            ---------------- */
 
-int integerp(lobj o) { return o && o->type == TYPE_INT; }
 int integer_value(lobj o) { return *(int*)(o->data); }
 
 lobj integer(int i)
@@ -158,7 +237,6 @@ lobj integer(int i)
 
 /* + FLOAT          ---------------- */
 
-int floatingp(lobj o) { return o && o->type == TYPE_FLOAT; }
 double floating_value(lobj o) { return *(double*)(o->data); }
 
 lobj floating(double d)
@@ -170,7 +248,6 @@ lobj floating(double d)
 
 /* + STREAM         ---------------- */
 
-int streamp(lobj o) { return o && o->type == TYPE_STRM; }
 FILE* stream_value(lobj o) { return *(FILE**)(o->data); }
 
 lobj stream(FILE *f)
@@ -182,20 +259,19 @@ lobj stream(FILE *f)
 
 /* + CONS           ---------------- */
 
-int consp(lobj o) { return o && o->type == TYPE_CONS; }
-lobj car(lobj o) { return ((lobj*)(o->data))[0]; }
-lobj cdr(lobj o) { return ((lobj*)(o->data))[1]; }
+lobj car(lobj o) { return CONS_CELL(o)[0]; }
+lobj cdr(lobj o) { return CONS_CELL(o)[1]; }
 
 lobj cons(lobj car, lobj cdr)
 {
-    lobj o = alloc_lobj(TYPE_CONS, sizeof(lobj) * 2);
-    ((lobj*)(o->data))[0] = car;
-    ((lobj*)(o->data))[1] = cdr;
+    lobj o = alloc_cons();
+    CONS_CELL(o)[0] = car;
+    CONS_CELL(o)[1] = cdr;
     return o;
 }
 
-void setcar(lobj o, lobj newcar) { ((lobj*)(o->data))[0] = newcar; }
-void setcdr(lobj o, lobj newcdr) { ((lobj*)(o->data))[1] = newcdr; }
+void setcar(lobj o, lobj newcar) { CONS_CELL(o)[0] = newcar; gc_write_barrier(o); }
+void setcdr(lobj o, lobj newcdr) { CONS_CELL(o)[1] = newcdr; gc_write_barrier(o); }
 
 /* (proper) list */
 
@@ -214,9 +290,8 @@ lobj list(unsigned len, ...)
 
         o = cons(va_arg(rest, lobj), NIL), len--;
 
-        WITH_GC_PROTECTION()
-            for(last = o; len--; last = cdr(last))
-                setcdr(last, cons(va_arg(rest, lobj), NIL));
+        for(last = o; len--; last = cdr(last))
+            setcdr(last, cons(va_arg(rest, lobj), NIL));
 
         va_end(rest);
 
@@ -226,9 +301,15 @@ lobj list(unsigned len, ...)
 
 /* + ARRAY          ---------------- */
 
-int arrayp(lobj o) { return o && o->type == TYPE_ARR; }
 unsigned array_length(lobj o) { return ((unsigned*)(o->data))[0]; }
-lobj* array_ptr(lobj o) { return (lobj*)&(((unsigned*)(o->data))[1]); }
+
+/* the caller may store objects via the pointer, so O is remembered
+ * by the collector */
+lobj* array_ptr(lobj o)
+{
+    gc_write_barrier(o);
+    return (lobj*)&(((unsigned*)(o->data))[1]);
+}
 
 lobj alloc_array(unsigned size)
 {
@@ -262,8 +343,31 @@ lobj array(unsigned size, ...)
 
 /* + STRING         ---------------- */
 
-unsigned (*string_length)(lobj o) = array_length;
-char* (*string_ptr)(lobj o) = (char*(*)(lobj))array_ptr;
+/* a string is either its own chars (length + chars + '\0'), or a
+ * substring which shares the chars of another string (length with
+ * STRING_VIEW + parent + offset). parents are flagged STRING_SHARED,
+ * so that they are never transformed into arrays under substrings.
+ * substrings are not terminated with '\0', so C functions must be
+ * given "string_cstr". */
+
+#define STRING_VIEW   ((unsigned)1 << 31)
+#define STRING_SHARED ((unsigned)1 << 30)
+
+char* string_chars(lobj o) { return (char*)&(((unsigned*)(o->data))[1]); }
+
+int string_view(lobj o) { return ((unsigned*)(o->data))[0] & STRING_VIEW; }
+int string_shared(lobj o) { return ((unsigned*)(o->data))[0] & (STRING_VIEW | STRING_SHARED); }
+lobj string_base(lobj o) { return string_view(o) ? *(lobj*)&(((unsigned*)(o->data))[1]) : o; }
+
+unsigned string_length(lobj o) { return ((unsigned*)(o->data))[0] & ~(STRING_VIEW | STRING_SHARED); }
+
+char* string_ptr(lobj o)
+{
+    if(string_view(o))
+        return string_chars(string_base(o)) + ((unsigned*)(o->data))[3];
+
+    return string_chars(o);
+}
 
 lobj make_string(unsigned len, char init)
 {
@@ -294,7 +398,38 @@ lobj string(char* str)
     return o;
 }
 
-/* destructively transform into an array */
+/* LEN chars of string STR from START, sharing the chars of STR */
+lobj substring(lobj str, unsigned start, unsigned len)
+{
+    lobj o = alloc_lobj(TYPE_STR, sizeof(unsigned) * 2 + sizeof(lobj));
+
+    if(!string_interned(string_base(str)))
+        ((unsigned*)(string_base(str)->data))[0] |= STRING_SHARED;
+
+    ((unsigned*)(o->data))[0] = len | STRING_VIEW;
+    *(lobj*)&(((unsigned*)(o->data))[1]) = string_base(str);
+    ((unsigned*)(o->data))[3] = (string_ptr(str) - string_chars(string_base(str))) + start;
+
+    return o;
+}
+
+char* string_cstr(lobj o)
+{
+    unsigned len = string_length(o);
+    char *str;
+
+    if(!string_view(o))
+        return string_ptr(o);
+
+    /* the copy is kept alive while the pointer is on the stack */
+    str = string_ptr(make_string(len, '\0'));
+    memcpy(str, string_ptr(o), len);
+
+    return str;
+}
+
+/* destructively transform into an array (O must not be shared, see
+ * "string_shared") */
 void string_to_array(lobj o)
 {
     char *str = string_ptr(o);
@@ -307,67 +442,192 @@ void string_to_array(lobj o)
     o->type = TYPE_ARR;
 }
 
-int stringp(lobj o)
+/* destructively transform an array of chars into a string, and
+ * return non-0 iff O is a string after all. chars are packed in
+ * place from the head, where each one is read before its slot is
+ * overwritten. */
+int array_to_string(lobj o)
 {
-    if(!o)
+    unsigned len, ix;
+    lobj *arr;
+    char *dest;
+
+    if(stringp(o))
+        return 1;
+    else if(!arrayp(o))
         return 0;
 
-    else if(o->type == TYPE_STR)
+    len = array_length(o), arr = array_ptr(o), dest = (char*)arr;
+
+    for(ix = 0; ix < len; ix++)
+        if(!characterp(arr[ix]))
+            return 0;
+
+    for(ix = 0; ix < len; ix++)
+        dest[ix] = character_value(arr[ix]);
+    dest[ix] = '\0';
+
+    o->type = TYPE_STR;
+
+    return 1;
+}
+
+/* -- interned strings -- */
+
+/* interned strings are fixed, as the table refers to them, and so
+ * the fixed strings are exactly the interned ones. they are never
+ * modified, and cache their hash after the terminating '\0'. */
+
+#define HASH_SLOT(len) (1 + ((len) + sizeof(unsigned)) / sizeof(unsigned))
+
+int string_interned(lobj o) { return o->fixed; }
+
+/* FNV-1a */
+unsigned hash_chars(char* str, unsigned len)
+{
+    unsigned h = 2166136261u;
+
+    while(len--)
+        h = (h ^ (unsigned char)*str++) * 16777619u;
+
+    return h;
+}
+
+unsigned string_hash(lobj o)
+{
+    if(string_interned(o))
+        return ((unsigned*)(o->data))[HASH_SLOT(string_length(o))];
+
+    return hash_chars(string_ptr(o), string_length(o));
+}
+
+int string_equal(lobj s1, lobj s2)
+{
+    unsigned len = string_length(s1);
+
+    if(s1 == s2)
         return 1;
+    else if(string_interned(s1) && string_interned(s2))
+        return 0;
+
+    return len == string_length(s2) && !memcmp(string_ptr(s1), string_ptr(s2), len);
+}
+
+/* the table is an open-addressing hash table shared by all
+ * interpreters, guarded by this lock */
+lobj *string_table = NULL;
+unsigned string_table_size = 0, string_table_used = 0;
+pthread_mutex_t string_table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* the slot for a string of hash H equal to STR, which is empty if
+ * none is interned yet */
+lobj* string_table_slot(lobj str, unsigned h)
+{
+    unsigned ix;
 
-    /* transform into a string if possible */
-    else if(o->type == TYPE_ARR)
+    for(ix = h & (string_table_size - 1); string_table[ix];
+        ix = (ix + 1) & (string_table_size - 1))
+        if(string_hash(string_table[ix]) == h && string_equal(string_table[ix], str))
+            break;
+
+    return &string_table[ix];
+}
+
+void string_table_grow()
+{
+    lobj *old = string_table;
+    unsigned old_size = string_table_size, ix;
+
+    string_table_size = string_table_size ? string_table_size * 2 : 256;
+
+    if(!(string_table = (lobj*)calloc(string_table_size, sizeof(lobj))))
     {
-        unsigned len = array_length(o), ix;
-        lobj *arr = array_ptr(o);
-        char *dest = (char*)array_ptr(o),
-              *src = (char*)malloc(len); /* *NOTE* "malloc" USED HERE */
+        fputs("FATAL: failed to allocate memory.\n", stderr);
+        exit(1);
+    }
+
+    for(ix = 0; ix < old_size; ix++)
+        if(old[ix])
+            *string_table_slot(old[ix], string_hash(old[ix])) = old[ix];
 
-        for(ix = 0; ix < len; ix++)
-            if(!characterp(arr[ix]))
-                return 0;
+    free(old);
+}
 
-        for(ix = 0; ix < len; ix++)
-            src[ix] = character_value(arr[ix]);
+/* the interned string equal to string STR. if it does not exist, make
+ * it. */
+lobj intern_string(lobj str)
+{
+    unsigned len = string_length(str), h;
+    lobj *slot;
 
-        for(ix = 0; ix < len; ix++)
-            dest[ix] = src[ix];
-        dest[ix] = '\0';
+    if(string_interned(str))
+        return str;
 
-        o->type = TYPE_STR;
+    h = hash_chars(string_ptr(str), len);
 
-        return 1;
+    pthread_mutex_lock(&string_table_lock);
+
+    if((string_table_used + 1) * 2 > string_table_size)
+        string_table_grow();
+
+    if(!*(slot = string_table_slot(str, h)))
+    {
+        *slot = alloc_fixed(TYPE_STR, sizeof(unsigned) * (HASH_SLOT(len) + 1));
+        ((unsigned*)((*slot)->data))[0] = len;
+        memcpy(string_ptr(*slot), string_ptr(str), len);
+        string_ptr(*slot)[len] = '\0';
+        ((unsigned*)((*slot)->data))[HASH_SLOT(len)] = h;
+        string_table_used++;
     }
 
-    return 0;
+    pthread_mutex_unlock(&string_table_lock);
+
+    return *slot;
 }
 
 /* + FUNCTION       ---------------- */
 
-int functionp(lobj o) { return o && o->type == TYPE_FUNC; }
+/* formals of a lexical function are an array of symbols, and the
+ * I-th symbol is bound to the I-th slot of a new scope, whose parent
+ * is SCOPE (the scope where the function is made). */
+
 pargs function_args(lobj o) { return ((pargs*)(o->data))[0]; }
 lobj function_formals(lobj o) { return ((lobj*)&(((pargs*)(o->data))[1]))[0]; }
 lobj function_expr(lobj o) { return ((lobj*)&(((pargs*)(o->data))[1]))[1]; }
+lobj function_scope(lobj o) { return ((lobj*)&(((pargs*)(o->data))[1]))[2]; }
+
+int lexicalp(lobj o) { return functionp(o) && arrayp(function_formals(o)); }
 
 lobj function(pargs args, lobj formals, lobj expr)
 {
-    lobj o = alloc_lobj(TYPE_FUNC, sizeof(int) + 2 * sizeof(lobj));
+    lobj o = alloc_lobj(TYPE_FUNC, sizeof(int) + 3 * sizeof(lobj));
     ((pargs*)(o->data))[0] = args;
     ((lobj*)&(((pargs*)(o->data))[1]))[0] = formals;
     ((lobj*)&(((pargs*)(o->data))[1]))[1] = expr;
     return o;
 }
 
+lobj lexical_function(pargs args, lobj formals, lobj expr, lobj scope)
+{
+    lobj o = function(args, formals, expr);
+    ((lobj*)&(((pargs*)(o->data))[1]))[2] = scope;
+
+    if(scope)
+        scope_share(scope);
+
+    return o;
+}
+
 /* + CLOSURE        ---------------- */
 
-int closurep(lobj o) { return o && o->type == TYPE_CLOS; }
-lobj (*closure_obj)(lobj) = car;
-lobj (*closure_env)(lobj) = cdr;
+lobj closure_obj(lobj o) { return ((lobj*)(o->data))[0]; }
+lobj closure_env(lobj o) { return ((lobj*)(o->data))[1]; }
 
 lobj closure(lobj obj, lobj env)
 {
-    lobj o = cons(obj, env);
-    o->type = TYPE_CLOS;
+    lobj o = alloc_lobj(TYPE_CLOS, sizeof(lobj) * 2);
+    ((lobj*)(o->data))[0] = obj;
+    ((lobj*)(o->data))[1] = env;
     return o;
 }
 
@@ -375,7 +635,6 @@ lobj closure(lobj obj, lobj env)
 
 /* a subr is a lisp function implemented in C */
 
-int subrp(lobj o) { return o && o->type == TYPE_SUBR; }
 lsubr subr_object(lobj o) { return (*(lsubr*)(o->data)); }
 pargs subr_args(lobj o) { return (*(lsubr*)(o->data)).args; }
 lobj (*subr_function(lobj o))(lobj) { return (*(lsubr*)(o->data)).function; }
@@ -390,14 +649,202 @@ lobj subr(lsubr subr)
 
 /* + CONTINUATION   ---------------- */
 
-int continuationp(lobj o) { return o && o->type == TYPE_CONT; }
-lobj continuation_callstack(lobj o) { return *(lobj*)(o->data); }
-
-lobj continuation(lobj callstack)
+lobj continuation_callstack(lobj o) { return ((lobj*)(o->data))[0]; }
+lobj continuation_winds(lobj o) { return ((lobj*)(o->data))[1]; }
+unsigned long continuation_session(lobj o) { return ((unsigned long*)&(((lobj*)(o->data))[2]))[0]; }
+unsigned long continuation_stamp(lobj o) { return ((unsigned long*)&(((lobj*)(o->data))[2]))[1]; }
+void continuation_set_stamp(lobj o, unsigned long s) { ((unsigned long*)&(((lobj*)(o->data))[2]))[1] = s; }
+int continuation_escape(lobj o) { return *(int*)&(((unsigned long*)&(((lobj*)(o->data))[2]))[2]); }
+void continuation_set_escape(lobj o, int e) { *(int*)&(((unsigned long*)&(((lobj*)(o->data))[2]))[2]) = e; }
+
+/* ESCAPE is non-0 for escape-only continuations (see "call-ec"), and
+ * STAMP is when they are known to be live */
+lobj continuation(lobj callstack, lobj winds, unsigned long session, int escape)
 {
-    lobj o = alloc_lobj(TYPE_CONT, sizeof(lobj));
+    lobj o = alloc_lobj(TYPE_CONT, sizeof(lobj) * 2 + sizeof(unsigned long) * 2 + sizeof(int));
     o->type = TYPE_CONT;
-    *(lobj*)(o->data) = callstack;
+    if(current_stats) current_stats->captures++;
+    ((lobj*)(o->data))[0] = callstack;
+    ((lobj*)(o->data))[1] = winds;
+    ((unsigned long*)&(((lobj*)(o->data))[2]))[0] = session;
+    continuation_set_stamp(o, 0);
+    continuation_set_escape(o, escape);
+    return o;
+}
+
+/* + THREAD         ---------------- */
+
+/* a green thread. CONT is the continuation to resume it with, and
+ * VALUE is either the value passed on resume, or the result if it is
+ * finished (what VALUE means depends on STATE, see "core.c").
+ * WAITERS is the list of threads joining it. PORTS are the current
+ * input, output and error ports while it is not running (not traced,
+ * as streams are never finalized). */
+
+lobj thread_cont(lobj o) { return ((lobj*)(o->data))[0]; }
+lobj thread_value(lobj o) { return ((lobj*)(o->data))[1]; }
+lobj thread_waiters(lobj o) { return ((lobj*)(o->data))[2]; }
+int thread_state(lobj o) { return *(int*)&(((lobj*)(o->data))[3]); }
+void thread_set_cont(lobj o, lobj k) { ((lobj*)(o->data))[0] = k; gc_write_barrier(o); }
+void thread_set_value(lobj o, lobj v) { ((lobj*)(o->data))[1] = v; gc_write_barrier(o); }
+void thread_set_waiters(lobj o, lobj w) { ((lobj*)(o->data))[2] = w; gc_write_barrier(o); }
+void thread_set_state(lobj o, int s) { *(int*)&(((lobj*)(o->data))[3]) = s; }
+FILE** thread_ports(lobj o) { return (FILE**)&(((lobj*)(o->data))[4]); }
+
+lobj thread(lobj cont, lobj value, int state)
+{
+    lobj o = alloc_lobj(TYPE_THRD, sizeof(lobj) * 4 + sizeof(FILE*) * 3);
+    thread_set_cont(o, cont);
+    thread_set_value(o, value);
+    thread_set_waiters(o, NIL);
+    thread_set_state(o, state);
+    thread_ports(o)[0] = thread_ports(o)[1] = thread_ports(o)[2] = NULL;
+    return o;
+}
+
+/* + CHANNEL        ---------------- */
+
+/* a FIFO queue of values, and a list of threads waiting for a value */
+
+lobj channel_items(lobj o) { return ((lobj*)(o->data))[0]; }
+lobj channel_waiters(lobj o) { return ((lobj*)(o->data))[2]; }
+void channel_set_waiters(lobj o, lobj w) { ((lobj*)(o->data))[2] = w; gc_write_barrier(o); }
+
+lobj channel()
+{
+    lobj o = alloc_lobj(TYPE_CHAN, sizeof(lobj) * 3);
+    ((lobj*)(o->data))[0] = ((lobj*)(o->data))[1] = NIL;
+    channel_set_waiters(o, NIL);
+    return o;
+}
+
+void channel_push(lobj o, lobj v)
+{
+    lobj t = cons(v, NIL);
+
+    if(((lobj*)(o->data))[0])
+        setcdr(((lobj*)(o->data))[1], t);
+    else
+        ((lobj*)(o->data))[0] = t;
+
+    ((lobj*)(o->data))[1] = t;
+    gc_write_barrier(o);
+}
+
+/* pop a value from non-empty channel O */
+lobj channel_pop(lobj o)
+{
+    lobj v = car(channel_items(o));
+    ((lobj*)(o->data))[0] = cdr(channel_items(o));
+    gc_write_barrier(o);
+    return v;
+}
+
+/* + FUTURE         ---------------- */
+
+/* a future holds a task of the worker pool (see "pool.c"), and the
+ * expression and the value of the task. the task is freed with the
+ * future. */
+
+void* future_task(lobj o) { return *(void**)(o->data); }
+lobj* future_ptr(lobj o) { return (lobj*)&(((void**)(o->data))[1]); }
+
+lobj future(void* task, lobj item)
+{
+    lobj o = alloc_lobj(TYPE_FUTR, sizeof(void*) + sizeof(lobj) * 2);
+    *(void**)(o->data) = task;
+    future_ptr(o)[0] = item;
+    return o;
+}
+
+/* + SCOPE          ---------------- */
+
+/* a scope is a frame of local bindings, with a pointer to the parent
+ * scope and a small array of (symbol, value) slots. bindings are
+ * added to the top scope while it has room, and then to a new scope.
+ * once a scope is shared (referred by an environment, or by another
+ * scope as the parent), it never gets new slots, so that the
+ * environment sees exactly the bindings at the time it was made
+ * (values can still be modified with "bind!").
+
+   info = count (8 bits) + size (8 bits) + boundary + shared + kept
+
+ * a boundary scope begins a new group of local bindings (see
+ * "core.c"). a kept scope may be referred from outside of the
+ * callstack (closures, other threads, callers of "eval" ...). */
+
+#define SCOPE_COUNT(o)    (((unsigned*)((o)->data))[0] & 255)
+#define SCOPE_SIZE(o)     ((((unsigned*)((o)->data))[0] >> 8) & 255)
+#define SCOPE_BOUNDARY    (1 << 16)
+#define SCOPE_SHARED      (1 << 17)
+#define SCOPE_KEPT        (1 << 18)
+
+lobj scope_parent(lobj o) { return ((lobj*)&(((unsigned*)(o->data))[1]))[0]; }
+unsigned scope_count(lobj o) { return SCOPE_COUNT(o); }
+int scope_boundary(lobj o) { return !!(((unsigned*)(o->data))[0] & SCOPE_BOUNDARY); }
+lobj* scope_slots(lobj o) { return &((lobj*)&(((unsigned*)(o->data))[1]))[1]; }
+int scope_kept(lobj o) { return !!(((unsigned*)(o->data))[0] & SCOPE_KEPT); }
+void scope_share(lobj o) { ((unsigned*)(o->data))[0] |= SCOPE_SHARED; }
+void scope_keep(lobj o) { ((unsigned*)(o->data))[0] |= SCOPE_SHARED | SCOPE_KEPT; }
+
+/* set the value of IX-th slot of O */
+void scope_set(lobj o, unsigned ix, lobj value)
+{
+    scope_slots(o)[2 * ix + 1] = value;
+    gc_write_barrier(o);
+}
+
+/* make an empty scope with room for SIZE bindings (up to 255) */
+lobj scope(lobj parent, unsigned size, int boundary)
+{
+    lobj o = alloc_lobj(TYPE_SCOP, sizeof(unsigned) + sizeof(lobj) * (1 + 2 * size));
+    ((unsigned*)(o->data))[0] = size << 8 | (boundary ? SCOPE_BOUNDARY : 0);
+    ((lobj*)&(((unsigned*)(o->data))[1]))[0] = parent;
+
+    if(parent)
+        scope_share(parent);
+
+    return o;
+}
+
+/* add a binding of SYMBOL to O, and return non-0. return 0 (and do
+ * nothing) if O is full or shared. */
+int scope_push(lobj o, lobj symbol, lobj value)
+{
+    unsigned info = ((unsigned*)(o->data))[0], count = SCOPE_COUNT(o);
+
+    if(info & SCOPE_SHARED || count == SCOPE_SIZE(o))
+        return 0;
+
+    scope_slots(o)[2 * count] = symbol;
+    scope_slots(o)[2 * count + 1] = value;
+    ((unsigned*)(o->data))[0] = info + 1;
+    gc_write_barrier(o);
+
+    return 1;
+}
+
+/* + ENVIRONMENT    ---------------- */
+
+/* an environment is a snapshot of the registers of local and global
+ * bindings: the top scope, the list of global bindings (with a header
+ * cell), and whether a boundary is pending on the scope. making one
+ * is O(1), as scopes are never modified after shared. */
+
+int environment_boundary(lobj o) { return ((unsigned*)(o->data))[0]; }
+lobj environment_scope(lobj o) { return ((lobj*)&(((unsigned*)(o->data))[1]))[0]; }
+lobj environment_globals(lobj o) { return ((lobj*)&(((unsigned*)(o->data))[1]))[1]; }
+
+lobj environment(lobj scope, lobj globals, int boundary)
+{
+    lobj o = alloc_lobj(TYPE_ENV, sizeof(unsigned) + sizeof(lobj) * 2);
+    ((unsigned*)(o->data))[0] = !!boundary;
+    ((lobj*)&(((unsigned*)(o->data))[1]))[0] = scope;
+    ((lobj*)&(((unsigned*)(o->data))[1]))[1] = globals;
+
+    if(scope)
+        scope_share(scope);
+
     return o;
 }
 
@@ -409,7 +856,6 @@ lobj continuation(lobj callstack)
    -> head = cons(#<subr if> (cons 1 @tail=cons('a, NIL)))
  */
 
-int pap(lobj o) { return o && o->type == TYPE_PA; }
 int pa_eval_pattern(lobj o) { return ((int*)(o->data))[0]; }
 int pa_num_values(lobj o) { return ((int*)(o->data))[1]; }
 lobj pa_function(lobj o) { return car(((lobj*)&(((int*)(o->data))[2]))[0]); }
@@ -426,6 +872,18 @@ lobj pa(int eval_pattern, lobj function)
     return o;
 }
 
+/* a copy of O which does not share the list of values with O */
+lobj pa_copy(lobj o)
+{
+    lobj c = pa(0, pa_function(o)), v;
+
+    for(v = pa_values(o); v; v = cdr(v))
+        pa_push(c, car(v));
+    ((int*)(c->data))[0] = pa_eval_pattern(o);
+
+    return c;
+}
+
 /* *NOTE* NOT PORTABLE IMPLEMENTATION OF "eval_pattern"
    - ">>" FOR AN "int" SHOULD NOT BE LOGICAL
    - NUMBER OF MAXIMUM ARGUMENTS DEPENDS ON WORD-SIZE
@@ -438,4 +896,5 @@ void pa_push(lobj o, lobj v)
     ((int*)(o->data))[1]++;
     setcdr(((lobj*)&(((int*)(o->data))[2]))[1], t);
     ((lobj*)&(((int*)(o->data))[2]))[1] = t;
+    gc_write_barrier(o);
 }
@@ -0,0 +1,393 @@
+#define _POSIX_C_SOURCE 200112L /* sysconf */
+
+#include "philisp.h"
+#include "core.h"
+#include "pool.h"
+#include "gc.h"
+
+#include <stdlib.h>             /* malloc, free */
+#include <string.h>             /* strcpy */
+#include <pthread.h>            /* pthread_create, pthread_mutex_lock, ... */
+#define read posix_read          /* not to conflict with "read" in core.h */
+#include <unistd.h>             /* sysconf */
+#undef read
+
+/* + TASK           ---------------- */
+
+/* a task applies PROC to each of ITEMS[0 .. COUNT) (or evaluates each
+ * item, if PROC is ()) and stores the results to RESULTS, which points
+ * into object OWNER. it runs in the environment of the interpreter
+ * which made it: globals are shared, and new bindings made by the
+ * task are private. an error in a task stops it, and is raised again
+ * in the interpreter waiting for the task.
+ *
+ * *NOTE* CONTINUATIONS CANNOT ESCAPE FROM A TASK RUN BY A WORKER. */
+struct ltask
+{
+    lobj proc, *items, *results, owner;
+    unsigned count;
+    lobj env;                   /* environment to run in */
+    int done;                   /* guarded by pool_lock */
+    char error[ERROR_MESSAGE_MAX]; /* empty unless failed */
+    char *error_kind;
+    ltask *prev, *next;         /* list of running tasks */
+};
+
+void init_task(ltask* t, lobj proc, lobj* items, lobj* results, lobj owner, unsigned count)
+{
+    t->proc = proc, t->items = items, t->results = results, t->owner = owner;
+    t->count = count, t->done = 0, t->error[0] = '\0';
+
+    /* a boundary, and a private copy of the global bindings */
+    t->env = environment(current_scope(), cons(NIL, cdr(current_interp->global_env)), 1);
+}
+
+/* + DEQUE          ---------------- */
+
+/* each worker has a deque of tasks. the owner pushes and pops tasks
+ * at the bottom, and other workers steal tasks from the top. */
+typedef struct deque
+{
+    ltask **buf;
+    unsigned top, bottom, size; /* tasks are buf[top .. bottom) modulo SIZE */
+    pthread_mutex_t lock;
+} deque;
+
+void deque_push(deque* d, ltask* t)
+{
+    pthread_mutex_lock(&d->lock);
+
+    if(d->bottom - d->top == d->size) /* full */
+    {
+        ltask **buf = (ltask**)malloc(sizeof(ltask*) * d->size * 2);
+        unsigned ix;
+
+        if(!buf)
+            fatal("failed to allocate memory.");
+
+        for(ix = d->top; ix != d->bottom; ix++)
+            buf[ix % (d->size * 2)] = d->buf[ix % d->size];
+
+        free(d->buf);
+        d->buf = buf, d->size *= 2;
+    }
+
+    d->buf[d->bottom++ % d->size] = t;
+
+    pthread_mutex_unlock(&d->lock);
+}
+
+ltask* deque_pop(deque* d)
+{
+    ltask* t = NULL;
+
+    pthread_mutex_lock(&d->lock);
+    if(d->top != d->bottom)
+        t = d->buf[--d->bottom % d->size];
+    pthread_mutex_unlock(&d->lock);
+
+    return t;
+}
+
+ltask* deque_steal(deque* d)
+{
+    ltask* t = NULL;
+
+    pthread_mutex_lock(&d->lock);
+    if(d->top != d->bottom)
+        t = d->buf[d->top++ % d->size];
+    pthread_mutex_unlock(&d->lock);
+
+    return t;
+}
+
+/* + POOL           ---------------- */
+
+/* workers are made on the first use of the pool, one per core. each
+ * worker runs its own interpreter. */
+
+unsigned pool_size;             /* number of workers */
+deque* deques;                  /* deques of workers */
+pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+/* "pool_cond" is broadcasted when a task is pushed or done */
+pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+unsigned pool_pending = 0;      /* tasks pushed and not taken yet */
+unsigned pool_next = 0;         /* deque to push tasks of non-workers */
+
+THREAD_LOCAL int worker_id = -1; /* index of this worker, or -1 */
+
+/* tasks taken from deques and not done yet (guarded by pool_lock) */
+ltask *running_tasks = NULL;
+
+/* wait on "pool_cond", letting others collect meanwhile. pool_lock is
+ * unlocked on return, since the collector may wait for this thread
+ * to stop running while others hold pool_lock. */
+void pool_wait()
+{
+    gc_context ctx;
+    int state;
+
+    GC_SAVE_CONTEXT(ctx);
+    state = gc_block();
+    pthread_cond_wait(&pool_cond, &pool_lock);
+    pthread_mutex_unlock(&pool_lock);
+    gc_unblock(state);
+}
+
+/* take a task from the own deque, or steal one from others. return
+ * NULL if no tasks are found. */
+ltask* take_task()
+{
+    ltask* t = NULL;
+    unsigned ix;
+
+    if(worker_id >= 0)
+        t = deque_pop(&deques[worker_id]);
+
+    for(ix = 1; !t && ix <= pool_size; ix++)
+        t = deque_steal(&deques[(worker_id + ix) % pool_size]);
+
+    if(t)
+    {
+        pthread_mutex_lock(&pool_lock);
+        pool_pending--;
+        t->prev = NULL, t->next = running_tasks;
+        if(running_tasks)
+            running_tasks->prev = t;
+        running_tasks = t;
+        pthread_mutex_unlock(&pool_lock);
+    }
+
+    return t;
+}
+
+void push_task(ltask* t)
+{
+    unsigned ix;
+
+    pthread_mutex_lock(&pool_lock);
+    ix = worker_id >= 0 ? (unsigned)worker_id : pool_next++ % pool_size;
+    pthread_mutex_unlock(&pool_lock);
+
+    deque_push(&deques[ix], t);
+
+    pthread_mutex_lock(&pool_lock);
+    pool_pending++;
+    pthread_cond_broadcast(&pool_cond);
+    pthread_mutex_unlock(&pool_lock);
+}
+
+/* run task T in the current interpreter */
+void run_task(ltask* t)
+{
+    lobj saved_env = save_current_env(1);
+    unsigned ix;
+
+    restore_current_env(t->env);
+    current_interp->catching++;
+
+    for(ix = 0; ix < t->count && !escaping(); ix++)
+    {
+        if(t->proc)
+            t->results[ix] = funcall(t->proc, cons(t->items[ix], NIL));
+        else
+            t->results[ix] = eval(t->items[ix], NIL);
+        gc_write_barrier(t->owner);
+    }
+
+    if(pending_error)
+    {
+        strcpy(t->error, pending_error);
+        t->error_kind = current_interp->error_kind;
+        pending_error = NULL;
+    }
+
+    current_interp->catching--;
+    restore_current_env(saved_env);
+
+    pthread_mutex_lock(&pool_lock);
+    if(t->prev)
+        t->prev->next = t->next;
+    else
+        running_tasks = t->next;
+    if(t->next)
+        t->next->prev = t->prev;
+    t->done = 1;
+    pthread_cond_broadcast(&pool_cond);
+    pthread_mutex_unlock(&pool_lock);
+}
+
+/* wait for task T to be done, running other tasks meanwhile (so that
+ * workers waiting for nested tasks never deadlock). */
+void wait_task(ltask* t)
+{
+    ltask* u;
+
+    while(1)
+    {
+        pthread_mutex_lock(&pool_lock);
+
+        if(t->done)
+            break;
+        else if(!pool_pending)
+            pool_wait();
+        else
+        {
+            pthread_mutex_unlock(&pool_lock);
+            if((u = take_task()))
+                run_task(u);
+        }
+    }
+
+    pthread_mutex_unlock(&pool_lock);
+}
+
+void* worker_main(void* arg)
+{
+    ltask* t;
+
+    worker_id = (deque*)arg - deques;
+    interp_enter(interp_new());
+
+    while(1)
+        if((t = take_task()))
+            run_task(t);
+        else
+        {
+            pthread_mutex_lock(&pool_lock);
+            if(pool_pending)
+                pthread_mutex_unlock(&pool_lock);
+            else
+                pool_wait();
+        }
+
+    return NULL;
+}
+
+/* visit objects referred by pending and running tasks */
+void scan_tasks(void (*visit)(lobj))
+{
+    ltask *t;
+    unsigned ix, jx;
+
+    for(ix = 0; ix < pool_size; ix++)
+        for(jx = deques[ix].top; jx != deques[ix].bottom; jx++)
+        {
+            t = deques[ix].buf[jx % deques[ix].size];
+            visit(t->proc), visit(t->owner), visit(t->env);
+        }
+
+    for(t = running_tasks; t; t = t->next)
+        visit(t->proc), visit(t->owner), visit(t->env);
+}
+
+void pool_initialize()
+{
+    pthread_t th;
+    unsigned ix;
+
+  #ifdef _SC_NPROCESSORS_ONLN
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    pool_size = n > 0 ? n : 1;
+  #endif
+  #ifndef _SC_NPROCESSORS_ONLN
+    pool_size = 4;
+  #endif
+
+    if(!(deques = (deque*)malloc(sizeof(deque) * pool_size)))
+        fatal("failed to allocate memory.");
+
+    for(ix = 0; ix < pool_size; ix++)
+    {
+        if(!(deques[ix].buf = (ltask**)malloc(sizeof(ltask*) * 16)))
+            fatal("failed to allocate memory.");
+        deques[ix].top = deques[ix].bottom = 0, deques[ix].size = 16;
+        pthread_mutex_init(&deques[ix].lock, NULL);
+    }
+
+    gc_add_root_scanner(scan_tasks);
+
+    for(ix = 0; ix < pool_size; ix++)
+        if(pthread_create(&th, NULL, worker_main, &deques[ix]))
+            fatal("failed to create a worker thread.");
+        else
+            pthread_detach(th);
+}
+
+/* apply PROC to each element of array ITEMS in parallel, and store
+ * the results to array RESULTS. items are split into a few tasks per
+ * worker. */
+void pool_map(lobj proc, lobj items, lobj results)
+{
+    ltask* tasks;
+    unsigned count = array_length(items), num_tasks, chunk, ix;
+
+    if(!count)
+        return;
+
+    pthread_once(&pool_once, pool_initialize);
+
+    num_tasks = pool_size * 4 < count ? pool_size * 4 : count;
+    chunk = (count + num_tasks - 1) / num_tasks;
+    num_tasks = (count + chunk - 1) / chunk;
+
+    if(!(tasks = (ltask*)malloc(sizeof(ltask) * num_tasks)))
+        fatal("failed to allocate memory.");
+
+    for(ix = 0; ix < num_tasks; ix++)
+    {
+        init_task(&tasks[ix], proc, array_ptr(items) + ix * chunk,
+                  array_ptr(results) + ix * chunk, results,
+                  ix == num_tasks - 1 ? count - ix * chunk : chunk);
+        push_task(&tasks[ix]);
+    }
+
+    for(ix = 0; ix < num_tasks; ix++)
+        wait_task(&tasks[ix]);
+
+    for(ix = 0; ix < num_tasks; ix++)
+        if(tasks[ix].error[0])
+        {
+            raise_error(tasks[ix].error_kind, tasks[ix].error);
+            break;
+        }
+
+    free(tasks);
+}
+
+/* start evaluating EXPR in the pool, and return a future of the
+ * value. the task is freed when the future is collected. */
+lobj pool_future(lobj expr)
+{
+    ltask* t = (ltask*)malloc(sizeof(ltask));
+    lobj f;
+
+    if(!t)
+        fatal("failed to allocate memory.");
+
+    pthread_once(&pool_once, pool_initialize);
+
+    f = future(t, expr);
+    init_task(t, NIL, future_ptr(f), future_ptr(f) + 1, f, 1);
+    push_task(t);
+
+    return f;
+}
+
+/* wait for the task of future F, and return the value. */
+lobj pool_touch(lobj f)
+{
+    ltask* t = (ltask*)future_task(f);
+
+    wait_task(t);
+
+    if(t->error[0])
+    {
+        raise_error(t->error_kind, t->error);
+        return NIL;
+    }
+
+    return future_ptr(f)[1];
+}
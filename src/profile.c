@@ -0,0 +1,414 @@
+#define _XOPEN_SOURCE 500       /* setitimer, sigaction */
+
+#include "philisp.h"
+#include "core.h"
+#include "gc.h"
+#include "profile.h"
+
+#include <stdlib.h>             /* malloc, realloc, free, qsort */
+#include <string.h>             /* memset, strcpy */
+#include <pthread.h>            /* pthread_mutex_lock, pthread_once */
+#ifndef _WIN32
+#include <sys/time.h>           /* setitimer */
+#endif
+
+/* a sampling profiler. a timer (SIGPROF) sets "profile_pending" every
+ * PROFILE_INTERVAL usecs of CPU time, and the evaluator records the
+ * chain of running functions at the next PROFILE_POINT. samples are
+ * aggregated into a call tree and a call graph on the fly. */
+
+#define PROFILE_INTERVAL 1000   /* usecs of CPU time between samples */
+#define PROFILE_DEPTH    256    /* maximum number of calls in a sample */
+
+volatile sig_atomic_t profile_pending = 0;
+
+/* guards everything below */
+pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_once_t profile_once = PTHREAD_ONCE_INIT;
+int profiling = 0;
+unsigned long num_samples = 0;
+
+/* + FUNCTIONS      ---------------- */
+
+/* functions seen in samples. they are roots of the collector, so that
+ * their addresses are never reused while profiling. "last" is the
+ * last sample which counted the function in "total". */
+typedef struct pfunc { lobj fn; unsigned long self, total, last; } pfunc;
+
+pfunc *funcs = NULL;
+unsigned num_funcs = 0, funcs_size = 0;
+
+/* open-addressing hash table of (index + 1) of funcs, 0 if empty */
+unsigned *func_table = NULL, func_table_size = 0;
+
+unsigned func_hash(lobj fn) { return (unsigned)((size_t)fn >> 4) * 2654435761u; }
+
+void *profile_realloc(void* ptr, size_t size)
+{
+    if(!(ptr = realloc(ptr, size)))
+        fatal("failed to allocate memory.");
+
+    return ptr;
+}
+
+void func_table_insert(unsigned ix)
+{
+    unsigned h = func_hash(funcs[ix].fn) & (func_table_size - 1);
+
+    while(func_table[h])
+        h = (h + 1) & (func_table_size - 1);
+
+    func_table[h] = ix + 1;
+}
+
+/* index of FN in funcs, added if not found */
+unsigned func_index(lobj fn)
+{
+    unsigned h, ix;
+
+    if((num_funcs + 1) * 2 > func_table_size)
+    {
+        free(func_table);
+        func_table_size = func_table_size ? func_table_size * 2 : 64;
+        func_table = (unsigned*)profile_realloc(NULL, sizeof(unsigned) * func_table_size);
+        memset(func_table, 0, sizeof(unsigned) * func_table_size);
+
+        for(ix = 0; ix < num_funcs; ix++)
+            func_table_insert(ix);
+    }
+
+    for(h = func_hash(fn) & (func_table_size - 1); func_table[h]; h = (h + 1) & (func_table_size - 1))
+        if(funcs[func_table[h] - 1].fn == fn)
+            return func_table[h] - 1;
+
+    if(num_funcs == funcs_size)
+    {
+        funcs_size = funcs_size ? funcs_size * 2 : 64;
+        funcs = (pfunc*)profile_realloc(funcs, sizeof(pfunc) * funcs_size);
+    }
+
+    funcs[num_funcs].fn = fn;
+    funcs[num_funcs].self = funcs[num_funcs].total = funcs[num_funcs].last = 0;
+    func_table[h] = num_funcs + 1;
+
+    return num_funcs++;
+}
+
+void scan_funcs(void (*visit)(lobj))
+{
+    unsigned ix;
+
+    for(ix = 0; ix < num_funcs; ix++)
+        visit(funcs[ix].fn);
+}
+
+/* + CALL TREE      ---------------- */
+
+/* a node is a chain of calls from the root. TOTAL is the number of
+ * samples in the chain, and SELF is the number of samples exactly at
+ * the chain. */
+typedef struct pnode pnode;
+struct pnode
+{
+    unsigned func;
+    unsigned long self, total;
+    pnode *child, *next;
+};
+
+pnode call_tree;
+
+pnode* node_child(pnode* node, unsigned func)
+{
+    pnode *c;
+
+    for(c = node->child; c; c = c->next)
+        if(c->func == func)
+            return c;
+
+    if(!(c = (pnode*)malloc(sizeof(pnode))))
+        fatal("failed to allocate memory.");
+
+    c->func = func, c->self = c->total = 0;
+    c->child = NULL, c->next = node->child, node->child = c;
+
+    return c;
+}
+
+void free_nodes(pnode* node)
+{
+    pnode *c, *next;
+
+    for(c = node->child; c; c = next)
+    {
+        next = c->next;
+        free_nodes(c);
+        free(c);
+    }
+
+    node->child = NULL;
+}
+
+/* + CALL GRAPH     ---------------- */
+
+/* an edge of the call graph. COUNT is the number of samples in which
+ * CALLER calls CALLEE, however deep they recurse, and LAST is the last
+ * sample which counted the edge. */
+typedef struct pedge { unsigned caller, callee; unsigned long count, last; } pedge;
+
+pedge *edges = NULL;
+unsigned num_edges = 0, edges_size = 0;
+
+/* count an edge from CALLER to CALLEE in the current sample */
+void count_edge(unsigned caller, unsigned callee)
+{
+    unsigned ix;
+
+    for(ix = 0; ix < num_edges; ix++)
+        if(edges[ix].caller == caller && edges[ix].callee == callee)
+            break;
+
+    if(ix == num_edges)
+    {
+        if(num_edges == edges_size)
+        {
+            edges_size = edges_size ? edges_size * 2 : 64;
+            edges = (pedge*)profile_realloc(edges, sizeof(pedge) * edges_size);
+        }
+
+        edges[ix].caller = caller, edges[ix].callee = callee;
+        edges[ix].count = edges[ix].last = 0;
+        num_edges++;
+    }
+
+    if(edges[ix].last != num_samples)
+        edges[ix].last = num_samples, edges[ix].count++;
+}
+
+/* + SAMPLING       ---------------- */
+
+#ifndef _WIN32
+void profile_handler(int sig) { (void)sig; profile_pending = 1; }
+#endif
+
+/* record the chain of running functions of the current interpreter,
+ * and LEAF (if a subr) as the innermost one */
+void profile_sample(lobj leaf)
+{
+    lobj frames[PROFILE_DEPTH];
+    pnode *node = &call_tree;
+    unsigned n = 0, f;
+
+    profile_pending = 0;
+
+    if(leaf && subrp(leaf))
+        frames[n++] = leaf;
+    n += running_calls(frames + n, PROFILE_DEPTH - n);
+
+    pthread_mutex_lock(&profile_lock);
+
+    if(profiling)
+    {
+        num_samples++;
+        node->total++;
+
+        while(n--)              /* from the outermost call */
+        {
+            f = func_index(frames[n]);
+            if(node != &call_tree)
+                count_edge(node->func, f);
+            node = node_child(node, f);
+            node->total++;
+
+            if(funcs[f].last != num_samples)
+                funcs[f].last = num_samples, funcs[f].total++;
+            if(!n)
+                funcs[f].self++;
+        }
+
+        node->self++;
+    }
+
+    pthread_mutex_unlock(&profile_lock);
+}
+
+void profile_initialize() { gc_add_root_scanner(scan_funcs); }
+
+/* start profiling, discarding the last profile. return non-0 on
+ * failure. */
+int profile_start()
+{
+  #ifndef _WIN32
+    struct sigaction sa;
+    struct itimerval timer;
+
+    pthread_once(&profile_once, profile_initialize);
+
+    pthread_mutex_lock(&profile_lock);
+    free_nodes(&call_tree);
+    call_tree.self = call_tree.total = 0;
+    num_funcs = 0, num_edges = 0, num_samples = 0;
+    if(func_table_size)
+        memset(func_table, 0, sizeof(unsigned) * func_table_size);
+    profiling = 1;
+    pthread_mutex_unlock(&profile_lock);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = profile_handler, sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+
+    timer.it_interval.tv_sec = 0, timer.it_interval.tv_usec = PROFILE_INTERVAL;
+    timer.it_value = timer.it_interval;
+
+    return sigaction(SIGPROF, &sa, NULL) || setitimer(ITIMER_PROF, &timer, NULL);
+  #endif
+  #ifdef _WIN32
+    return 1;                   /* *TODO* SUPPORT WINDOWS */
+  #endif
+}
+
+/* + REPORT         ---------------- */
+
+char **func_names;
+
+/* the name of the global variable bound to FN, or its type and
+ * address if not found */
+char* func_name(lobj fn)
+{
+    char buf[SYMBOL_NAME_MAX + 32], *name;
+    lobj env;
+
+    memset(buf, 0, sizeof(buf));
+
+    for(env = cdr(current_interp->global_env); env; env = cdr(env))
+        if(cdr(car(env)) == fn && !rintern(car(car(env)), buf, SYMBOL_NAME_MAX))
+            break;
+
+    if(!env)
+    {
+        if(subrp(fn))
+            sprintf(buf, "%.*s", SYMBOL_NAME_MAX, subr_description(fn));
+        else
+            sprintf(buf, "#<%s %p>", type_names[TYPE_OF(fn)], (void*)fn);
+    }
+
+    name = (char*)profile_realloc(NULL, strlen(buf) + 1);
+    strcpy(name, buf);
+
+    return name;
+}
+
+int compare_funcs(const void* a, const void* b)
+{
+    unsigned long x = funcs[*(unsigned*)a].total, y = funcs[*(unsigned*)b].total;
+
+    return x < y ? 1 : x > y ? -1
+        : funcs[*(unsigned*)b].self < funcs[*(unsigned*)a].self ? -1
+        : funcs[*(unsigned*)b].self > funcs[*(unsigned*)a].self;
+}
+
+/* flat profile, then callers and callees of each function */
+void write_report(FILE* f)
+{
+    unsigned *order, ix, jx;
+    double n = num_samples ? num_samples : 1;
+
+    order = (unsigned*)profile_realloc(NULL, sizeof(unsigned) * (num_funcs + 1));
+    for(ix = 0; ix < num_funcs; ix++)
+        order[ix] = ix;
+    qsort(order, num_funcs, sizeof(unsigned), compare_funcs);
+
+    fprintf(f, "%lu samples, every %d usecs of CPU time\n\n", num_samples, PROFILE_INTERVAL);
+    fprintf(f, "  self%%  total%%      self     total  name\n");
+
+    for(ix = 0; ix < num_funcs; ix++)
+    {
+        pfunc *p = &funcs[order[ix]];
+        fprintf(f, "%7.2f %7.2f %9lu %9lu  %s\n",
+                p->self * 100 / n, p->total * 100 / n, p->self, p->total, func_names[order[ix]]);
+    }
+
+    fprintf(f, "\ncall graph (callers above, callees below each function)\n");
+
+    for(ix = 0; ix < num_funcs; ix++)
+    {
+        fputc('\n', f);
+
+        for(jx = 0; jx < num_edges; jx++)
+            if(edges[jx].callee == order[ix])
+                fprintf(f, "    %9lu  %s\n", edges[jx].count, func_names[edges[jx].caller]);
+
+        fprintf(f, "%9lu  %s\n", funcs[order[ix]].total, func_names[order[ix]]);
+
+        for(jx = 0; jx < num_edges; jx++)
+            if(edges[jx].caller == order[ix])
+                fprintf(f, "    %9lu  %s\n", edges[jx].count, func_names[edges[jx].callee]);
+    }
+
+    free(order);
+}
+
+/* one line per chain : names from the outermost call separated by
+ * ';', and the number of samples */
+void write_folded(FILE* f, pnode* node, unsigned* path, unsigned depth)
+{
+    pnode *c;
+    unsigned ix;
+
+    if(node != &call_tree)
+        path[depth++] = node->func;
+
+    if(node->self && depth)
+    {
+        for(ix = 0; ix < depth; ix++)
+            fprintf(f, ix ? ";%s" : "%s", func_names[path[ix]]);
+        fprintf(f, " %lu\n", node->self);
+    }
+
+    for(c = node->child; c; c = c->next)
+        write_folded(f, c, path, depth);
+}
+
+/* stop profiling, and write the profile to F. if FOLDED is non-0,
+ * write folded stacks (for flamegraph tools) instead of a report.
+ * return the number of samples. */
+long profile_stop(FILE* f, int folded)
+{
+    unsigned path[PROFILE_DEPTH], ix;
+    long samples;
+
+  #ifndef _WIN32
+    struct itimerval timer;
+
+    memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_PROF, &timer, NULL);
+  #endif
+
+    pthread_mutex_lock(&profile_lock);
+
+    profiling = 0, profile_pending = 0;
+
+    func_names = (char**)profile_realloc(NULL, sizeof(char*) * (num_funcs + 1));
+    for(ix = 0; ix < num_funcs; ix++)
+        func_names[ix] = func_name(funcs[ix].fn);
+
+    if(folded)
+        write_folded(f, &call_tree, path, 0);
+    else
+        write_report(f);
+
+    for(ix = 0; ix < num_funcs; ix++)
+        free(func_names[ix]);
+    free(func_names);
+
+    /* release the functions to the collector */
+    free_nodes(&call_tree);
+    num_funcs = 0, num_edges = 0;
+    if(func_table_size)
+        memset(func_table, 0, sizeof(unsigned) * func_table_size);
+
+    samples = num_samples;
+
+    pthread_mutex_unlock(&profile_lock);
+
+    return samples;
+}
@@ -1,8 +1,17 @@
 #include "philisp.h"
 #include "core.h"
 #include "subr.h"
-
-#include <dlfcn.h>              /* dlopen, dlsym */
+#include "pool.h"
+#include "gc.h"
+#include "profile.h"
+#include "trace.h"
+
+#include <stdlib.h>             /* malloc, strtol, strtod */
+#include <string.h>             /* strcmp, strcpy, strlen, memset, memchr, memcmp, memcpy */
+#include <limits.h>             /* INT_MAX, INT_MIN */
+#include <ctype.h>              /* isspace */
+#include <errno.h>              /* errno */
+#include <dlfcn.h>              /* dlopen, dlsym, dlclose */
 
 #define unused(var) (void)(var) /* suppress "unused variable" warning */
 
@@ -11,10 +20,11 @@
 
 /* + UTIL           ---------------- */
 
-lobj obj(lobj o, int(*typep)(lobj))
+/* O (or the object O closes) if its tag is TYPE, or NIL */
+lobj obj(lobj o, int type)
 {
-    return typep(o) ? o
-        : closurep(o) ? obj(closure_obj(o), typep)
+    return TYPE_OF(o) == type ? o
+        : closurep(o) ? obj(closure_obj(o), type)
         : NIL;
 }
 
@@ -28,7 +38,7 @@ DEFSUBR(subr_nilp, E, _)(lobj args) { return car(args) ? NIL : symbol(); }
 
 /* (symbol? O) => O if O is a symbol or a closure of symbol. ()
  * otherwise. */
-DEFSUBR(subr_symbolp, E, _)(lobj args) { return obj(car(args), symbolp) ? car(args) : NIL; }
+DEFSUBR(subr_symbolp, E, _)(lobj args) { return obj(car(args), TYPE_SYMB) ? car(args) : NIL; }
 
 /* (gensym) => an uninterned symbol. */
 DEFSUBR(subr_gensym, _, _)(lobj args) { unused(args); return symbol(); }
@@ -37,8 +47,8 @@ DEFSUBR(subr_gensym, _, _)(lobj args) { unused(args); return symbol(); }
 DEFSUBR(subr_intern, E, _)(lobj args)
 {
     if(!stringp(car(args)))
-        type_error("subr \"intern\"", 0, "string");
-    return intern(string_ptr(car(args)));
+        return type_error("subr \"intern\"", 0, "string");
+    return intern(string_cstr(car(args)));
 }
 
 /* + ENVIRON        ---------------- */
@@ -57,18 +67,16 @@ DEFSUBR(subr_bind, E, E)(lobj args)
  * is omitted. */
 DEFSUBR(subr_bound_value, E, E)(lobj args)
 {
-    lobj pair = binding(car(args), 0);
+    lobj value;
 
-    if(pair)
-        return cdr(pair);
+    if(binding(car(args), 0, &value))
+        return value;
 
     else if(cdr(args))
-        return eval(cons(car(cdr(args)),
-                         cons(string("reference to unbound symbol."), NIL)),
-                    NIL);    /* *FIXME* RECURSIVE "eval" */
+        return call_errorback(car(cdr(args)), "reference to unbound symbol.");
 
     else
-        lisp_error("reference to unbound symbol.");
+        return lisp_error("reference to unbound symbol.");
 }
 
 /* + CHAR           ---------------- */
@@ -80,7 +88,7 @@ DEFSUBR(subr_charp, E, _)(lobj args) { return characterp(car(args)) ? car(args)
 DEFSUBR(subr_char_to_int, E, _)(lobj args)
 {
     if(!characterp(car(args)))
-        type_error("subr \"char->int\"", 0, "character");
+        return type_error("subr \"char->int\"", 0, "character");
     return integer(character_value(car(args)));
 }
 
@@ -88,7 +96,7 @@ DEFSUBR(subr_char_to_int, E, _)(lobj args)
 DEFSUBR(subr_int_to_char, E, _)(lobj args)
 {
     if(!integerp(car(args)))
-        type_error("subr \"int->char\"", 0, "integer");
+        return type_error("subr \"int->char\"", 0, "integer");
     return character((char)integer_value(car(args)));
 }
 
@@ -119,10 +127,10 @@ int all_integerp(lobj lst)
 DEFSUBR(subr_mod, E E, _)(lobj args)
 {
     if(!integerp(car(args)))
-        type_error("subr \"mod\"", 0, "integer");
+        return type_error("subr \"mod\"", 0, "integer");
 
     if(!integerp(car(cdr(args))))
-        type_error("subr \"mod\"", 1, "integer");
+        return type_error("subr \"mod\"", 1, "integer");
 
     return integer(integer_value(car(args)) % integer_value(car(cdr(args))));
 }
@@ -134,14 +142,14 @@ DEFSUBR(subr_quot, E, E)(lobj args)
     unsigned i;
 
     if(!integerp(car(args)))
-        type_error("subr \"/\"", 0, "integer");
+        return type_error("subr \"/\"", 0, "integer");
 
     val = integer_value(car(args));
 
     for(args = cdr(args), i = 1; args; args = cdr(args), i++)
     {
         if(!integerp(car(args)))
-            type_error("subr \"/\"", i, "integer");
+            return type_error("subr \"/\"", i, "integer");
         val /= integer_value(car(args));
     }
 
@@ -156,7 +164,7 @@ DEFSUBR(subr_round, E, _)(lobj args)
     else if(floatingp(car(args)))
         return integer((int)floating_value(car(args)));
     else
-        type_error("subr \"round\"", 0, "number");
+        return type_error("subr \"round\"", 0, "number");
 }
 
 /* (+ NUM1 ...) => sum of NUM1, NUM2, ... . result is an integer
@@ -184,7 +192,7 @@ DEFSUBR(subr_add, _, E)(lobj args)
             else if(floatingp(car(args)))
                 sum += floating_value(car(args));
             else
-                type_error("subr \"+\"", ix, "number");
+                return type_error("subr \"+\"", ix, "number");
 
         return floating(sum);
     }
@@ -215,7 +223,7 @@ DEFSUBR(subr_mult, _, E)(lobj args)
             else if(floatingp(car(args)))
                 prod *= floating_value(car(args));
             else
-                type_error("subr \"*\"", ix, "number");
+                return type_error("subr \"*\"", ix, "number");
 
         return floating(prod);
     }
@@ -247,7 +255,7 @@ DEFSUBR(subr_sub, E, E)(lobj args)
             else if(floatingp(car(args)))
                 res = floating_value(car(args));
             else
-                type_error("subr \"-\"", 0, "number");
+                return type_error("subr \"-\"", 0, "number");
 
             for(ix = 1, args = cdr(args); args; ix++, args = cdr(args))
                 if(integerp(car(args)))
@@ -255,7 +263,7 @@ DEFSUBR(subr_sub, E, E)(lobj args)
                 else if(floatingp(car(args)))
                     res -= floating_value(car(args));
                 else
-                    type_error("subr \"-\"", ix, "number");
+                    return type_error("subr \"-\"", ix, "number");
 
             return floating(res);
         }
@@ -268,7 +276,7 @@ DEFSUBR(subr_sub, E, E)(lobj args)
         else if(floatingp(car(args)))
             return floating(-floating_value(car(args)));
         else
-            type_error("subr \"-\"", 0, "number");
+            return type_error("subr \"-\"", 0, "number");
     }
 }
 
@@ -286,7 +294,7 @@ DEFSUBR(subr_div, E, E)(lobj args)
         else if(floatingp(car(args)))
             res = floating_value(car(args));
         else
-            type_error("subr \"/\"", 0, "number");
+            return type_error("subr \"/\"", 0, "number");
 
         for(ix = 1, args = cdr(args); args; ix++, args = cdr(args))
             if(integerp(car(args)))
@@ -294,7 +302,7 @@ DEFSUBR(subr_div, E, E)(lobj args)
             else if(floatingp(car(args)))
                 res /= floating_value(car(args));
             else
-                type_error("subr \"/\"", ix, "number");
+                return type_error("subr \"/\"", ix, "number");
 
         return floating(res);
     }
@@ -306,7 +314,7 @@ DEFSUBR(subr_div, E, E)(lobj args)
         else if(floatingp(car(args)))
             return floating(1.0 / floating_value(car(args)));
         else
-            type_error("subr \"/\"", 0, "number");
+            return type_error("subr \"/\"", 0, "number");
     }
 }
 
@@ -319,14 +327,14 @@ DEFSUBR(subr_div, E, E)(lobj args)
         {                                                               \
             double num1, num2;                                          \
             unsigned ix;                                                \
-            lobj last;                                                  \
+            lobj last = args;                                           \
                                                                         \
             if(integerp(car(args)))                                     \
                 num1 = integer_value(car(args));                        \
             else if(floatingp(car(args)))                               \
                 num1 = floating_value(car(args));                       \
             else                                                        \
-                type_error("subr \"" #name "\"", 0, "number");          \
+                return type_error("subr \"" #name "\"", 0, "number");   \
                                                                         \
             for(ix = 1, args = cdr(args); args; ix++, args = cdr(args)) \
             {                                                           \
@@ -335,7 +343,8 @@ DEFSUBR(subr_div, E, E)(lobj args)
                 else if(floatingp(car(args)))                           \
                     num2 = floating_value(car(args));                   \
                 else                                                    \
-                    type_error("subr \"" #name "\"", ix, "number");     \
+                    return type_error("subr \"" #name "\"",             \
+                                      ix, "number");                    \
                                                                         \
                 if(!(num1 cmpop num2)) return NIL;                      \
                                                                         \
@@ -380,10 +389,10 @@ DEFSUBR(subr_output_port, _, _)(lobj args) { unused(args); return stream(current
 /* (error-port) => current error port, which defaults to stderr. */
 DEFSUBR(subr_error_port, _, _)(lobj args) { unused(args); return stream(current_err); }
 
-/* (set-ports [ISTREAM OSTREAM ESTREAM]) => change input port to
- * ISTREAM (resp. output port, error port). some of arguments can be
- * omitted or (), which represents "no-change". (return value is
- * unspecified) */
+/* (set-ports [ISTREAM OSTREAM ESTREAM]) => change input port of the
+ * current thread to ISTREAM (resp. output port, error port). some of
+ * arguments can be omitted or (), which represents "no-change".
+ * (return value is unspecified) */
 DEFSUBR(subr_set_ports, _, E)(lobj args)
 {
     if(args)
@@ -391,7 +400,7 @@ DEFSUBR(subr_set_ports, _, E)(lobj args)
         if(car(args))
         {
             if(!streamp(car(args)))
-                type_error("subr \"set-ports\"", 0, "stream");
+                return type_error("subr \"set-ports\"", 0, "stream");
             current_in = stream_value(car(args));
         }
 
@@ -400,7 +409,7 @@ DEFSUBR(subr_set_ports, _, E)(lobj args)
             if(car(args))
             {
                 if(!streamp(car(args)))
-                    type_error("subr \"set-ports\"", 1, "stream");
+                    return type_error("subr \"set-ports\"", 1, "stream");
                 current_out = stream_value(car(args));
             }
 
@@ -408,7 +417,7 @@ DEFSUBR(subr_set_ports, _, E)(lobj args)
                 if(car(args))
                 {
                     if(!streamp(car(args)))
-                        type_error("subr \"set-ports\"", 2, "stream");
+                        return type_error("subr \"set-ports\"", 2, "stream");
                     current_err = stream_value(car(args));
                 }
         }
@@ -417,24 +426,41 @@ DEFSUBR(subr_set_ports, _, E)(lobj args)
     return NIL;
 }
 
+/* if other threads may run while no input is available, set *O to a
+ * tail call which waits for input (with "wait-input") and then calls
+ * RETRY with ERRORBACK (if any), and return non-0. */
+int wait_input(lsubr retry, lobj args, lobj* o)
+{
+    if(!threads_pending() || input_ready(current_in))
+        return 0;
+
+    *o = pa(0, subr(retry));
+    if(args)
+        pa_push(*o, car(args));
+    *o = tail_call(subr(subr_wait_input), list(2, stream(current_in), *o));
+
+    return 1;
+}
+
 /* (getc [ERRORBACK]) => get a character from input port. on failure,
  * ERRORBACK is called with error message, or error if ERRORBACK is
- * omitted. */
+ * omitted. while no input is available, other threads run. */
 DEFSUBR(subr_getc, _, E)(lobj args)
 {
     int val;
-    unused(args);
+    lobj o;
+
+    if(wait_input(subr_getc, args, &o))
+        return o;
 
-    if((val = getc(current_in)) != EOF)
+    if((val = input_getc(current_in)) != EOF)
         return character(val);
 
     else if(args)
-        return eval(cons(car(args),    /* *FIXME* RECURSIVE "eval" */
-                         cons(string("failed to get character."), NIL)),
-                    NIL);
+        return call_errorback(car(args), "failed to get character.");
 
     else
-        lisp_error("failed to get character.");
+        return lisp_error("failed to get character.");
 }
 
 /* (putc CHAR [ERRORBACK]) => write CHAR to output port and return
@@ -443,17 +469,15 @@ DEFSUBR(subr_getc, _, E)(lobj args)
 DEFSUBR(subr_putc, E, E)(lobj args)
 {
     if(!characterp(car(args)))
-        type_error("subr \"putc\"", 0, "character");
+        return type_error("subr \"putc\"", 0, "character");
 
     if(putc(character_value(car(args)), current_out) == EOF)
     {
         if(cdr(args))
-            return eval(cons(car(cdr(args)), /* *FIXME* RECURSIVE "eval" */
-                             cons(string("failed to put character"), NIL)),
-                        NIL);
+            return call_errorback(car(cdr(args)), "failed to put character");
 
         else
-            lisp_error("failed to put character.");
+            return lisp_error("failed to put character.");
     }
 
     fflush(current_out);
@@ -467,17 +491,15 @@ DEFSUBR(subr_putc, E, E)(lobj args)
 DEFSUBR(subr_puts, E, E)(lobj args)
 {
     if(!stringp(car(args)))
-        type_error("subr \"puts\"", 0, "string");
+        return type_error("subr \"puts\"", 0, "string");
 
-    if(fprintf(current_out, string_ptr(car(args))) < 0)
+    if(fprintf(current_out, string_cstr(car(args))) < 0)
     {
         if(cdr(args))
-            return eval(cons(car(cdr(args)), /* *FIXME* RECURSIVE "eval" */
-                             cons(string("failed to put string"), NIL)),
-                        NIL);
+            return call_errorback(car(cdr(args)), "failed to put string");
 
         else
-            lisp_error("failed to put string.");
+            return lisp_error("failed to put string.");
     }
 
     fflush(current_out);
@@ -493,17 +515,15 @@ DEFSUBR(subr_puts, E, E)(lobj args)
 DEFSUBR(subr_ungetc, E, E)(lobj args)
 {
     if(!characterp(car(args)))
-        type_error("subr \"ungetc\"", 0, "character");
+        return type_error("subr \"ungetc\"", 0, "character");
 
-    if(ungetc(character_value(car(args)), current_in) == EOF)
+    if(input_ungetc(character_value(car(args)), current_in) == EOF)
     {
         if(cdr(args))
-            return eval(cons(car(cdr(args)), /* *FIXME* RECURSIVE "eval" */
-                             cons(string("failed to unget character."), NIL)),
-                        NIL);
+            return call_errorback(car(cdr(args)), "failed to unget character.");
 
         else
-            lisp_error("failed to unget character.");
+            return lisp_error("failed to unget character.");
     }
 
     return car(args);
@@ -520,8 +540,8 @@ DEFSUBR(subr_open, E, E)(lobj args)
 
     /* prepare FILENAME */
     if(!stringp(car(args)))
-        type_error("subr \"open\"", 0, "string");
-    filename = string_ptr(car(args));
+        return type_error("subr \"open\"", 0, "string");
+    filename = string_cstr(car(args));
 
     /* prepare MODE */
     ix = 1, mode[0] = 'r', args = cdr(args);
@@ -534,12 +554,10 @@ DEFSUBR(subr_open, E, E)(lobj args)
     if(!(f = fopen(filename, mode)))
     {
         if(args)
-            return eval(cons(car(args), /* *FIXME* RECURSIVE "eval" */
-                             cons(string("failed to open file"), NIL)),
-                        NIL);
+            return call_errorback(car(args), "failed to open file");
 
         else
-            lisp_error("failed to open file.");
+            return lisp_error("failed to open file.");
     }
 
     return stream(f);
@@ -551,17 +569,17 @@ DEFSUBR(subr_open, E, E)(lobj args)
 DEFSUBR(subr_close, E, E)(lobj args)
 {
     if(!streamp(car(args)))
-        type_error("subr \"close!\"", 0, "stream");
+        return type_error("subr \"close!\"", 0, "stream");
+
+    input_forget(stream_value(car(args)));
 
     if(fclose(stream_value(car(args))) == EOF)
     {
         if(cdr(args))
-            return eval(cons(car(cdr(args)), /* *FIXME* RECURSIVE "eval" */
-                             cons(string("failed to close stream."), NIL)),
-                        NIL);
+            return call_errorback(car(cdr(args)), "failed to close stream.");
 
         else
-            lisp_error("failed to close stream.");
+            return lisp_error("failed to close stream.");
     }
 
     return NIL;
@@ -571,7 +589,7 @@ DEFSUBR(subr_close, E, E)(lobj args)
 
 /* (cons? O) => O if O is a pair or a closure of pair. ()
  * otherwise. */
-DEFSUBR(subr_consp, E, _)(lobj args) { return obj(car(args), consp) ? car(args) : NIL; }
+DEFSUBR(subr_consp, E, _)(lobj args) { return obj(car(args), TYPE_CONS) ? car(args) : NIL; }
 
 /* (cons O1 O2) => pair of O1 and O2. */
 DEFSUBR(subr_cons, E E, _)(lobj args) { return cons(car(args), car(cdr(args))); }
@@ -584,10 +602,10 @@ DEFSUBR(subr_car, E, _)(lobj args)
 
     if(!car(args))
         return NIL;
-    else if((pair = obj(car(args), consp)))
+    else if((pair = obj(car(args), TYPE_CONS)))
         return car(pair);
     else
-        type_error("subr \"car\"", 0, "cons nor ()");
+        return type_error("subr \"car\"", 0, "cons nor ()");
 }
 
 /* (cdr PAIR) => CDR part of PAIR. if PAIR is (), return (). PAIR also
@@ -598,10 +616,10 @@ DEFSUBR(subr_cdr, E, _)(lobj args)
 
     if(!car(args))
         return NIL;
-    else if((pair = obj(car(args), consp)))
+    else if((pair = obj(car(args), TYPE_CONS)))
         return cdr(pair);
     else
-        type_error("subr \"cdr\"", 0, "cons nor ()");
+        return type_error("subr \"cdr\"", 0, "cons nor ()");
 }
 
 /* (setcar! PAIR NEWCAR) => set CAR part of PAIR to NEWCAR. return
@@ -609,8 +627,8 @@ DEFSUBR(subr_cdr, E, _)(lobj args)
 DEFSUBR(subr_setcar, E E, _)(lobj args)
 {
     lobj pair;
-    if(!(pair = obj(car(args), consp)))
-        type_error("subr \"setcar!\"", 0, "cons");
+    if(!(pair = obj(car(args), TYPE_CONS)))
+        return type_error("subr \"setcar!\"", 0, "cons");
     setcar(pair, car(cdr(args)));
     return car(cdr(args));
 }
@@ -619,8 +637,8 @@ DEFSUBR(subr_setcar, E E, _)(lobj args)
 DEFSUBR(subr_setcdr, E E, _)(lobj args)
 {
     lobj pair;
-    if(!(pair = obj(car(args), consp)))
-        type_error("subr \"setcdr!\"", 0, "cons");
+    if(!(pair = obj(car(args), TYPE_CONS)))
+        return type_error("subr \"setcdr!\"", 0, "cons");
     setcdr(pair, car(cdr(args)));
     return car(cdr(args));
 }
@@ -642,10 +660,10 @@ DEFSUBR(subr_make_array, E, E)(lobj args)
     lobj init = cdr(args) ? car(cdr(args)) : NIL;
 
     if(!integerp(car(args)))
-        type_error("subr \"make-array\"", 0, "positive integer");
+        return type_error("subr \"make-array\"", 0, "positive integer");
 
     if((len = integer_value(car(args))) < 0)
-        type_error("subr \"make-array\"", 0, "positive integer");
+        return type_error("subr \"make-array\"", 0, "positive integer");
 
     if(characterp(init))
         return make_string(len, character_value(init));
@@ -660,15 +678,15 @@ DEFSUBR(subr_aref, E E, _)(lobj args)
     int ix;
 
     if(!integerp(car(cdr(args))))
-        type_error("subr \"aref\"", 1, "positive integer");
+        return type_error("subr \"aref\"", 1, "positive integer");
 
     if((ix = integer_value(car(cdr(args)))) < 0)
-        type_error("subr \"aref\"", 1, "positive integer");
+        return type_error("subr \"aref\"", 1, "positive integer");
 
     if(arrayp(car(args)))
     {
         if((unsigned)ix >= array_length(car(args)))
-            lisp_error("array boundary error");
+            return lisp_error("array boundary error");
 
         return (array_ptr(car(args)))[ix];
     }
@@ -676,61 +694,747 @@ DEFSUBR(subr_aref, E E, _)(lobj args)
     else if(stringp(car(args)))
     {
         if((unsigned)ix >= string_length(car(args)))
-            lisp_error("array boundary error");
+            return lisp_error("array boundary error");
 
         return character((string_ptr(car(args)))[ix]);
     }
 
     else
-        type_error("subr \"aref\"", 0, "array");
+        return type_error("subr \"aref\"", 0, "array");
 }
 
 /* (aset! ARRAY N O) => set N-th element of ARRAY to O and return
- * O. error if O is negative or greater than the length of ARRAY. */
+ * O. error if O is negative or greater than the length of ARRAY, or
+ * ARRAY is an interned string. chars set to a substring are also set
+ * to the string it shares the chars of, and other objects cannot be
+ * set to strings which share chars with substrings. */
 DEFSUBR(subr_aset, E E E, _)(lobj args)
 {
     int ix;
 
-    if(stringp(car(args)) && !characterp(car(cdr(args))))
+    if(stringp(car(args)) && string_interned(string_base(car(args))))
+        return lisp_error("interned strings cannot be modified.");
+
+    if(stringp(car(args)) && !characterp(car(cdr(cdr(args)))))
+    {
+        if(string_shared(car(args)))
+            return type_error("subr \"aset!\"", 2, "character");
+
         string_to_array(car(args));
+    }
 
     if(!integerp(car(cdr(args))))
-        type_error("subr \"aset!\"", 1, "positive integer");
+        return type_error("subr \"aset!\"", 1, "positive integer");
     if((ix = integer_value(car(cdr(args)))) < 0)
-        type_error("subr \"aset!\"", 1, "positive integer");
+        return type_error("subr \"aset!\"", 1, "positive integer");
 
     if(arrayp(car(args)))
     {
         if((unsigned)ix >= array_length(car(args)))
-            lisp_error("array boundary error");
+            return lisp_error("array boundary error");
 
-        return (array_ptr(car(args)))[ix] = car(cdr(args));
+        return (array_ptr(car(args)))[ix] = car(cdr(cdr(args)));
     }
 
     else if(stringp(car(args)))
     {
         if((unsigned)ix >= string_length(car(args)))
-            lisp_error("array boundary error");
+            return lisp_error("array boundary error");
 
-        (string_ptr(car(args)))[ix] = character_value(car(cdr(args)));
+        (string_ptr(car(args)))[ix] = character_value(car(cdr(cdr(args))));
 
-        return car(cdr(args));
+        return car(cdr(cdr(args)));
     }
 
     else
-        type_error("subr \"aset!\"", 0, "array");
+        return type_error("subr \"aset!\"", 0, "array");
 }
 
-/* (string? O) => O if O is a char-array, or () otherwise. */
+/* (string? O) => O if O is a string, or () otherwise. an array which
+ * happens to have only chars is not a string. */
 DEFSUBR(subr_stringp, E, _)(lobj args) { return stringp(car(args)) ? car(args) : NIL; }
 
+/* + STRING         ---------------- */
+
+/* (string-hash STRING) => hash of the contents of STRING, a
+ * non-negative integer. equal strings have the same hash. */
+DEFSUBR(subr_string_hash, E, _)(lobj args)
+{
+    if(!stringp(car(args)))
+        return type_error("subr \"string-hash\"", 0, "string");
+
+    return integer((int)(string_hash(car(args)) & INT_MAX));
+}
+
+/* (intern-string STRING) => the interned string equal to STRING.
+ * interned strings are shared, so equal ones are "eq", and never
+ * modified nor freed. */
+DEFSUBR(subr_intern_string, E, _)(lobj args)
+{
+    if(!stringp(car(args)))
+        return type_error("subr \"intern-string\"", 0, "string");
+
+    return intern_string(car(args));
+}
+
+/* -- search -- */
+
+#define TWO_WAY_MIN 32          /* length of needles searched by "two_way" */
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+/* find NEEDLE of length L (>= 2) in HAY of length HLEN, by the
+ * Two-Way algorithm of Crochemore and Perrin, which runs in linear
+ * time and constant space. SHIFT[c] is the position next to the last
+ * occurrence of char c in NEEDLE, or 0 if none. (as in musl's
+ * "memmem") */
+char* two_way(unsigned char* hay, unsigned hlen, unsigned char* needle, unsigned l)
+{
+    unsigned char *end = hay + hlen;
+    unsigned shift[256], ix, ip, jp, k, p, ms, p0, mem, mem0;
+
+    for(ix = 0; ix < 256; ix++)
+        shift[ix] = 0;
+    for(ix = 0; ix < l; ix++)
+        shift[needle[ix]] = ix + 1;
+
+    /* maximal suffixes for both orders, and the periods of them */
+    for(ip = (unsigned)-1, jp = 0, k = p = 1; jp + k < l; )
+        if(needle[ip + k] == needle[jp + k])
+        {
+            if(k == p)
+                jp += p, k = 1;
+            else
+                k++;
+        }
+        else if(needle[ip + k] > needle[jp + k])
+            jp += k, k = 1, p = jp - ip;
+        else
+            ip = jp++, k = p = 1;
+    ms = ip, p0 = p;
+
+    for(ip = (unsigned)-1, jp = 0, k = p = 1; jp + k < l; )
+        if(needle[ip + k] == needle[jp + k])
+        {
+            if(k == p)
+                jp += p, k = 1;
+            else
+                k++;
+        }
+        else if(needle[ip + k] < needle[jp + k])
+            jp += k, k = 1, p = jp - ip;
+        else
+            ip = jp++, k = p = 1;
+
+    if(ip + 1 > ms + 1)
+        ms = ip;
+    else
+        p = p0;
+
+    /* periodic needles remember the prefix known to match */
+    if(memcmp(needle, needle + p, ms + 1))
+        mem0 = 0, p = MAX(ms, l - ms - 1) + 1;
+    else
+        mem0 = l - p;
+
+    for(mem = 0; (unsigned)(end - hay) >= l; )
+    {
+        /* skip by the last char of the window */
+        if(!(k = shift[hay[l - 1]]))
+        {
+            hay += l, mem = 0;
+            continue;
+        }
+        else if((k = l - k))
+        {
+            hay += MAX(k, mem), mem = 0;
+            continue;
+        }
+
+        /* the right half, and then the left half */
+        for(k = MAX(ms + 1, mem); k < l && needle[k] == hay[k]; k++);
+        if(k < l)
+        {
+            hay += k - ms, mem = 0;
+            continue;
+        }
+
+        for(k = ms + 1; k > mem && needle[k - 1] == hay[k - 1]; k--);
+        if(k <= mem)
+            return (char*)hay;
+
+        hay += p, mem = mem0;
+    }
+
+    return NULL;
+}
+
+/* the first occurrence of NEEDLE of length NLEN in HAY of length
+ * HLEN, or NULL. candidates are found by "memchr", which libc
+ * vectorizes, and long needles are left to "two_way" so that the
+ * worst case stays linear. */
+char* search_chars(char* hay, unsigned hlen, char* needle, unsigned nlen)
+{
+    char *end = hay + hlen, *p;
+
+    if(!nlen)
+        return hay;
+    else if(nlen > hlen)
+        return NULL;
+    else if(nlen >= TWO_WAY_MIN)
+        return two_way((unsigned char*)hay, hlen, (unsigned char*)needle, nlen);
+
+    for(p = hay; (p = memchr(p, *needle, end - p - nlen + 1)); p++)
+        if(!memcmp(p + 1, needle + 1, nlen - 1))
+            return p;
+
+    return NULL;
+}
+
+/* chars of a string or a char O for the separators and the needles.
+ * return non-0 iff O is either. */
+int needle_chars(lobj o, char* buf, char** ptr, unsigned* len)
+{
+    if(characterp(o))
+        *buf = character_value(o), *ptr = buf, *len = 1;
+    else if(stringp(o))
+        *ptr = string_ptr(o), *len = string_length(o);
+    else
+        return 0;
+
+    return 1;
+}
+
+/* (string-search NEEDLE STRING [START]) => index of the first
+ * occurrence of NEEDLE, a string or a char, in STRING at or after
+ * START (defaults to 0), or () if none. */
+DEFSUBR(subr_string_search, E E, E)(lobj args)
+{
+    lobj str = car(cdr(args));
+    unsigned nlen, len, start = 0;
+    char c, *needle, *p;
+
+    if(!needle_chars(car(args), &c, &needle, &nlen))
+        return type_error("subr \"string-search\"", 0, "string or character");
+    if(!stringp(str))
+        return type_error("subr \"string-search\"", 1, "string");
+
+    len = string_length(str);
+
+    if(cdr(cdr(args)))
+    {
+        if(!integerp(car(cdr(cdr(args)))) || integer_value(car(cdr(cdr(args)))) < 0)
+            return type_error("subr \"string-search\"", 2, "positive integer");
+        if((start = integer_value(car(cdr(cdr(args))))) > len)
+            return lisp_error("array boundary error");
+    }
+
+    if(!(p = search_chars(string_ptr(str) + start, len - start, needle, nlen)))
+        return NIL;
+
+    return integer(p - string_ptr(str));
+}
+
+/* -- substrings -- */
+
+/* (substring STRING START [END]) => chars of STRING from START to
+ * END (defaults to the length of STRING). the result shares the chars
+ * with STRING, so chars set to either one are also set to the other,
+ * and STRING is kept alive while the result is alive. */
+DEFSUBR(subr_substring, E E, E)(lobj args)
+{
+    lobj str = car(args);
+    int start, end;
+
+    if(!stringp(str))
+        return type_error("subr \"substring\"", 0, "string");
+    if(!integerp(car(cdr(args))))
+        return type_error("subr \"substring\"", 1, "integer");
+    if(cdr(cdr(args)) && !integerp(car(cdr(cdr(args)))))
+        return type_error("subr \"substring\"", 2, "integer");
+
+    start = integer_value(car(cdr(args)));
+    end = cdr(cdr(args)) ? integer_value(car(cdr(cdr(args)))) : (int)string_length(str);
+
+    if(start < 0 || end < start || (unsigned)end > string_length(str))
+        return lisp_error("array boundary error");
+
+    return substring(str, start, end - start);
+}
+
+/* (split-string SEP STRING) => list of substrings of STRING
+ * separated by SEP, a char or a non-empty string. empty ones are not
+ * omitted, so the list has one more element than occurrences of
+ * SEP. the substrings share the chars with STRING (see
+ * "substring"). */
+DEFSUBR(subr_split_string, E E, _)(lobj args)
+{
+    lobj str = car(cdr(args)), head = NIL, tail = NIL, o;
+    unsigned slen, len, ix;
+    char c, *sep, *ptr, *p;
+
+    if(!needle_chars(car(args), &c, &sep, &slen) || !slen)
+        return type_error("subr \"split-string\"", 0, "non-empty string or character");
+    if(!stringp(str))
+        return type_error("subr \"split-string\"", 1, "string");
+
+    ptr = string_ptr(str), len = string_length(str);
+
+    for(ix = 0; ; ix = p - ptr + slen)
+    {
+        if(!(p = search_chars(ptr + ix, len - ix, sep, slen)))
+            p = ptr + len;
+
+        o = cons(substring(str, ix, p - ptr - ix), NIL);
+
+        if(!head)
+            head = tail = o;
+        else
+            setcdr(tail, o), tail = o;
+
+        if(p == ptr + len)
+            return head;
+    }
+}
+
+/* (join-string SEP STRINGS) => a new string of STRINGS, a list or an
+ * array of strings, separated by SEP, a char or a string. */
+DEFSUBR(subr_join_string, E E, _)(lobj args)
+{
+    lobj items = car(cdr(args)), *strs, o;
+    unsigned slen, len = 0, n, ix;
+    char c, *sep, *ptr;
+
+    if(!needle_chars(car(args), &c, &sep, &slen))
+        return type_error("subr \"join-string\"", 0, "string or character");
+
+    if(listp(items))
+        items = list_array(items);
+    else if(!arrayp(items))
+        return type_error("subr \"join-string\"", 1, "list or array");
+
+    n = array_length(items), strs = array_ptr(items);
+
+    for(ix = 0; ix < n; ix++)
+    {
+        if(!stringp(strs[ix]))
+            return type_error("subr \"join-string\"", 1, "sequence of strings");
+        len += string_length(strs[ix]) + (ix ? slen : 0);
+    }
+
+    ptr = string_ptr(o = make_string(len, '\0'));
+
+    for(ix = 0; ix < n; ix++)
+    {
+        if(ix)
+            memcpy(ptr, sep, slen), ptr += slen;
+        memcpy(ptr, string_ptr(strs[ix]), string_length(strs[ix]));
+        ptr += string_length(strs[ix]);
+    }
+
+    return o;
+}
+
+/* -- conversion -- */
+
+/* (string->number STRING) => the integer or the float STRING
+ * represents, or () if STRING is not a number. integers out of the
+ * range of ints are read as floats. */
+DEFSUBR(subr_string_to_number, E, _)(lobj args)
+{
+    char *str, *end;
+    long l;
+    double d;
+
+    if(!stringp(car(args)))
+        return type_error("subr \"string->number\"", 0, "string");
+
+    str = string_cstr(car(args));
+
+    if(!*str || isspace((unsigned char)*str))
+        return NIL;
+
+    errno = 0, l = strtol(str, &end, 10);
+    if(!*end && !errno && INT_MIN <= l && l <= INT_MAX)
+        return integer((int)l);
+
+    d = strtod(str, &end);
+    return *end ? NIL : floating(d);
+}
+
+/* (number->string NUM) => a new string of NUM, as "print" prints
+ * it. */
+DEFSUBR(subr_number_to_string, E, _)(lobj args)
+{
+    char buf[512];
+
+    if(integerp(car(args)))
+        sprintf(buf, "%d", integer_value(car(args)));
+    else if(floatingp(car(args)))
+        sprintf(buf, "%f", floating_value(car(args)));
+    else
+        return type_error("subr \"number->string\"", 0, "number");
+
+    return string(buf);
+}
+
+/* + SEQUENCE       ---------------- */
+
+/* sequences are lists, arrays and strings. procedures are applied
+ * with "funcall", so subrs are called without the evaluator. lisp
+ * functions run in nested sessions, so continuations captured in them
+ * cannot be called after the subr returns. */
+
+/* N-th element of array or string SEQ. */
+lobj seq_ref(lobj seq, unsigned n)
+{
+    return arrayp(seq) ? array_ptr(seq)[n] : character(string_ptr(seq)[n]);
+}
+
+/* length of array or string SEQ. */
+unsigned seq_length(lobj seq)
+{
+    return arrayp(seq) ? array_length(seq) : string_length(seq);
+}
+
+/* (map FUNC SEQ) => a sequence of results of applying FUNC to each
+ * element of SEQ. the result is a list iff SEQ is a list, or an array
+ * otherwise. */
+DEFSUBR(subr_map, E E, _)(lobj args)
+{
+    lobj f = car(args), seq = car(cdr(args)), head = NIL, tail = NIL, o;
+
+    if(listp(seq))
+    {
+        for(; seq; seq = cdr(seq))
+        {
+            o = funcall(f, cons(car(seq), NIL));
+
+            if(escaping())
+                return NIL;
+            else if(!head)
+                head = tail = cons(o, NIL);
+            else
+                setcdr(tail, cons(o, NIL)), tail = cdr(tail);
+        }
+
+        return head;
+    }
+
+    else if(arrayp(seq) || stringp(seq))
+    {
+        unsigned len = seq_length(seq), ix;
+
+        o = make_array(len, NIL);
+
+        for(ix = 0; ix < len; ix++)
+        {
+            array_ptr(o)[ix] = funcall(f, cons(seq_ref(seq, ix), NIL));
+
+            if(escaping())
+                return NIL;
+        }
+
+        return o;
+    }
+
+    else
+        return type_error("subr \"map\"", 1, "sequence");
+}
+
+/* (for-each FUNC SEQ) => apply FUNC to each element of SEQ in order,
+ * and return (). */
+DEFSUBR(subr_for_each, E E, _)(lobj args)
+{
+    lobj f = car(args), seq = car(cdr(args));
+
+    if(listp(seq))
+    {
+        for(; seq; seq = cdr(seq))
+            if(funcall(f, cons(car(seq), NIL)), escaping())
+                return NIL;
+    }
+
+    else if(arrayp(seq) || stringp(seq))
+    {
+        unsigned len = seq_length(seq), ix;
+
+        for(ix = 0; ix < len; ix++)
+            if(funcall(f, cons(seq_ref(seq, ix), NIL)), escaping())
+                return NIL;
+    }
+
+    else
+        return type_error("subr \"for-each\"", 1, "sequence");
+
+    return NIL;
+}
+
+/* (filter PRED SEQ) => a sequence of elements of SEQ which satisfy
+ * PRED, in order. the result is a list iff SEQ is a list, or an array
+ * otherwise. */
+DEFSUBR(subr_filter, E E, _)(lobj args)
+{
+    lobj f = car(args), seq = car(cdr(args)), head = NIL, tail = NIL, o;
+
+    if(listp(seq))
+    {
+        for(; seq; seq = cdr(seq))
+        {
+            o = funcall(f, cons(car(seq), NIL));
+
+            if(escaping())
+                return NIL;
+            else if(!o)
+                continue;
+            else if(!head)
+                head = tail = cons(car(seq), NIL);
+            else
+                setcdr(tail, cons(car(seq), NIL)), tail = cdr(tail);
+        }
+
+        return head;
+    }
+
+    else if(arrayp(seq) || stringp(seq))
+    {
+        unsigned len = seq_length(seq), ix, n = 0;
+        lobj buf = make_array(len, NIL);
+
+        for(ix = 0; ix < len; ix++)
+        {
+            lobj elem = seq_ref(seq, ix);
+
+            if(funcall(f, cons(elem, NIL)))
+                array_ptr(buf)[n++] = elem;
+
+            if(escaping())
+                return NIL;
+        }
+
+        for(o = make_array(n, NIL); n--;)
+            array_ptr(o)[n] = array_ptr(buf)[n];
+
+        return o;
+    }
+
+    else
+        return type_error("subr \"filter\"", 1, "sequence");
+}
+
+/* (reduce FUNC INIT SEQ) => (FUNC (... (FUNC (FUNC INIT E1) E2) ...)
+ * En) where E1 ... En are elements of SEQ. */
+DEFSUBR(subr_reduce, E E E, _)(lobj args)
+{
+    lobj f = car(args), acc = car(cdr(args)), seq = car(cdr(cdr(args)));
+
+    if(listp(seq))
+    {
+        for(; seq; seq = cdr(seq))
+            if(acc = funcall(f, list(2, acc, car(seq))), escaping())
+                return NIL;
+    }
+
+    else if(arrayp(seq) || stringp(seq))
+    {
+        unsigned len = seq_length(seq), ix;
+
+        for(ix = 0; ix < len; ix++)
+            if(acc = funcall(f, list(2, acc, seq_ref(seq, ix))), escaping())
+                return NIL;
+    }
+
+    else
+        return type_error("subr \"reduce\"", 2, "sequence");
+
+    return acc;
+}
+
+/* -- sort -- */
+
+THREAD_LOCAL lobj sort_pred; /* predicate of the running sort, or () for "<" */
+
+double sort_number(lobj o)
+{
+    if(integerp(o))
+        return integer_value(o);
+    else if(floatingp(o))
+        return floating_value(o);
+    else
+        type_error("subr \"sort\"", 0, "sequence of numbers");
+
+    return 0;
+}
+
+/* non-0 iff A must precede B. after escaping, always 0. */
+int sort_less(lobj a, lobj b)
+{
+    if(escaping())
+        return 0;
+    else if(!sort_pred)
+        return sort_number(a) < sort_number(b);
+    else
+        return funcall(sort_pred, list(2, a, b)) != NIL;
+}
+
+void insertion_sort(lobj* v, unsigned len)
+{
+    unsigned i, j;
+    lobj t;
+
+    for(i = 1; i < len; i++)
+    {
+        for(t = v[i], j = i; j && sort_less(t, v[j - 1]); j--)
+            v[j] = v[j - 1];
+        v[j] = t;
+    }
+}
+
+/* stable merge sort of V using TMP as a buffer of the same size. */
+void merge_sort(lobj* v, lobj* tmp, unsigned len)
+{
+    unsigned mid = len / 2, i = 0, j = mid, k = 0;
+
+    if(len <= 8)
+    {
+        insertion_sort(v, len);
+        return;
+    }
+
+    merge_sort(v, tmp, mid);
+    merge_sort(v + mid, tmp, len - mid);
+
+    while(i < mid && j < len)
+        tmp[k++] = sort_less(v[j], v[i]) ? v[j++] : v[i++];
+    while(i < mid)
+        tmp[k++] = v[i++];
+    while(k--)
+        v[k] = tmp[k];
+}
+
+void sift_down(lobj* v, unsigned root, unsigned len)
+{
+    unsigned child;
+    lobj t;
+
+    while((child = root * 2 + 1) < len)
+    {
+        if(child + 1 < len && sort_less(v[child], v[child + 1]))
+            child++;
+        if(!sort_less(v[root], v[child]))
+            return;
+        t = v[root], v[root] = v[child], v[child] = t;
+        root = child;
+    }
+}
+
+void heap_sort(lobj* v, unsigned len)
+{
+    unsigned i;
+    lobj t;
+
+    for(i = len / 2; i--;)
+        sift_down(v, i, len);
+
+    for(i = len; --i;)
+    {
+        t = v[0], v[0] = v[i], v[i] = t;
+        sift_down(v, 0, i);
+    }
+}
+
+/* introsort: quicksort falling back to heapsort after DEPTH
+ * partitions, and to insertion sort for short ranges. */
+void intro_sort(lobj* v, unsigned len, unsigned depth)
+{
+    while(len > 16)
+    {
+        unsigned i = 0, j = len - 1, mid = (len - 1) / 2;
+        lobj pivot, t;
+
+        if(!depth--)
+        {
+            heap_sort(v, len);
+            return;
+        }
+
+        /* median of three */
+        if(sort_less(v[mid], v[0])) t = v[mid], v[mid] = v[0], v[0] = t;
+        if(sort_less(v[j], v[mid])) t = v[j], v[j] = v[mid], v[mid] = t;
+        if(sort_less(v[mid], v[0])) t = v[mid], v[mid] = v[0], v[0] = t;
+        pivot = v[mid];
+
+        /* hoare partition (bounded, for inconsistent predicates) */
+        while(1)
+        {
+            while(i < len - 1 && sort_less(v[i], pivot)) i++;
+            while(j > 0 && sort_less(pivot, v[j])) j--;
+            if(i >= j) break;
+            t = v[i], v[i] = v[j], v[j] = t;
+            i++, j--;
+        }
+        if(j >= len - 1) j = len - 2;
+
+        /* recurse into the shorter half */
+        if(j + 1 < len - j - 1)
+            intro_sort(v, j + 1, depth), v += j + 1, len -= j + 1;
+        else
+            intro_sort(v + j + 1, len - j - 1, depth), len = j + 1;
+    }
+
+    insertion_sort(v, len);
+}
+
+/* (sort SEQ [LESS]) => a sorted copy of SEQ, in which no element
+ * precedes an element LESS than it. LESS defaults to "<" on
+ * numbers. lists are merge-sorted (stable), and arrays are
+ * intro-sorted. */
+DEFSUBR(subr_sort, E, E)(lobj args)
+{
+    lobj seq = car(args), saved_pred = sort_pred, o = NIL;
+
+    sort_pred = cdr(args) ? car(cdr(args)) : NIL;
+
+    if(listp(seq))
+    {
+        lobj v = list_array(seq), tmp = make_array(array_length(v), NIL);
+        unsigned ix = array_length(v);
+
+        merge_sort(array_ptr(v), array_ptr(tmp), ix);
+
+        for(o = NIL; ix--;)
+            o = cons(array_ptr(v)[ix], o);
+    }
+
+    else if(arrayp(seq) || stringp(seq))
+    {
+        unsigned len = seq_length(seq), ix, depth;
+
+        o = make_array(len, NIL);
+        for(ix = 0; ix < len; ix++)
+            array_ptr(o)[ix] = seq_ref(seq, ix);
+
+        for(depth = 0, ix = len; ix; ix >>= 1)
+            depth += 2;
+
+        intro_sort(array_ptr(o), len, depth);
+    }
+
+    else
+        type_error("subr \"sort\"", 0, "sequence");
+
+    sort_pred = saved_pred;
+
+    return escaping() ? NIL : o;
+}
+
 /* + FUNCTION       ---------------- */
 
 /* (function? O) => O iff O is a function, partially-applied object or
  * a closure of function. () otherwise. */
 DEFSUBR(subr_functionp, E, _)(lobj args)
 {
-    return obj(car(args), functionp) || obj(car(args), pap) ? car(args) : NIL;
+    return obj(car(args), TYPE_FUNC) || obj(car(args), TYPE_PA) ? car(args) : NIL;
 }
 
 /* (fn ,FORMALS ,EXPR) => a function. */
@@ -744,12 +1448,12 @@ DEFSUBR(subr_fn, Q Q, _)(lobj args)
     else if(!consp(formals))    /* 0+ (eval) */
         return function(~0 << 8, formals, car(cdr(args)));
 
-    else if(car(formals) == intern("eval")) /* 0+ (quote) */
+    else if(car(formals) == SYM(EVAL)) /* 0+ (quote) */
     {
         lobj s = car(cdr(formals));
 
         if(!symbolp(s))
-            lisp_error("invalid syntax in subr \"fn\".");
+            return lisp_error("invalid syntax in subr \"fn\".");
 
         return function(256, s, car(cdr(args)));
     }
@@ -762,11 +1466,11 @@ DEFSUBR(subr_fn, Q Q, _)(lobj args)
 
         if(!consp(car(formals))) /* (x ...) */
             head = tail = cons(car(formals), NIL), pattern = 1, len = 1;
-        else if(car(car(formals)) == intern("eval") /* ((eval x) ...) */
+        else if(car(car(formals)) == SYM(EVAL) /* ((eval x) ...) */
                 && symbolp(car(cdr(car(formals)))))
             head = tail = cons(car(cdr(car(formals))), NIL), pattern = 0, len = 1;
         else
-            lisp_error("invalid syntax in subr \"fn\".");
+            return lisp_error("invalid syntax in subr \"fn\".");
 
         mask = 2, formals = cdr(formals);
         while(formals)
@@ -777,12 +1481,12 @@ DEFSUBR(subr_fn, Q Q, _)(lobj args)
                 return function((~0 << (9 + len)) | (pattern << 9) | 256 | len,
                                 head, car(cdr(args)));
             }
-            else if(car(formals) == intern("eval")) /* (eval x) */
+            else if(car(formals) == SYM(EVAL)) /* (eval x) */
             {
                 lobj s = car(cdr(formals));
 
                 if(!symbolp(s))
-                    lisp_error("invalid syntax in subr \"fn\".");
+                    return lisp_error("invalid syntax in subr \"fn\".");
 
                 setcdr(tail, s);
 
@@ -794,7 +1498,7 @@ DEFSUBR(subr_fn, Q Q, _)(lobj args)
                 tail = cdr(tail), pattern = pattern | (mask & ~0), len++;
                 mask <<= 1, formals = cdr(formals);
             }
-            else if(car(car(formals)) == intern("eval")       /* ((eval x) ...) */
+            else if(car(car(formals)) == SYM(EVAL)       /* ((eval x) ...) */
                     && symbolp(car(cdr(car(formals)))))
             {
                 setcdr(tail, cons(car(cdr(car(formals))), NIL));
@@ -802,30 +1506,79 @@ DEFSUBR(subr_fn, Q Q, _)(lobj args)
                 formals = cdr(formals);
             }
             else
-                lisp_error("invalid syntax in subr \"fn\".");
+                return lisp_error("invalid syntax in subr \"fn\".");
         }
 
         return function(pattern << 9 | len, head, car(cdr(args)));
     }
 }
 
+/* (lfn ,FORMALS ,EXPR) => a lexical function. FORMALS are same as
+ * "fn", but resolved to slots of a new scope when the function is
+ * made. EXPR sees the formals, "self" and the local bindings where
+ * the function is made, but not the ones of the caller. */
+DEFSUBR(subr_lfn, Q Q, _)(lobj args)
+{
+    lobj f = f_subr_fn(args), formals, o;
+    unsigned len, ix;
+
+    if(!f)
+        return NIL;
+
+    for(formals = function_formals(f), len = 0; consp(formals); formals = cdr(formals))
+        len++;
+
+    o = make_array(len + !!formals, NIL);
+
+    for(formals = function_formals(f), ix = 0; ix < len; formals = cdr(formals))
+        array_ptr(o)[ix++] = car(formals);
+    if(formals)
+        array_ptr(o)[ix] = formals;
+
+    o = lexical_function(function_args(f), o, function_expr(f), current_scope());
+
+    return o;
+}
+
 /* + CLOSURE        ---------------- */
 
 /* (closure? O) => O iff O is a function, or () otherwise. */
 DEFSUBR(subr_closurep, E, _)(lobj args) { return closurep(car(args)) ? car(args) : NIL; }
 
-/* (closure O) => make a closure of object O. O can be either a
- * function, symbol or pair. */
-DEFSUBR(subr_closure, E, _)(lobj args) /* *NOTE* PAs ARE NOT ACCEPTED */
+/* (closure O [ENV]) => make a closure of object O with environment
+ * ENV, or the current environment if ENV is omitted. O can be either
+ * a function, symbol or pair. */
+DEFSUBR(subr_closure, E, E)(lobj args) /* *NOTE* PAs ARE NOT ACCEPTED */
 {
     lobj o = car(args);
 
     if(!(functionp(o) || symbolp(o) || consp(o) || pap(o)))
-        type_error("subr \"closure\"", 0, "function, symbol nor pair");
+        return type_error("subr \"closure\"", 0, "function, symbol nor pair");
+    else if(cdr(args) && !environmentp(car(cdr(args))))
+        return type_error("subr \"closure\"", 1, "environment");
+    else if(cdr(args))
+        return closure(o, car(cdr(args)));
     else
         return closure(o, save_current_env(0));
 }
 
+/* (closure-environment CLOSURE) => the environment of CLOSURE. */
+DEFSUBR(subr_closure_environment, E, _)(lobj args)
+{
+    if(!closurep(car(args)))
+        return type_error("subr \"closure-environment\"", 0, "closure");
+    else
+        return closure_env(car(args));
+}
+
+/* (environment? O) => O iff O is an environment, or () otherwise. */
+DEFSUBR(subr_environmentp, E, _)(lobj args) { return environmentp(car(args)) ? car(args) : NIL; }
+
+/* (environment) => the current environment. the local bindings are
+ * shared with closures made here, and global bindings made later are
+ * not (like "closure"). */
+DEFSUBR(subr_environment, _, _)(lobj args) { unused(args); return save_current_env(0); }
+
 /* + C-FUNCTION     ---------------- */
 
 /* (subr? O) => O iff O is a subr (a compiled function), or ()
@@ -841,36 +1594,106 @@ DEFSUBR(subr_dlsubr, E, E)(lobj args)
     lsubr *ptr;
 
     if(!stringp(car(args)))
-        type_error("subr \"dlsubr\"", 0, "string");
+        return type_error("subr \"dlsubr\"", 0, "string");
 
-    if(!(h = dlopen(string_ptr(car(args)), RTLD_LAZY)))
+    if(!(h = dlopen(string_cstr(car(args)), RTLD_LAZY)))
     {
         if(cdr(cdr(args)))
-            return eval(cons(car(cdr(cdr(args))), /* *FIXME* RECURSIVE "eval" */
-                             cons(string("filed to load shared object."), NIL)),
-                        NIL);
+            return call_errorback(car(cdr(cdr(args))), "failed to load shared object.");
 
         else
-            lisp_error("failed to load shared object.");
+            return lisp_error("failed to load shared object.");
     }
 
     if(!stringp(car(cdr(args))))
-        type_error("subr \"dlsubr\"", 1, "string");
+        return type_error("subr \"dlsubr\"", 1, "string");
 
-    if(!(ptr = dlsym(h, string_ptr(car(cdr(args))))))
+    if(!(ptr = dlsym(h, string_cstr(car(cdr(args))))))
     {
         if(cdr(cdr(args)))
-            return eval(cons(car(cdr(cdr(args))), /* *FIXME* RECURSIVE "eval" */
-                             cons(string("filed to find symbol from shared object."), NIL)),
-                        NIL);
+            return call_errorback(car(cdr(cdr(args))), "failed to find symbol from shared object.");
 
         else
-            lisp_error("failed to find symbol from shared object.");
+            return lisp_error("failed to find symbol from shared object.");
     }
 
     return subr(*ptr);
 }
 
+/* list of modules (= shared objects) already loaded by "require" */
+typedef struct module_node *module_node;
+struct module_node { module_node next; void* handle; char* filename; };
+
+#define loaded_modules (current_interp->loaded_modules) /* per interpreter */
+
+void register_module(void* handle, char* filename)
+{
+    /* *NOTE* "malloc" USED HERE (modules are never unloaded) */
+    module_node m = (module_node)malloc(sizeof(struct module_node));
+    m->filename = strcpy((char*)malloc(strlen(filename) + 1), filename);
+    m->handle = handle, m->next = loaded_modules, loaded_modules = m;
+}
+
+/* (require FILENAME [ERRORBACK]) => load module FILENAME, bind all
+ * subrs it exports globally, run its init hook, and return
+ * FILENAME. a module is loaded only once. on failure, ERRORBACK is
+ * called with error message, or error if ERRORBACK is omitted. */
+DEFSUBR(subr_require, E, E)(lobj args)
+{
+    module_node m;
+    lmodule *mod;
+    lmodule_entry *e;
+    char *filename;
+    void *h;
+
+    if(!stringp(car(args)))
+        return type_error("subr \"require\"", 0, "string");
+    filename = string_cstr(car(args));
+
+    for(m = loaded_modules; m; m = m->next)
+        if(!strcmp(m->filename, filename))
+            return car(args);
+
+    if(!(h = dlopen(filename, RTLD_LAZY)))
+    {
+        if(cdr(args))
+            return call_errorback(car(cdr(args)), "failed to load shared object.");
+
+        else
+            return lisp_error("failed to load shared object.");
+    }
+
+    /* the same object may be required with another filename */
+    for(m = loaded_modules; m; m = m->next)
+        if(m->handle == h)
+        {
+            dlclose(h);         /* drop the extra reference */
+            register_module(h, filename);
+            return car(args);
+        }
+
+    if(!(mod = dlsym(h, MODULE_SYMBOL)))
+    {
+        dlclose(h);
+
+        if(cdr(args))
+            return call_errorback(car(cdr(args)), "failed to find module from shared object.");
+
+        else
+            return lisp_error("failed to find module from shared object.");
+    }
+
+    register_module(h, filename);
+
+    for(e = mod->entries; e->name; e++)
+        bind(intern(e->name), subr(*e->subr), 0);
+
+    if(mod->init)
+        mod->init();
+
+    return car(args);
+}
+
 /* + CONTINUATION   ---------------- */
 
 /* (continuation? O) => O iff O is a continuation object, or () otherwise. */
@@ -879,6 +1702,279 @@ DEFSUBR(subr_continuationp, E, _)(lobj args)
     return continuationp(car(args)) ? car(args) : NIL;
 }
 
+/* + THREAD         ---------------- */
+
+/* (thread? O) => O iff O is a thread, or () otherwise. */
+DEFSUBR(subr_threadp, E, _)(lobj args) { return threadp(car(args)) ? car(args) : NIL; }
+
+/* (spawn FUNC ARGS ...) => make a thread which applies ARGS to FUNC
+ * and return it. the thread starts when the current thread yields. */
+DEFSUBR(subr_spawn, E, E)(lobj args) { return spawn(car(args), cdr(args)); }
+
+/* (current-thread) => the thread running now. */
+DEFSUBR(subr_current_thread, _, _)(lobj args) { unused(args); return current_thread; }
+
+/* (channel? O) => O iff O is a channel, or () otherwise. */
+DEFSUBR(subr_channelp, E, _)(lobj args) { return channelp(car(args)) ? car(args) : NIL; }
+
+/* (channel) => a new empty channel. */
+DEFSUBR(subr_channel, _, _)(lobj args) { unused(args); return channel(); }
+
+/* (send CHANNEL O) => send O to CHANNEL, and return O. this never
+ * blocks, since channels have unlimited capacity. */
+DEFSUBR(subr_send, E E, _)(lobj args)
+{
+    if(!channelp(car(args)))
+        return type_error("subr \"send\"", 0, "channel");
+
+    channel_send(car(args), car(cdr(args)));
+
+    return car(cdr(args));
+}
+
+/* + PARALLEL       ---------------- */
+
+/* procedures run in the worker pool (see "pool.c"), which see the
+ * environment of the caller but must not modify shared bindings. */
+
+/* (pmap FUNC SEQ) => like "map", but apply FUNC to elements of SEQ in
+ * parallel. */
+DEFSUBR(subr_pmap, E E, _)(lobj args)
+{
+    lobj f = car(args), seq = car(cdr(args)), items, results, o = NIL;
+    unsigned len, ix;
+
+    if(listp(seq))
+        items = list_array(seq);
+    else if(arrayp(seq) || stringp(seq))
+    {
+        items = make_array(len = seq_length(seq), NIL);
+        for(ix = 0; ix < len; ix++)
+            array_ptr(items)[ix] = seq_ref(seq, ix);
+    }
+    else
+        return type_error("subr \"pmap\"", 1, "sequence");
+
+    results = make_array(len = array_length(items), NIL);
+    pool_map(f, items, results);
+
+    if(escaping() || !listp(seq))
+        return results;
+
+    for(ix = len; ix--;)
+        o = cons(array_ptr(results)[ix], o);
+
+    return o;
+}
+
+/* (future ,EXPR) => start evaluating EXPR in parallel, and return a
+ * future of the value. */
+DEFSUBR(subr_future, Q, _)(lobj args) { return pool_future(car(args)); }
+
+/* (future? O) => O iff O is a future, or () otherwise. */
+DEFSUBR(subr_futurep, E, _)(lobj args) { return futurep(car(args)) ? car(args) : NIL; }
+
+/* (touch FUTURE) => wait for the value of FUTURE and return it. */
+DEFSUBR(subr_touch, E, _)(lobj args)
+{
+    if(!futurep(car(args)))
+        return type_error("subr \"touch\"", 0, "future");
+
+    return pool_touch(car(args));
+}
+
+/* + GC             ---------------- */
+
+/* (gc) => collect the whole heap now, and return (). */
+DEFSUBR(subr_gc, _, _)(lobj args) { unused(args); gc_collect(); return NIL; }
+
+/* (gc-stats) => an alist of counters of the collector : "minor" and
+ * "major" are numbers of collections, "heap", "old" and "nursery" are
+ * sizes in KB, and "last-pause", "max-pause", "total-pause" and
+ * "pause-target" are times in microseconds. */
+DEFSUBR(subr_gc_stats, _, _)(lobj args)
+{
+    gc_stats st;
+    char *names[] = { "minor", "major", "heap", "old", "nursery",
+                      "last-pause", "max-pause", "total-pause", "pause-target" };
+    unsigned long values[9];
+    lobj o = NIL;
+    int ix;
+
+    unused(args);
+
+    gc_get_stats(&st);
+    values[0] = st.minor_count, values[1] = st.major_count;
+    values[2] = st.heap_size / 1024, values[3] = st.old_size / 1024;
+    values[4] = st.nursery_size / 1024;
+    values[5] = st.last_pause, values[6] = st.max_pause, values[7] = st.total_pause;
+    values[8] = st.pause_target;
+
+    for(ix = 8; ix >= 0; ix--)
+        o = cons(cons(intern(names[ix]), integer(values[ix])), o);
+
+    return o;
+}
+
+/* (gc-pause-target [USEC]) => set the target pause time of
+ * incremental marking to USEC microseconds, if given, and return the
+ * current target. */
+DEFSUBR(subr_gc_pause_target, _, E)(lobj args)
+{
+    gc_stats st;
+
+    if(args)
+    {
+        if(!integerp(car(args)) || integer_value(car(args)) <= 0)
+            return type_error("subr \"gc-pause-target\"", 0, "positive integer");
+        gc_set_pause_target(integer_value(car(args)));
+    }
+
+    gc_get_stats(&st);
+
+    return integer(st.pause_target);
+}
+
+/* + STATS          ---------------- */
+
+/* a counter as an integer, or a float if it does not fit in an int */
+lobj counter(unsigned long n) { return n <= INT_MAX ? integer(n) : floating((double)n); }
+
+/* (stats) => an alist of counters summed over all interpreters :
+ * "evals", "applies" and "rets" are transitions of the evaluator,
+ * "lookups" is the number of variable lookups and "lookup-steps" is
+ * the number of bindings scanned by them, "captures" is the number of
+ * continuations made, "alloc-bytes" is the size of objects allocated,
+ * and "allocs" is an alist of the numbers of objects allocated per
+ * type. "minor" and "major" are numbers of collections. */
+DEFSUBR(subr_stats, _, _)(lobj args)
+{
+    lstats st;
+    gc_stats gst;
+    lobj allocs = NIL;
+    int ix;
+
+    unused(args);
+
+    memset(&st, 0, sizeof(lstats));
+    interp_stats(&st);
+    gc_get_stats(&gst);
+
+    for(ix = NUM_TYPES - 1; ix >= 0; ix--)
+        if(st.allocs[ix])
+            allocs = cons(cons(intern(type_names[ix]), counter(st.allocs[ix])), allocs);
+
+    return list(10,
+                cons(intern("evals"), counter(st.evals)),
+                cons(intern("applies"), counter(st.applies)),
+                cons(intern("rets"), counter(st.rets)),
+                cons(intern("lookups"), counter(st.lookups)),
+                cons(intern("lookup-steps"), counter(st.lookup_steps)),
+                cons(intern("captures"), counter(st.captures)),
+                cons(intern("alloc-bytes"), counter(st.alloc_bytes)),
+                cons(intern("allocs"), allocs),
+                cons(intern("minor"), counter(gst.minor_count)),
+                cons(intern("major"), counter(gst.major_count)));
+}
+
+/* + PROFILER       ---------------- */
+
+/* (profile-start) => start sampling the chains of running functions every
+ * 1ms of CPU time (see "profile.c"), and return (). */
+DEFSUBR(subr_profile_start, _, _)(lobj args)
+{
+    unused(args);
+
+    if(profile_start())
+        return lisp_error("failed to start the profiler.");
+
+    return NIL;
+}
+
+/* (profile-stop FILE [FOLDED]) => stop the profiler, write the flat
+ * profile and the call graph to FILE (a filename or a stream), and
+ * return the number of samples. if FOLDED is non-(), write stacks in
+ * the folded format of flamegraph tools instead. */
+DEFSUBR(subr_profile_stop, E, E)(lobj args)
+{
+    FILE* f;
+    long samples;
+
+    if(streamp(car(args)))
+        f = stream_value(car(args));
+    else if(!stringp(car(args)))
+        return type_error("subr \"profile-stop\"", 0, "string or stream");
+    else if(!(f = fopen(string_cstr(car(args)), "w")))
+        return lisp_error("failed to open file.");
+
+    samples = profile_stop(f, cdr(args) && car(cdr(args)));
+
+    if(!streamp(car(args)))
+        fclose(f);
+
+    return integer(samples);
+}
+
+/* + TRACER         ---------------- */
+
+/* (trace-start FILE [SIZE]) => start recording transitions of the
+ * evaluator to a ring buffer of the last SIZE (defaults to 65536)
+ * records, which is written to FILE on errors or by "trace-dump".
+ * decode FILE with "bin/philisp-trace". return FILE. */
+DEFSUBR(subr_trace_start, E, E)(lobj args)
+{
+    unsigned size = TRACE_DEFAULT_SIZE;
+    ltracer* t;
+
+    if(!stringp(car(args)))
+        return type_error("subr \"trace-start\"", 0, "string");
+
+    if(cdr(args))
+    {
+        if(!integerp(car(cdr(args))) || integer_value(car(cdr(args))) <= 0)
+            return type_error("subr \"trace-start\"", 1, "positive integer");
+        size = integer_value(car(cdr(args)));
+    }
+
+    if(!(t = tracer_new(string_cstr(car(args)), size)))
+        return lisp_error("failed to allocate memory.");
+
+    if(current_interp->tracer)
+        tracer_free(current_interp->tracer);
+    current_interp->tracer = t;
+
+    return car(args);
+}
+
+/* (trace-stop) => stop recording, discarding records, and return (). */
+DEFSUBR(subr_trace_stop, _, _)(lobj args)
+{
+    unused(args);
+
+    if(current_interp->tracer)
+        tracer_free(current_interp->tracer);
+    current_interp->tracer = NULL;
+
+    return NIL;
+}
+
+/* (trace-dump [ERRORBACK]) => write records to the file given to
+ * "trace-start". return an unspecified non-() value. on failure,
+ * ERRORBACK is called with error message, or error if ERRORBACK is
+ * omitted. */
+DEFSUBR(subr_trace_dump, _, E)(lobj args)
+{
+    if(!current_interp->tracer || trace_dump(current_interp->tracer))
+    {
+        if(args)
+            return call_errorback(car(args), "failed to write the trace.");
+        else
+            return lisp_error("failed to write the trace.");
+    }
+
+    return symbol();
+}
+
 /* + EQUALITY       ---------------- */
 
 /* (eq O1 ...) => an unspecified non-() value if O1 ... are all the
@@ -913,19 +2009,19 @@ DEFSUBR(subr_char_eq, _, E)(lobj args)
     {
         char ch1, ch2;
         unsigned ix;
-        lobj last;
+        lobj last = args;
 
         if(characterp(car(args)))
             ch1 = character_value(car(args));
         else
-            type_error("subr \"char=\"", 0, "character");
+            return type_error("subr \"char=\"", 0, "character");
 
         for(ix = 1, args = cdr(args); args; ix++, args = cdr(args))
         {
             if(characterp(car(args)))
                 ch2 = character_value(car(args));
             else
-                type_error("subr \"char=\"", ix, "character");
+                return type_error("subr \"char=\"", ix, "character");
 
             if(ch1 != ch2) return NIL;
 
@@ -936,6 +2032,29 @@ DEFSUBR(subr_char_eq, _, E)(lobj args)
     }
 }
 
+/* (string=? STR1 ...) => last string if STR1 ... are all equal as
+ * strings, or () otherwise. if no strings are given, return an
+ * unspecified non-() value. */
+DEFSUBR(subr_string_eq, _, E)(lobj args)
+{
+    unsigned ix;
+    lobj last;
+
+    if(!args)                   /* no args */
+        return symbol();
+
+    for(ix = 0, last = NIL; args; ix++, last = car(args), args = cdr(args))
+    {
+        if(!stringp(car(args)))
+            return type_error("subr \"string=?\"", ix, "string");
+
+        if(last && !string_equal(last, car(args)))
+            return NIL;
+    }
+
+    return last;
+}
+
 /* (= NUM1 ...) => last number if NUM1 ... are all equal as numbers,
  * or () otherwise. if no numbers are given, return an unspecified
  * non-() value. */
@@ -955,23 +2074,25 @@ DEFSUBR(subr_print, E, _)(lobj args)
 
 /* (read [ERRORBACK]) => read an S-expression from input port. on
  * failure, ERRORBACK is called with error message, or error if
- * ERRORBACK is omitted. */
+ * ERRORBACK is omitted. other threads run until some input is
+ * available, but not while an S-expression split across lines is
+ * being read. */
 DEFSUBR(subr_read, _, E)(lobj args)
 {
     lobj val;
-    unused(args);
+
+    if(wait_input(subr_read, args, &val))
+        return val;
 
     val = read();
 
     if(last_parse_error)
     {
         if(args)
-            return eval(cons(car(args), /* *FIXME* RECURSIVE "eval" */
-                             cons(string(last_parse_error), NIL)),
-                        NIL);
+            return call_errorback(car(args), last_parse_error);
 
         else
-            lisp_error(last_parse_error);
+            return lisp_error(last_parse_error);
     }
 
     return val;
@@ -982,14 +2103,19 @@ DEFSUBR(subr_read, _, E)(lobj args)
 /* (quote ,O) => O. */
 DEFSUBR(subr_quote, Q, _)(lobj args) { return car(args); }
 
-/* (error MSG) => print MSG to error port and quit. */
-DEFSUBR(subr_error, E, _)(lobj args) { lisp_error(string_ptr(car(args))); }
+/* (error MSG) => raise an error with message MSG. the innermost
+ * ERRORBACK of "eval" is called with MSG. if there is none, print MSG
+ * and the stack to error port, evaluate pending AFTERs of
+ * "unwind-protect", and abandon the evaluation. */
+DEFSUBR(subr_error, E, _)(lobj args) { return lisp_error(string_cstr(car(args))); }
 
 /* + INITIALIZE     ---------------- */
 
 void subr_initialize()
 {
-    bind(intern("nil"), NIL, 0);
+    loaded_modules = NULL;
+
+    bind(SYM(NIL), NIL, 0);
     bind(intern("nil?"), subr(subr_nilp), 0);
     bind(intern("symbol?"), subr(subr_symbolp), 0);
     bind(intern("gensym"), subr(subr_gensym), 0);
@@ -1034,18 +2160,56 @@ void subr_initialize()
     bind(intern("aref"), subr(subr_aref), 0);
     bind(intern("aset!"), subr(subr_aset), 0);
     bind(intern("string?"), subr(subr_stringp), 0);
+    bind(intern("string-hash"), subr(subr_string_hash), 0);
+    bind(intern("intern-string"), subr(subr_intern_string), 0);
+    bind(intern("string-search"), subr(subr_string_search), 0);
+    bind(intern("substring"), subr(subr_substring), 0);
+    bind(intern("split-string"), subr(subr_split_string), 0);
+    bind(intern("join-string"), subr(subr_join_string), 0);
+    bind(intern("string->number"), subr(subr_string_to_number), 0);
+    bind(intern("number->string"), subr(subr_number_to_string), 0);
+    bind(intern("map"), subr(subr_map), 0);
+    bind(intern("for-each"), subr(subr_for_each), 0);
+    bind(intern("filter"), subr(subr_filter), 0);
+    bind(intern("reduce"), subr(subr_reduce), 0);
+    bind(intern("sort"), subr(subr_sort), 0);
     bind(intern("function?"), subr(subr_functionp), 0);
     bind(intern("fn"), subr(subr_fn), 0);
+    bind(intern("lfn"), subr(subr_lfn), 0);
     bind(intern("closure?"), subr(subr_closurep), 0);
     bind(intern("closure"), subr(subr_closure), 0);
+    bind(intern("closure-environment"), subr(subr_closure_environment), 0);
+    bind(intern("environment?"), subr(subr_environmentp), 0);
+    bind(intern("environment"), subr(subr_environment), 0);
     bind(intern("subr?"), subr(subr_subrp), 0);
     bind(intern("dlsubr"), subr(subr_dlsubr), 0);
+    bind(intern("require"), subr(subr_require), 0);
     bind(intern("continuation?"), subr(subr_continuationp), 0);
+    bind(intern("thread?"), subr(subr_threadp), 0);
+    bind(intern("spawn"), subr(subr_spawn), 0);
+    bind(intern("current-thread"), subr(subr_current_thread), 0);
+    bind(intern("channel?"), subr(subr_channelp), 0);
+    bind(intern("channel"), subr(subr_channel), 0);
+    bind(intern("send"), subr(subr_send), 0);
+    bind(intern("pmap"), subr(subr_pmap), 0);
+    bind(intern("future"), subr(subr_future), 0);
+    bind(intern("future?"), subr(subr_futurep), 0);
+    bind(intern("touch"), subr(subr_touch), 0);
+    bind(intern("gc"), subr(subr_gc), 0);
+    bind(intern("gc-stats"), subr(subr_gc_stats), 0);
+    bind(intern("gc-pause-target"), subr(subr_gc_pause_target), 0);
+    bind(intern("stats"), subr(subr_stats), 0);
+    bind(intern("profile-start"), subr(subr_profile_start), 0);
+    bind(intern("profile-stop"), subr(subr_profile_stop), 0);
+    bind(intern("trace-start"), subr(subr_trace_start), 0);
+    bind(intern("trace-stop"), subr(subr_trace_stop), 0);
+    bind(intern("trace-dump"), subr(subr_trace_dump), 0);
     bind(intern("eq?"), subr(subr_eq), 0);
     bind(intern("char="), subr(subr_char_eq), 0);
+    bind(intern("string=?"), subr(subr_string_eq), 0);
     bind(intern("="), subr(subr_num_eq), 0);
     bind(intern("print"), subr(subr_print), 0);
     bind(intern("read"), subr(subr_read), 0);
     bind(intern("error"), subr(subr_error), 0);
-    bind(intern("quote"), subr(subr_quote), 0);
+    bind(SYM(QUOTE), subr(subr_quote), 0);
 }
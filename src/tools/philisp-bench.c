@@ -0,0 +1,167 @@
+/* philisp-bench : run benchmark programs and report their costs */
+
+/*
+  usage: philisp-bench [-n RUNS] [-p PHILISP] FILE ...
+
+  run "PHILISP --stats FILE" RUNS times (default 5) for each FILE,
+  with stdout discarded, and print the median and the minimum of the
+  wall-clock time, the number of bytes allocated by the interpreter,
+  and the maximum resident set size. a run fails if PHILISP exits
+  with non-0 status.
+*/
+
+#define _DEFAULT_SOURCE         /* wait4 */
+
+#include <stdio.h>
+#include <stdlib.h>             /* atoi, qsort, exit */
+#include <string.h>             /* strcmp, strncmp, strrchr */
+#include <fcntl.h>              /* open */
+#include <unistd.h>             /* fork, dup2, exec, pipe */
+#include <sys/time.h>           /* gettimeofday */
+#include <sys/resource.h>       /* rusage */
+#include <sys/wait.h>           /* wait4 */
+
+#define MAX_RUNS 64
+
+typedef struct bench_run
+{
+    double msec;                /* wall-clock time */
+    unsigned long alloc_kb;     /* allocated by the interpreter */
+    long rss_kb;                /* maximum resident set size */
+} bench_run;
+
+char* philisp = "bin/philisp";
+
+void usage()
+{
+    fputs("usage: philisp-bench [-n RUNS] [-p PHILISP] FILE ...\n", stderr);
+    exit(2);
+}
+
+/* run PHILISP once on FILE. return non-0 on failure. */
+int run_once(char* file, bench_run* r)
+{
+    struct timeval start, end;
+    struct rusage ru;
+    int fds[2], status;
+    char line[256];
+    FILE* err;
+    pid_t pid;
+
+    if(pipe(fds) < 0)
+    {
+        perror("pipe");
+        return 1;
+    }
+
+    gettimeofday(&start, NULL);
+
+    if(!(pid = fork()))
+    {
+        int null = open("/dev/null", O_RDWR);
+
+        dup2(null, 0), dup2(null, 1), dup2(fds[1], 2);
+        close(null), close(fds[0]), close(fds[1]);
+        execl(philisp, philisp, "--stats", file, (char*)NULL);
+        perror(philisp);
+        _exit(127);
+    }
+
+    close(fds[1]);
+
+    if(pid < 0)
+    {
+        perror("fork");
+        close(fds[0]);
+        return 1;
+    }
+
+    /* scan the stats report, and show errors */
+    r->alloc_kb = 0;
+    err = fdopen(fds[0], "r");
+    while(fgets(line, sizeof(line), err))
+        if(!strncmp(line, "allocated", 9))
+            r->alloc_kb = strtoul(line + 9, NULL, 10);
+        else if(strstr(line, "ERROR") || !strncmp(line, "FATAL", 5)
+                || !strncmp(line, "cannot open", 11))
+            fprintf(stderr, "%s: %s", file, line);
+    fclose(err);
+
+    if(wait4(pid, &status, 0, &ru) < 0)
+    {
+        perror("wait4");
+        return 1;
+    }
+
+    gettimeofday(&end, NULL);
+
+    r->msec = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_usec - start.tv_usec) / 1e3;
+    r->rss_kb = ru.ru_maxrss;
+
+    if(WIFSIGNALED(status))
+        fprintf(stderr, "%s: killed by signal %d\n", file, WTERMSIG(status));
+
+    return !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+}
+
+int compare_msec(const void* a, const void* b)
+{
+    double x = ((bench_run*)a)->msec, y = ((bench_run*)b)->msec;
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+int main(int argc, char** argv)
+{
+    bench_run runs[MAX_RUNS];
+    int n = 5, failures = 0, i, ix;
+    long rss;
+    char *name, *dot;
+
+    for(i = 1; i < argc && argv[i][0] == '-'; i++)
+        if(!strcmp(argv[i], "-n") && i + 1 < argc)
+        {
+            if((n = atoi(argv[++i])) < 1 || n > MAX_RUNS)
+                usage();
+        }
+        else if(!strcmp(argv[i], "-p") && i + 1 < argc)
+            philisp = argv[++i];
+        else
+            usage();
+
+    if(i == argc)
+        usage();
+
+    printf("%-16s %10s %10s %12s %10s\n",
+           "benchmark", "median(ms)", "min(ms)", "alloc(KB)", "rss(KB)");
+
+    for(; i < argc; i++)
+    {
+        /* print the name without the directory and the extension */
+        name = strrchr(argv[i], '/') ? strrchr(argv[i], '/') + 1 : argv[i];
+        dot = strrchr(name, '.');
+        printf("%-16.*s ", dot ? (int)(dot - name) : (int)strlen(name), name);
+        fflush(stdout);
+
+        for(ix = 0, rss = 0; ix < n; ix++)
+        {
+            if(run_once(argv[i], &runs[ix]))
+                break;
+
+            if(runs[ix].rss_kb > rss)
+                rss = runs[ix].rss_kb;
+        }
+
+        if(ix < n)
+        {
+            printf("%10s\n", "FAILED");
+            failures++;
+            continue;
+        }
+
+        qsort(runs, n, sizeof(bench_run), compare_msec);
+        printf("%10.1f %10.1f %12lu %10ld\n",
+               runs[n / 2].msec, runs[0].msec, runs[n / 2].alloc_kb, rss);
+    }
+
+    return failures != 0;
+}
@@ -0,0 +1,87 @@
+/* philisp-trace : decode trace files written by "trace-dump" */
+
+/*
+  usage: philisp-trace [-g USEC] FILE
+
+  print records in FILE, one per line. with -g, print only records
+  which come USEC microseconds or more after the previous record (and
+  the previous record), to find latency spikes.
+*/
+
+#include "philisp.h"
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>             /* atof, exit */
+#include <string.h>             /* memcmp, strcmp */
+
+char* kind_names[] = { "eval", "ret ", "evls", "call", "schd" };
+
+void put_record(trace_record* r)
+{
+    printf("%10lu %14.3f  %s %5u  0x%lx\n",
+           r->step, r->time / 1000.0,
+           r->kind < sizeof(kind_names) / sizeof(char*) ? kind_names[r->kind] : "????",
+           r->depth, r->expr);
+}
+
+void usage()
+{
+    fputs("usage: philisp-trace [-g USEC] FILE\n", stderr);
+    exit(2);
+}
+
+int main(int argc, char** argv)
+{
+    FILE* f;
+    trace_header h;
+    trace_record r, prev;
+    double gap = -1;
+    unsigned long ix;
+    char *file = NULL;
+    int i;
+
+    for(i = 1; i < argc; i++)
+        if(!strcmp(argv[i], "-g") && i + 1 < argc)
+            gap = atof(argv[++i]) * 1000;
+        else if(!file)
+            file = argv[i];
+        else
+            usage();
+
+    if(!file)
+        usage();
+
+    if(!(f = fopen(file, "rb")))
+    {
+        fprintf(stderr, "cannot open %s\n", file);
+        return 1;
+    }
+
+    if(fread(&h, sizeof(h), 1, f) != 1 || memcmp(h.magic, TRACE_MAGIC, 4)
+       || h.version != TRACE_VERSION || h.record_size != sizeof(trace_record))
+    {
+        fprintf(stderr, "%s is not a trace of this build\n", file);
+        return 1;
+    }
+
+    printf("# %lu records (%lu older ones dropped)\n", h.count, h.dropped);
+    printf("#     step      time(us)  kind depth  expr\n");
+
+    for(ix = 0; ix < h.count && fread(&r, sizeof(r), 1, f) == 1; ix++)
+    {
+        if(gap < 0)
+            put_record(&r);
+        else if(ix && r.time - prev.time >= gap)
+        {
+            put_record(&prev), put_record(&r);
+            printf("#   %.3f us\n", (r.time - prev.time) / 1000.0);
+        }
+
+        prev = r;
+    }
+
+    fclose(f);
+
+    return 0;
+}
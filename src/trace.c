@@ -0,0 +1,113 @@
+#define _POSIX_C_SOURCE 200112L /* clock_gettime */
+
+#include "philisp.h"
+#include "trace.h"
+
+#include <stdlib.h>             /* malloc, free */
+#include <string.h>             /* memcpy, strlen, strcpy */
+#include <time.h>               /* clock_gettime, clock */
+
+/* a tracer records transitions of an interpreter to a ring buffer of
+ * SIZE records, which is written to FILE on demand (or on errors, see
+ * "core.c"). tracers are per interpreter, so no locks are needed. */
+struct ltracer
+{
+    trace_record *ring;
+    unsigned size;
+    unsigned long count;        /* records written so far */
+    unsigned long start;        /* time when the tracer started */
+    lobj last_stack, last_next; /* callstack of the last record, and its cdr */
+    unsigned last_depth;
+    char* file;
+};
+
+/* monotonic time in nanoseconds */
+unsigned long trace_now()
+{
+  #ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+  #endif
+  #ifndef CLOCK_MONOTONIC
+    return (unsigned long)((double)clock() / CLOCKS_PER_SEC * 1e9);
+  #endif
+}
+
+/* make a tracer which keeps the last SIZE records, and dumps them to
+ * FILE. return NULL on failure. */
+ltracer* tracer_new(char* file, unsigned size)
+{
+    ltracer *t;
+
+    if(!size || !(t = (ltracer*)malloc(sizeof(ltracer))))
+        return NULL;
+
+    t->ring = (trace_record*)malloc(sizeof(trace_record) * size);
+    t->file = (char*)malloc(strlen(file) + 1);
+
+    if(!t->ring || !t->file)
+    {
+        free(t->ring), free(t->file), free(t);
+        return NULL;
+    }
+
+    strcpy(t->file, file);
+    t->size = size, t->count = 0, t->start = trace_now();
+    t->last_stack = t->last_next = NIL, t->last_depth = 0;
+
+    return t;
+}
+
+void tracer_free(ltracer* t)
+{
+    free(t->ring), free(t->file), free(t);
+}
+
+/* record a transition of KIND, with EXPR in EAX and STACK as the
+ * callstack. the depth is tracked from the last record, since most
+ * transitions push, pop or replace just one frame. (the last
+ * callstack may be dead now, so it is never dereferenced) */
+void trace_point(ltracer* t, unsigned kind, lobj expr, lobj stack)
+{
+    trace_record *r = &t->ring[t->count % t->size];
+    lobj s;
+
+    if(stack != t->last_stack)
+    {
+        if(stack && cdr(stack) == t->last_stack)
+            t->last_depth++;
+        else if(t->last_stack && stack == t->last_next)
+            t->last_depth--;
+        else if(!(stack && t->last_stack && cdr(stack) == t->last_next))
+            for(t->last_depth = 0, s = stack; s; s = cdr(s))
+                t->last_depth++;
+
+        t->last_stack = stack, t->last_next = stack ? cdr(stack) : NIL;
+    }
+
+    r->step = t->count++, r->time = trace_now() - t->start;
+    r->expr = (unsigned long)expr, r->depth = t->last_depth, r->kind = kind;
+}
+
+/* write records in the ring to the file of T. return non-0 on
+ * failure. */
+int trace_dump(ltracer* t)
+{
+    trace_header h;
+    unsigned long n = t->count < t->size ? t->count : t->size, ix;
+    FILE* f;
+
+    if(!(f = fopen(t->file, "wb")))
+        return 1;
+
+    memcpy(h.magic, TRACE_MAGIC, 4);
+    h.version = TRACE_VERSION, h.record_size = sizeof(trace_record);
+    h.count = n, h.dropped = t->count - n;
+    fwrite(&h, sizeof(h), 1, f);
+
+    for(ix = t->count - n; ix < t->count; ix++)
+        fwrite(&t->ring[ix % t->size], sizeof(trace_record), 1, f);
+
+    return fclose(f) != 0;
+}